@@ -0,0 +1,121 @@
+//
+//  arena.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+typedef struct chunk_t {
+    struct chunk_t *next;   // sll, newest first
+    size_t size;            // usable bytes after the header
+    size_t used;
+} chunk_t;
+
+#define CHUNK_HEADER ((sizeof(chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_t
+{
+    chunk_t *chunks;
+    size_t chunksize;
+    size_t used;            // handed out, for reporting
+};
+
+static chunk_t *newchunk(arena_t *arena, size_t size)
+{
+    chunk_t *c = malloc(CHUNK_HEADER + size);
+    if (!c)
+    {
+        fprintf(stderr, "Out of memory growing arena.\n");
+        exit(-1);
+    }
+    c->size = size;
+    c->used = 0;
+    c->next = arena->chunks;
+    arena->chunks = c;
+    return c;
+}
+
+arena_t *arena_new(size_t chunksize)
+{
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    arena->chunksize = chunksize ? chunksize : 64 * 1024;
+    return arena;
+}
+
+//
+// size zeroed bytes, aligned for anything. Never fails.
+//
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    chunk_t *c = arena->chunks;
+    if (!c || c->size - c->used < size)
+    {
+        if (size > arena->chunksize / 4)
+        {
+            // big arrays get a chunk of their own, behind the current
+            // one so its free space isn't wasted
+            chunk_t *big = newchunk(arena, size);
+            if (c)
+            {
+                arena->chunks = c;
+                big->next = c->next;
+                c->next = big;
+            }
+            c = big;
+        }
+        else
+        {
+            c = newchunk(arena, arena->chunksize);
+        }
+    }
+
+    void *p = (char *)c + CHUNK_HEADER + c->used;
+    c->used += size;
+    arena->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void *arena_array(arena_t *arena, size_t count, size_t size)
+{
+    if (size && count > (size_t)-1 / size)
+    {
+        fprintf(stderr, "Arena array of %zu too big.\n", count);
+        exit(-1);
+    }
+    return arena_alloc(arena, count * size);
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+size_t arena_used(const arena_t *arena)
+{
+    return arena->used;
+}
+
+//
+// Frees everything allocated from the arena, and the arena.
+//
+void arena_free(arena_t *arena)
+{
+    while (arena->chunks)
+    {
+        chunk_t *c = arena->chunks;
+        arena->chunks = c->next;
+        free(c);
+    }
+    free(arena);
+}
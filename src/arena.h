@@ -0,0 +1,23 @@
+//
+//  arena.h
+//
+//  Bump allocator. Everything loaded from the config (servers, their
+//  camera and event arrays, prebuilt strings) comes out of one arena,
+//  laid out back to back, and goes with a single arena_free().
+//
+
+#ifndef ARENA_H
+  #define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_t arena_t;
+
+arena_t *arena_new(size_t chunksize);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_array(arena_t *arena, size_t count, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+size_t arena_used(const arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif
@@ -0,0 +1,716 @@
+//
+//  bench.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sunspy.h"
+#include "sunriset.h"
+#include "sunbatch.h"
+#include "solar.h"
+#include "scheduler.h"
+#include "loop.h"
+#include "http.h"
+#include "bench.h"
+#include "timeexpr.h"
+#include "arena.h"
+
+// from sunspy.c
+extern double lat, lon, tz;
+extern bool verbose;
+extern float version;
+void calc_sunrise_sunset(time_t tt);
+mstime_t evaltime(const timeexpr_t *te);
+mstime_t convertTime(time_t day, double hour);
+extern arena_t *configarena;
+void addcamera(camera_t *cameras, unsigned *count, const char *name, unsigned number, const char *start, const char *stop);
+server_t *addserver(const char *name, const char *url, const char *user, const char *password, camera_t *cameras, unsigned numcameras);
+void prepareserver(server_t *sv);
+void queuecameras(server_t *sv);
+typedef struct fleet_t fleet_t;
+extern fleet_t *fleet;
+fleet_t *newfleet(void);
+void releasefleet(fleet_t *f);
+extern server_t *serverlist;
+extern unsigned numservers;
+extern unsigned simulatedays;
+unsigned long simulate(FILE *f);
+
+#define BENCH_REPS      10      // timed runs per microbenchmark, for the stddev
+#define BENCH_RESULTS   64
+
+// Every result, for the json report.
+typedef struct
+{
+    char name[48];
+    double nsop;
+    double stddev;
+} benchresult_t;
+
+static benchresult_t results[BENCH_RESULTS];
+static unsigned nresults = 0;
+
+// How far the fast solar engine is from noaa, for the json report.
+#define BENCH_LATITUDES 12
+typedef struct
+{
+    double latitude;        // either side of the equator
+    double p50, p99, max;   // seconds, rise, noon and set
+    unsigned mismatched;    // days one has a polar day or night and the other doesn't
+    unsigned count;
+} accuracy_t;
+
+static accuracy_t accuracy[BENCH_LATITUDES];
+static unsigned naccuracy = 0;
+static FILE *out;               // the table, stderr when stdout is json
+static volatile double sink;    // keeps results from being optimized away
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(const char *name, double nsop, double stddev)
+{
+    if (nresults == BENCH_RESULTS)
+        return;
+    snprintf(results[nresults].name, sizeof(results[nresults].name), "%s", name);
+    results[nresults].nsop = nsop;
+    results[nresults].stddev = stddev;
+    nresults++;
+}
+
+//
+// Mean and standard deviation of the BENCH_REPS runs, printed and recorded.
+//
+static void report(const char *name, const double *samples)
+{
+    double mean = 0, var = 0;
+    for (unsigned r = 0; r < BENCH_REPS; r++)
+        mean += samples[r];
+    mean /= BENCH_REPS;
+    for (unsigned r = 0; r < BENCH_REPS; r++)
+        var += (samples[r] - mean) * (samples[r] - mean);
+    double stddev = sqrt(var / (BENCH_REPS - 1));
+
+    fprintf(out, "%-24s %9.1f ns/op  +/- %6.1f  %9.3f Mops/s\n", name, mean, stddev, 1e3 / mean);
+    record(name, mean, stddev);
+}
+
+// Runs body iters times, BENCH_REPS times over, with i the iteration.
+#define MEASURE(name, iters, body)                                  \
+    do {                                                            \
+        double samples[BENCH_REPS];                                 \
+        for (unsigned r = 0; r < BENCH_REPS; r++)                   \
+        {                                                           \
+            double t0 = now();                                      \
+            for (unsigned i = 0; i < (iters); i++)                  \
+            {                                                       \
+                body;                                               \
+            }                                                       \
+            samples[r] = (now() - t0) * 1e9 / (iters);              \
+        }                                                           \
+        report(name, samples);                                      \
+    } while (0)
+
+//
+// Inserts n events spread over a year, then fires n events the way
+// camloop() does: take the earliest and push it back out a day.
+//
+static void bench_scheduler(unsigned n)
+{
+    camevent_t *events = calloc(n, sizeof(camevent_t));
+    mstime_t base = 1380000000000LL;
+    srand(n);
+
+    double t0 = now();
+    for (unsigned i = 0; i < n; i++)
+    {
+        events[i].action = (i & 1) ? CAM_ACTION_PASSIVE : CAM_ACTION_ACTIVE;
+        events[i].camera = i;
+        events[i].starttime = base + (rand() % (365*24*60)) * 60000LL;
+        sched_add(&events[i]);
+    }
+    double t1 = now();
+    for (unsigned i = 0; i < n; i++)
+    {
+        camevent_t *e = sched_peek();
+        sched_reschedule(e, e->starttime + 24*60*60*1000LL);
+    }
+    double t2 = now();
+
+    fprintf(out, "scheduler %8u events  insert %7.1f ns/op %6.2f Mops/s  fire %7.1f ns/op %6.2f Mops/s\n",
+           n, (t1 - t0) * 1e9 / n, n / (t1 - t0) / 1e6, (t2 - t1) * 1e9 / n, n / (t2 - t1) / 1e6);
+    char name[48];
+    sprintf(name, "scheduler_insert_%u", n);
+    record(name, (t1 - t0) * 1e9 / n, 0);
+    sprintf(name, "scheduler_fire_%u", n);
+    record(name, (t2 - t1) * 1e9 / n, 0);
+
+    sched_clear();
+    free(events);
+}
+
+//
+// A fleet of ncams cameras on one server, the way main() and a worker
+// handle it: load the cameras and lay out their urls and events in the
+// config arena, queue every event, walk them all, then free the lot.
+//
+static void bench_fleet(unsigned ncams)
+{
+    arena_t *savedarena = configarena;
+    bool wasverbose = verbose;
+    verbose = false;
+    calc_sunrise_sunset(1388534400);
+
+    double t0 = now();
+    configarena = arena_new(0);
+    server_t *sv = arena_alloc(configarena, sizeof(server_t));
+    sv->name = sv->url = "http://127.0.0.1:8000";
+    sv->user = sv->password = "bench";
+    sv->cameras = arena_array(configarena, ncams, sizeof(camera_t));
+    for (unsigned i = 0; i < ncams; i++)
+        addcamera(sv->cameras, &sv->numcameras, "bench", i, "sunrise-30m", "sunset+30m");
+    prepareserver(sv);
+    double t1 = now();
+    queuecameras(sv);
+    double t2 = now();
+    for (unsigned i = 0; i < sv->numcameras * 2; i++)
+        sink += sv->camevents[i].starttime + sv->camevents[i].url[0];
+    double t3 = now();
+    size_t bytes = arena_used(configarena);
+    sched_clear();
+    arena_free(configarena);
+    double t4 = now();
+
+    fprintf(out, "fleet     %8u cameras  load %6.1f ns  queue %6.1f ns  walk %5.1f ns  free %5.1f ns per camera  %zu bytes\n",
+            ncams, (t1 - t0) * 1e9 / ncams, (t2 - t1) * 1e9 / ncams, (t3 - t2) * 1e9 / ncams, (t4 - t3) * 1e9 / ncams, bytes);
+    char name[48];
+    sprintf(name, "fleet_load_%u", ncams);
+    record(name, (t1 - t0) * 1e9 / ncams, 0);
+    sprintf(name, "fleet_queue_%u", ncams);
+    record(name, (t2 - t1) * 1e9 / ncams, 0);
+    sprintf(name, "fleet_free_%u", ncams);
+    record(name, (t4 - t3) * 1e9 / ncams, 0);
+
+    configarena = savedarena;
+    verbose = wasverbose;
+}
+
+//
+// nsites random sites over ndays days, one at a time through sunriset()
+// and then through each sunriset_batch() kernel, checking the batch
+// results against sunriset().
+//
+static void bench_sunbatch(unsigned nsites, unsigned ndays)
+{
+    unsigned n = nsites * ndays;
+    double *lat = malloc(n * sizeof(double)), *lon = malloc(n * sizeof(double));
+    double *angle = malloc(n * sizeof(double));
+    unsigned int *day = malloc(n * sizeof(unsigned int));
+    double *rise = malloc(n * sizeof(double)), *noon = malloc(n * sizeof(double));
+    double *set = malloc(n * sizeof(double));
+    DayType *type = malloc(n * sizeof(DayType));
+    sunrise_t *ref = malloc(n * sizeof(sunrise_t));
+    const double angles[] = { TWILIGHT_ANGLE_DAYLIGHT, TWILIGHT_ANGLE_CIVIL, TWILIGHT_ANGLE_NAUTICAL, TWILIGHT_ANGLE_ASTRONOMICAL };
+    srand(n);
+
+    // day major, the way a fleet schedule gets built
+    for (unsigned d = 0; d < ndays; d++)
+    {
+        for (unsigned i = 0; i < nsites; i++)
+        {
+            unsigned k = d * nsites + i;
+            srand(i * 7919 + 1);
+            lat[k] = rand() / (double)RAND_MAX * 180.0 - 90.0;
+            lon[k] = rand() / (double)RAND_MAX * 360.0 - 180.0;
+            angle[k] = angles[rand() % 4];
+            day[k] = 5000 + d;
+        }
+    }
+
+    sun_dayterms_flush();
+    double t0 = now();
+    for (unsigned k = 0; k < n; k++)
+    {
+        ref[k].latitude = lat[k];
+        ref[k].longitude = lon[k];
+        ref[k].daysSince2000 = day[k];
+        ref[k].twilightAngle = angle[k];
+        sunriset(&ref[k]);
+    }
+    double t1 = now();
+    unsigned long hits, misses;
+    sun_dayterms_stats(&hits, &misses);
+    fprintf(out, "sunriset  %8u sites x %u days  scalar  %7.1f ns/op  day cache %lu hits %lu misses\n",
+           nsites, ndays, (t1 - t0) * 1e9 / n, hits, misses);
+    record("sunriset_loop", (t1 - t0) * 1e9 / n, 0);
+
+    sunbatch_t b = { n, lat, lon, day, angle, rise, noon, set, type };
+    for (SunbatchIsa isa = SUNBATCH_SCALAR; isa <= SUNBATCH_AVX2; isa++)
+    {
+        if (sunbatch_isa(isa) != isa)
+            continue;
+        t0 = now();
+        sunriset_batch(&b);
+        t1 = now();
+
+        double maxerr = 0;
+        unsigned mismatched = 0;
+        for (unsigned k = 0; k < n; k++)
+        {
+            if (type[k] != ref[k].dayType)
+            {
+                mismatched++;
+                continue;
+            }
+            maxerr = fmax(maxerr, fabs(noon[k] - ref[k].noonTime));
+            if (type[k] == DAYTYPE_NORMAL)
+                maxerr = fmax(maxerr, fmax(fabs(rise[k] - ref[k].riseTime), fabs(set[k] - ref[k].setTime)));
+        }
+        fprintf(out, "sunbatch  %8u sites x %u days  %-7s %7.1f ns/op  max error %.3gs, %u day type mismatches%s\n",
+               nsites, ndays, sunbatch_isaname(isa), (t1 - t0) * 1e9 / n, maxerr * 3600, mismatched,
+               (maxerr > SUNBATCH_MAX_ERROR) ? "  ** OUT OF TOLERANCE **" : "");
+        char name[48];
+        sprintf(name, "sunbatch_%s", sunbatch_isaname(isa));
+        record(name, (t1 - t0) * 1e9 / n, 0);
+    }
+    sunbatch_isa(SUNBATCH_AUTO);
+
+    free(lat); free(lon); free(angle); free(day);
+    free(rise); free(noon); free(set); free(type); free(ref);
+}
+
+static int cmpdouble(const void *a, const void *b);
+
+//
+// How far apart the solar engines are, with noaa taken as right: every
+// third day of every tenth year this century, both hemispheres, a few
+// longitudes and every twilight. One row per latitude, and the worst
+// sunrise or sunset at or below 60 degrees by year, to show whether the
+// fast engine drifts with time; the maxima above are twilights that only
+// just happen, where a small error in the sun's position is a big one in
+// time.
+//
+static void bench_solaraccuracy()
+{
+    const double lats[BENCH_LATITUDES] = { 0, 10, 20, 30, 40, 50, 55, 60, 65, 70, 75, 80 };
+    const double lons[] = { -150, -75, 0, 75, 150 };
+    const double angles[] = { TWILIGHT_ANGLE_DAYLIGHT, TWILIGHT_ANGLE_CIVIL, TWILIGHT_ANGLE_NAUTICAL, TWILIGHT_ANGLE_ASTRONOMICAL };
+    const unsigned nlons = sizeof(lons) / sizeof(lons[0]);
+    const unsigned firstyear = 2000, lastyear = 2100, yearstep = 10;
+    const unsigned nyears = (lastyear - firstyear) / yearstep + 1;
+    double byyear[nyears];
+    memset(byyear, 0, sizeof(byyear));
+
+    unsigned maxerrs = 2 * nlons * 4 * 3 * 122 * nyears;
+    double *errs = malloc(maxerrs * sizeof(double));
+    fprintf(out, "\nfast vs noaa, seconds   p50      p99      max   polar day/night mismatches\n");
+    naccuracy = 0;
+    for (unsigned l = 0; l < BENCH_LATITUDES; l++)
+    {
+        accuracy_t *acc = &accuracy[naccuracy++];
+        memset(acc, 0, sizeof(*acc));
+        acc->latitude = lats[l];
+        unsigned nerrs = 0;
+
+        for (unsigned y = 0; y < nyears; y++)
+        {
+            unsigned first = daysSince2000(firstyear + y * yearstep, 1, 1);
+            for (unsigned d = 0; d < 365; d += 3)
+                for (int hemi = -1; hemi <= 1; hemi += 2)
+                    for (unsigned o = 0; o < nlons; o++)
+                        for (unsigned a = 0; a < 4; a++)
+                        {
+                            sunrise_t fast, noaa;
+                            memset(&fast, 0, sizeof(fast));
+                            fast.latitude = hemi * lats[l];
+                            fast.longitude = lons[o];
+                            fast.daysSince2000 = first + d;
+                            fast.twilightAngle = angles[a];
+                            noaa = fast;
+                            solar_riset(SOLAR_FAST, &fast);
+                            solar_riset(SOLAR_NOAA, &noaa);
+
+                            acc->count++;
+                            if (fast.dayType != noaa.dayType)
+                            {
+                                acc->mismatched++;
+                                continue;
+                            }
+                            double err = fabs(fast.noonTime - noaa.noonTime);
+                            if (fast.dayType == DAYTYPE_NORMAL)
+                                err = fmax(err, fmax(fabs(fast.riseTime - noaa.riseTime), fabs(fast.setTime - noaa.setTime)));
+                            err *= 3600;
+                            errs[nerrs++] = err;
+                            if (lats[l] <= 60 && angles[a] == TWILIGHT_ANGLE_DAYLIGHT)
+                                byyear[y] = fmax(byyear[y], err);
+                        }
+        }
+
+        qsort(errs, nerrs, sizeof(double), cmpdouble);
+        if (nerrs)
+        {
+            acc->p50 = errs[nerrs / 2];
+            acc->p99 = errs[(unsigned)(nerrs * 0.99)];
+            acc->max = errs[nerrs - 1];
+        }
+        fprintf(out, "  latitude +/-%2.0f     %8.1f %8.1f %8.1f   %u of %u\n",
+                acc->latitude, acc->p50, acc->p99, acc->max, acc->mismatched, acc->count);
+    }
+    free(errs);
+
+    fprintf(out, "  worst sunrise/set to 60 degrees by year:");
+    for (unsigned y = 0; y < nyears; y++)
+        fprintf(out, "%s %u %.0fs", y ? "," : "", firstyear + y * yearstep, byyear[y]);
+    fprintf(out, "\n\n");
+}
+
+typedef struct
+{
+    int fd;
+    mockserver_t *ms;
+    volatile bool started;      // copied, the accepting thread can go on
+} mockconn_t;
+
+static void *mockconn(void *arg)
+{
+    mockconn_t c = *(mockconn_t *)arg;
+    ((mockconn_t *)arg)->started = true;
+    const char *body = c.ms->body ? c.ms->body : "ok";
+    char resp[128];
+    sprintf(resp, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n\r\n", c.ms->status,
+            c.ms->status == 200 ? "OK" : "Not OK", strlen(body));
+    char buf[4096];
+    size_t len = 0;
+    ssize_t n;
+
+    while ((n = read(c.fd, buf + len, sizeof(buf) - len - 1)) > 0)
+    {
+        len += n;
+        buf[len] = 0;
+        char *end;
+        while ((end = strstr(buf, "\r\n\r\n")))
+        {
+            unsigned active = __sync_add_and_fetch(&c.ms->active, 1);
+            unsigned max;
+            while ((max = c.ms->maxactive) < active && !__sync_bool_compare_and_swap(&c.ms->maxactive, max, active))
+                ;
+            if (c.ms->delayms)
+                usleep(c.ms->delayms * 1000);
+            // before the reply, the next request can't come until it's read
+            __sync_sub_and_fetch(&c.ms->active, 1);
+            __sync_add_and_fetch(&c.ms->served, 1);
+            if (write(c.fd, resp, strlen(resp)) < 0 || write(c.fd, body, strlen(body)) < 0)
+                len = 0;
+            end += 4;
+            len -= end - buf;
+            memmove(buf, end, len + 1);
+        }
+        if (len == sizeof(buf) - 1)
+            len = 0;
+    }
+    close(c.fd);
+    return NULL;
+}
+
+static void *mockaccept(void *arg)
+{
+    mockserver_t *ms = arg;
+    int fd;
+    while ((fd = accept(ms->fd, NULL, NULL)) >= 0)
+    {
+        // handed over on the stack, a heap call here would count against
+        // the client being tested
+        mockconn_t c = { fd, ms, false };
+        pthread_t t;
+        if (pthread_create(&t, NULL, mockconn, &c))
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(t);
+        while (!c.started)
+            usleep(100);
+    }
+    return NULL;
+}
+
+//
+// Starts ms on a free loopback port, answering every request with
+// status after delayms. It runs until the process exits. The body is
+// "ok" unless ms->body is set, which can be changed between requests.
+//
+void mockstart(mockserver_t *ms, unsigned delayms, int status)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    memset(ms, 0, sizeof(*ms));
+    ms->delayms = delayms;
+    ms->status = status;
+    ms->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ms->fd < 0 || bind(ms->fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(ms->fd, 64))
+    {
+        perror("sunspy: mock server");
+        exit(-1);
+    }
+    getsockname(ms->fd, (struct sockaddr *)&addr, &len);
+    ms->port = ntohs(addr.sin_port);
+
+    pthread_t t;
+    pthread_create(&t, NULL, mockaccept, ms);
+    pthread_detach(t);
+}
+
+// One server's worker, the way camloop() runs them: its own loop and
+// curl multi, all of its events due at once.
+typedef struct
+{
+    char url[64];
+    unsigned count;
+    double elapsed;     // until the last of its requests completed
+} benchworker_t;
+
+static void benchdone(httpreq_t *req, void *userdata)
+{
+    (*(unsigned *)userdata)--;
+}
+
+static void *benchworker(void *arg)
+{
+    benchworker_t *w = arg;
+    httpreq_t *reqs = calloc(w->count, sizeof(httpreq_t));
+    loop_t *loop = loop_new();
+    http_setloop(loop);
+
+    unsigned remaining = w->count;
+    double t0 = now();
+    for (unsigned i = 0; i < w->count; i++)
+    {
+        reqs[i].url = w->url;
+        reqs[i].userpwd = "bench:bench";
+        http_submit(&reqs[i], benchdone, &remaining);
+    }
+    while (remaining)
+        loop_once(loop, -1);
+    w->elapsed = now() - t0;
+
+    free(reqs);
+    return NULL;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//
+// nservers mock servers with ncams cameras each all flipping at once.
+// The first server takes slowms to answer, the rest answer right away;
+// the fast servers' times shouldn't depend on it or on how many there are.
+//
+static void bench_servers(unsigned nservers, unsigned ncams, unsigned slowms)
+{
+    mockserver_t *ms = calloc(nservers, sizeof(mockserver_t));
+    benchworker_t *w = calloc(nservers, sizeof(benchworker_t));
+    pthread_t *threads = calloc(nservers, sizeof(pthread_t));
+    double *fast = calloc(nservers, sizeof(double));
+
+    for (unsigned i = 0; i < nservers; i++)
+    {
+        mockstart(&ms[i], i == 0 ? slowms : 0, 200);
+        sprintf(w[i].url, "http://127.0.0.1:%u/++ssControlActiveMode?cameraNum=1", ms[i].port);
+        w[i].count = ncams;
+    }
+
+    double t0 = now();
+    for (unsigned i = 0; i < nservers; i++)
+        pthread_create(&threads[i], NULL, benchworker, &w[i]);
+    for (unsigned i = 0; i < nservers; i++)
+        pthread_join(threads[i], NULL);
+    double t1 = now();
+
+    for (unsigned i = 1; i < nservers; i++)
+        fast[i - 1] = w[i].elapsed;
+    qsort(fast, nservers - 1, sizeof(double), cmpdouble);
+    fprintf(out, "servers   %8u x %u cameras  all %7.1f ms  slow server %7.1f ms  others p50 %6.1f ms max %6.1f ms\n",
+           nservers, ncams, (t1 - t0) * 1e3, w[0].elapsed * 1e3,
+           nservers > 1 ? fast[(nservers - 1) / 2] * 1e3 : 0, nservers > 1 ? fast[nservers - 2] * 1e3 : 0);
+    char name[48];
+    sprintf(name, "servers_%u_slow", nservers);     // per request
+    record(name, w[0].elapsed * 1e9 / ncams, 0);
+    if (nservers > 1)
+    {
+        sprintf(name, "servers_%u_others_p50", nservers);
+        record(name, fast[(nservers - 1) / 2] * 1e9 / ncams, 0);
+    }
+
+    // the mock servers stay up, their ports just go unused
+    free(fast);
+    free(threads);
+    free(w);
+}
+
+//
+// The solar math, time parsing and event queue calls one at a time.
+//
+static void bench_micro()
+{
+    const unsigned n = 100000;
+    double RA, dec, dist;
+    time_t base = 1388534400;   // 2014-01-01
+
+    MEASURE("daysSince2000", n, sink += daysSince2000(2000 + i % 50, 1 + i % 12, 1 + i % 28));
+    MEASURE("GMST0", n, sink += GMST0(5000.0 + i * 0.37));
+    MEASURE("sun_RA_dec", n, sun_RA_dec(5000.0 + i * 0.37, &RA, &dec, &dist); sink += RA);
+
+    sunrise_t sr;
+    memset(&sr, 0, sizeof(sr));
+    sr.twilightAngle = TWILIGHT_ANGLE_CIVIL;
+    for (SolarEngine engine = 0; engine < NUM_SOLAR_ENGINES; engine++)
+    {
+        char name[48];
+        sprintf(name, "solar_%s", solar_name(engine));
+        MEASURE(name, n,
+                sr.latitude = (i * 7919) % 180 - 90.0;
+                sr.longitude = (i * 104729) % 360 - 180.0;
+                sr.daysSince2000 = 5000 + i % 365;
+                solar_riset(engine, &sr); sink += sr.riseTime);
+    }
+
+    MEASURE("convertTime", n, sink += convertTime(base + (i % 365) * 86400, (i % 240) / 10.0));
+
+    bool wasverbose = verbose;
+    verbose = false;
+    MEASURE("calc_sunrise_sunset", n / 10, calc_sunrise_sunset(base + (i % 365) * 86400));
+
+    const char *times[] = { "sunrise", "sunset-30m", "noon+2h", "sunrise-1h", "+6h", "sunset+1h30m" };
+    timeexpr_t te[6];
+    MEASURE("timeexpr_parse", n, timeexpr_parse(times[i % 6], &te[i % 6]); sink += te[i % 6].offset);
+    calc_sunrise_sunset(base);
+    MEASURE("evaltime", n, sink += evaltime(&te[i % 6]));
+    verbose = wasverbose;
+
+    // add and remove against a queue that already holds a fleet's worth
+    const unsigned queued = 10000;
+    camevent_t *events = calloc(queued + 1, sizeof(camevent_t));
+    for (unsigned i = 0; i < queued; i++)
+    {
+        events[i].starttime = base * 1000LL + (rand() % (365*24*60)) * 60000LL;
+        sched_add(&events[i]);
+    }
+    camevent_t *e = &events[queued];
+    MEASURE("sched_add+sched_remove", n,
+            e->starttime = base * 1000LL + (i * 7919 % (365*24*60)) * 60000LL;
+            sched_add(e); sched_remove(e));
+    sched_clear();
+    free(events);
+}
+
+//
+// ndays of ncams cameras on random sun relative schedules, through
+// --simulate: jump to each event, fire everything due with it and
+// reschedule, no sleeping or HTTP.
+//
+static void bench_simulate(unsigned ncams, unsigned ndays)
+{
+    const char *anchors[] = { "sunrise", "sunset", "noon" };
+    double savelat = lat, savelon = lon, savetz = tz;
+    unsigned savedays = simulatedays;
+
+    lat = 48.5; lon = 9.0; tz = 1.0;
+    srand(ncams);
+    newfleet();
+    camera_t *cams = arena_array(configarena, ncams, sizeof(camera_t));
+    unsigned count = 0;
+    for (unsigned i = 0; i < ncams; i++)
+    {
+        char start[24], stop[24];
+        sprintf(start, "%s%+dm", anchors[rand() % 3], rand() % 181 - 90);
+        sprintf(stop, "%s%+dm", anchors[rand() % 3], rand() % 181 - 90);
+        addcamera(cams, &count, "bench", i, arena_strdup(configarena, start), arena_strdup(configarena, stop));
+    }
+    server_t *sv = addserver("bench", "http://127.0.0.1:8000", "bench", "bench", cams, count);
+    prepareserver(sv);
+
+    simulatedays = ndays;
+    double t0 = now();
+    unsigned long anomalies = simulate(out);
+    double t1 = now();
+
+    fprintf(out, "simulate  %8u cameras x %u days  %lu events  %7.1f ms  %7.1f ns/event  %lu not once a day\n",
+            ncams, ndays, sv->events, (t1 - t0) * 1e3, (t1 - t0) * 1e9 / sv->events, anomalies);
+    char name[48];
+    sprintf(name, "simulate_%u_cameras", ncams);
+    record(name, (t1 - t0) * 1e9 / sv->events, 0);
+
+    releasefleet(fleet);
+    fleet = NULL;
+    serverlist = NULL;
+    numservers = 0;
+    simulatedays = savedays;
+    lat = savelat; lon = savelon; tz = savetz;
+}
+
+static void writejson(FILE *f)
+{
+    fprintf(f, "{\n  \"version\": %.1f,\n  \"results\": [\n", version);
+    for (unsigned i = 0; i < nresults; i++)
+        fprintf(f, "    { \"name\": \"%s\", \"ns_per_op\": %.3f, \"stddev_ns\": %.3f, \"ops_per_sec\": %.1f }%s\n",
+                results[i].name, results[i].nsop, results[i].stddev,
+                results[i].nsop > 0 ? 1e9 / results[i].nsop : 0, i + 1 < nresults ? "," : "");
+    fprintf(f, "  ],\n  \"solar_accuracy\": [\n");
+    for (unsigned i = 0; i < naccuracy; i++)
+        fprintf(f, "    { \"engine\": \"fast\", \"reference\": \"noaa\", \"latitude\": %.0f, \"p50_s\": %.1f, "
+                "\"p99_s\": %.1f, \"max_s\": %.1f, \"daytype_mismatches\": %u, \"samples\": %u }%s\n",
+                accuracy[i].latitude, accuracy[i].p50, accuracy[i].p99, accuracy[i].max,
+                accuracy[i].mismatched, accuracy[i].count, i + 1 < naccuracy ? "," : "");
+    fprintf(f, "  ]\n}\n");
+}
+
+//
+// Runs everything, printing a table, or with json the table goes to
+// stderr and stdout gets the results for regression tracking.
+//
+void runbenchmarks(bool json)
+{
+    out = json ? stderr : stdout;
+
+    bench_micro();
+    bench_solaraccuracy();
+    bench_scheduler(10000);
+    bench_scheduler(100000);
+    bench_scheduler(1000000);
+    bench_fleet(10000);
+    bench_fleet(100000);
+    bench_sunbatch(1000, 365);
+    bench_servers(1, 50, 500);
+    bench_servers(4, 50, 500);
+    bench_servers(16, 50, 500);
+    bench_servers(64, 50, 500);
+    bench_simulate(1000, 365);
+    bench_simulate(10000, 365);
+
+    if (json)
+        writejson(stdout);
+}
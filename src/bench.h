@@ -0,0 +1,31 @@
+//
+//  bench.h
+//
+//  Built-in benchmarks, run with --benchmark, or --benchmark=json for
+//  machine readable results.
+//
+
+#ifndef BENCH_H
+  #define BENCH_H
+
+#include "sunspy.h"
+
+// A stand in SecuritySpy server on a loopback port, for the benchmarks
+// and tests. A thread per connection, keep-alive, counting what's being
+// answered at once.
+typedef struct
+{
+    int fd;
+    unsigned port;
+    unsigned delayms;
+    int status;                     // http code every request gets
+    const char *volatile body;      // what it says, "ok" when NULL
+    volatile unsigned active;       // requests being answered
+    volatile unsigned maxactive;    // the most there have been at once
+    volatile unsigned served;
+} mockserver_t;
+
+void runbenchmarks(bool json);
+void mockstart(mockserver_t *ms, unsigned delayms, int status);
+
+#endif
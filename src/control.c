@@ -0,0 +1,355 @@
+//
+//  control.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "sunspy.h"
+#include "timer.h"
+#include "timeexpr.h"
+#include "scheduler.h"
+#include "listener.h"
+#include "control.h"
+
+#define CONTROL_LINE_MAX    512     // longest command accepted
+#define CONTROL_OUT_MAX     65536   // drop clients that don't read their replies
+#define CONTROL_NEXT        10      // events listed by "next" on its own
+#define CONTROL_NEXT_MAX    100
+
+typedef struct
+{
+    char in[CONTROL_LINE_MAX];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outalloc;
+} client_t;
+
+static server_t *ctlservers = NULL;
+static listener_t listener;
+
+static void freeclient(void *conn)
+{
+    free(((client_t *)conn)->out);
+}
+
+static void reply(client_t *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void reply(client_t *c, const char *fmt, ...)
+{
+    char line[CONTROL_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (len > (int)sizeof(line) - 2)
+        len = sizeof(line) - 2;
+    line[len++] = '\n';
+
+    if (c->outlen + len > c->outalloc)
+    {
+        c->outalloc = c->outalloc ? c->outalloc * 2 : 1024;
+        while (c->outalloc < c->outlen + len)
+            c->outalloc *= 2;
+        c->out = realloc(c->out, c->outalloc);
+    }
+    memcpy(c->out + c->outlen, line, len);
+    c->outlen += len;
+}
+
+// timer_str() without its newline
+static char *timestr(mstime_t t, char *dest)
+{
+    timer_str(t, dest);
+    dest[strlen(dest) - 1] = 0;
+    return dest;
+}
+
+static server_t *findserver(const char *name)
+{
+    for (server_t *sv = ctlservers; sv; sv = sv->next)
+        if (!strcmp(sv->name, name))
+            return sv;
+    return NULL;
+}
+
+//
+// active|passive|pause|resume <server> [camera|all]
+//
+static void order(client_t *c, OrderType type)
+{
+    char *name = strtok(NULL, " \t");
+    char *which = strtok(NULL, " \t");
+    if (!name || (!which && (type == ORDER_ACTIVE || type == ORDER_PASSIVE)))
+    {
+        reply(c, "error usage: %s <server> <camera|all>",
+              type == ORDER_ACTIVE ? "active" : type == ORDER_PASSIVE ? "passive"
+              : type == ORDER_PAUSE ? "pause" : "resume");
+        return;
+    }
+    server_t *sv = findserver(name);
+    if (!sv)
+    {
+        reply(c, "error no server '%s'", name);
+        return;
+    }
+
+    long camera = ORDER_ALL;
+    if (which && strcmp(which, "all"))
+    {
+        char *end;
+        camera = strtol(which, &end, 10);
+        unsigned i = 0;
+        if (end != which && !*end && camera >= 0)
+            while (i < sv->numcameras && sv->cameras[i].number != camera)
+                i++;
+        if (end == which || *end || camera < 0 || i == sv->numcameras)
+        {
+            reply(c, "error %s has no camera '%s'", sv->name, which);
+            return;
+        }
+    }
+
+    if (postorder(sv, type, camera))
+        reply(c, "ok sent to %s", sv->name);
+    else
+        reply(c, "error %s isn't running", sv->name);
+}
+
+// An event as listnext() saw it.
+typedef struct
+{
+    mstime_t when;
+    const server_t *server;
+    unsigned camera;
+    unsigned action;
+} nextevent_t;
+
+//
+// next [count], the soonest events across all the servers. Read from
+// what the workers last scheduled, without waiting on them: each
+// event's slot and time are loaded once, atomically, as the scheduler
+// stores them, and only that copy is used.
+//
+static void listnext(client_t *c)
+{
+    char *arg = strtok(NULL, " \t");
+    int count = arg ? atoi(arg) : CONTROL_NEXT;
+    if (count < 1 || count > CONTROL_NEXT_MAX)
+    {
+        reply(c, "error count must be 1 to %d", CONTROL_NEXT_MAX);
+        return;
+    }
+
+    // insertion sort into the count soonest
+    nextevent_t soonest[CONTROL_NEXT_MAX];
+    int found = 0;
+    for (server_t *sv = ctlservers; sv; sv = sv->next)
+        for (unsigned i = 0; i < sv->numcameras * 2; i++)
+        {
+            const camevent_t *e = &sv->camevents[i];
+            if (__atomic_load_n(&e->slot, __ATOMIC_RELAXED) == SCHED_NONE)
+                continue;
+            mstime_t when = __atomic_load_n(&e->starttime, __ATOMIC_RELAXED);
+            if (!when)
+                continue;
+            int at = found < count ? found++ : count;
+            while (at > 0 && soonest[at - 1].when > when)
+            {
+                if (at < count)
+                    soonest[at] = soonest[at - 1];
+                at--;
+            }
+            if (at < count)
+                soonest[at] = (nextevent_t){ when, sv, e->camera, e->action };
+        }
+
+    reply(c, "ok %d", found);
+    for (int i = 0; i < found; i++)
+    {
+        char str[40];
+        const nextevent_t *n = &soonest[i];
+        reply(c, "%lld %s #%u %s %s", n->when, n->server->name, n->camera,
+              n->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE", timestr(n->when, str));
+    }
+}
+
+//
+// sun, the times calc_sunrise_sunset() last worked out.
+//
+static void listsun(client_t *c)
+{
+    mstime_t today[NUM_ANCHORS], tomorrow[NUM_ANCHORS];
+    unsigned used;
+    mstime_t reference = suntimes(today, tomorrow, &used);
+
+    int n = 0;
+    for (int a = 0; a < NUM_ANCHORS; a++)
+        n += a != ANCHOR_CLOCK && (used & (1 << a));
+    if (!reference)
+    {
+        reply(c, "error not worked out yet");
+        return;
+    }
+
+    reply(c, "ok %d", n);
+    for (int a = 0; a < NUM_ANCHORS; a++)
+    {
+        if (a == ANCHOR_CLOCK || !(used & (1 << a)))
+            continue;
+        char t1[40], t2[40];
+        reply(c, "%s %s / %s", timeexpr_anchorname(a), timestr(today[a], t1), timestr(tomorrow[a], t2));
+    }
+}
+
+static void command(client_t *c, char *line)
+{
+    char *cmd = strtok(line, " \t");
+    if (!cmd)
+        return;
+
+    if (!strcmp(cmd, "status"))
+    {
+        // the workers own their queues, this is what they last published
+        unsigned nservers = 0, queued = 0, inflight = 0, waiting = 0, down = 0, paused = 0;
+        unsigned long events = 0, requests = 0, allocs = 0, retries = 0, trips = 0, fixed = 0;
+        mstime_t nextevent = 0;
+        for (server_t *sv = ctlservers; sv; sv = sv->next)
+        {
+            nservers++;
+            queued += sv->queued;
+            inflight += sv->inflight;
+            events += sv->events;
+            requests += sv->requests;
+            allocs += sv->allocs;
+            retries += sv->retries;
+            waiting += sv->waiting;
+            trips += sv->trips;
+            down += sv->breakeropen;
+            fixed += sv->reconciled;
+            paused += sv->paused;
+            if (sv->nextevent && (!nextevent || sv->nextevent < nextevent))
+                nextevent = sv->nextevent;
+        }
+
+        char next[40] = "none";
+        if (nextevent)
+            timestr(nextevent, next);
+        reply(c, "ok servers=%u events=%u inflight=%u sent=%lu saved=%lu buffers=%lu armed=%lldms "
+              "retries=%lu waiting=%u trips=%lu down=%u fixed=%lu paused=%u next=%s",
+              nservers, queued, inflight, requests, events - requests, allocs, timer_armed(),
+              retries, waiting, trips, down, fixed, paused, next);
+    }
+    else if (!strcmp(cmd, "help"))
+    {
+        reply(c, "ok commands: status next sun active passive pause resume help");
+    }
+    else if (!strcmp(cmd, "next"))
+        listnext(c);
+    else if (!strcmp(cmd, "sun"))
+        listsun(c);
+    else if (!strcmp(cmd, "active"))
+        order(c, ORDER_ACTIVE);
+    else if (!strcmp(cmd, "passive"))
+        order(c, ORDER_PASSIVE);
+    else if (!strcmp(cmd, "pause"))
+        order(c, ORDER_PAUSE);
+    else if (!strcmp(cmd, "resume"))
+        order(c, ORDER_RESUME);
+    else
+    {
+        reply(c, "error unknown command '%s'", cmd);
+    }
+}
+
+static void onclient(loop_t *loop, int fd, unsigned events, void *userdata)
+{
+    client_t *c = listener_conn(&listener, fd);
+
+    if (events & LOOP_READ)
+    {
+        ssize_t n = read(fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            listener_drop(&listener, fd);
+            return;
+        }
+        if (n > 0)
+            c->inlen += n;
+
+        // run every complete line
+        char *eol;
+        while ((eol = memchr(c->in, '\n', c->inlen)))
+        {
+            *eol = 0;
+            if (eol > c->in && eol[-1] == '\r')
+                eol[-1] = 0;
+            command(c, c->in);
+            size_t used = eol + 1 - c->in;
+            memmove(c->in, eol + 1, c->inlen - used);
+            c->inlen -= used;
+        }
+        if (c->inlen == sizeof(c->in))
+        {
+            reply(c, "error line too long");
+            c->inlen = 0;
+        }
+    }
+
+    if (c->outlen)
+    {
+        ssize_t n = write(fd, c->out, c->outlen);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            listener_drop(&listener, fd);
+            return;
+        }
+        if (n > 0)
+        {
+            memmove(c->out, c->out + n, c->outlen - n);
+            c->outlen -= n;
+        }
+    }
+    if (c->outlen > CONTROL_OUT_MAX)
+    {
+        listener_drop(&listener, fd);
+        return;
+    }
+    loop_watch(loop, fd, LOOP_READ | (c->outlen ? LOOP_WRITE : 0), onclient, NULL);
+}
+
+//
+// Listens on a unix domain socket at path, replacing any stale one.
+// Reports on the given servers.
+//
+bool control_open(loop_t *loop, const char *path, server_t *servers)
+{
+    int fd = listener_unix(path, "Control");
+    if (fd < 0)
+        return false;
+    ctlservers = servers;
+    listener_start(&listener, loop, fd, path, sizeof(client_t), onclient, freeclient);
+    return true;
+}
+
+//
+// Servers to report on from now on, after a config reload.
+//
+void control_setservers(server_t *servers)
+{
+    ctlservers = servers;
+}
+
+void control_close()
+{
+    listener_close(&listener);
+}
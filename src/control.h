@@ -0,0 +1,43 @@
+//
+//  control.h
+//
+//  Local control socket. A unix domain socket served from the event loop
+//  with a one command per line protocol; every command gets a single
+//  "ok ..." or "error ..." line back, except that "ok N" from a query is
+//  followed by N lines of results.
+//
+//    active|passive <server> <camera|all>  send it now
+//    pause|resume <server> [camera|all]    stop or start sending its events
+//    next [count]                          upcoming events, soonest first
+//    sun                                   the sun times in use
+//
+//  Orders go to the server's worker through its mailbox and are carried
+//  out there; queries only read what the workers publish, so neither
+//  waits on them.
+//
+
+#ifndef CONTROL_H
+  #define CONTROL_H
+
+#include "sunspy.h"
+#include "loop.h"
+
+// What a worker can be told to do, see postorder().
+typedef enum
+{ ORDER_ACTIVE  = CAM_ACTION_ACTIVE
+, ORDER_PASSIVE = CAM_ACTION_PASSIVE
+, ORDER_PAUSE   = 3
+, ORDER_RESUME  = 4
+} OrderType;
+
+#define ORDER_ALL   -1      // every camera on the server
+
+// In sunspy.c
+bool postorder(server_t *sv, OrderType order, long camera);
+mstime_t suntimes(mstime_t *today, mstime_t *tomorrow, unsigned *used);
+
+bool control_open(loop_t *loop, const char *path, server_t *servers);
+void control_setservers(server_t *servers);
+void control_close(void);
+
+#endif
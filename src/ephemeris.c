@@ -0,0 +1,181 @@
+//
+//  ephemeris.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sunspy.h"
+#include "sunriset.h"
+#include "sunbatch.h"
+#include "ephemeris.h"
+
+static const double twilightangles[EPH_NUM_TWILIGHT] = {
+    TWILIGHT_ANGLE_DAYLIGHT, TWILIGHT_ANGLE_CIVIL, TWILIGHT_ANGLE_NAUTICAL, TWILIGHT_ANGLE_ASTRONOMICAL
+};
+
+static const ephheader_t *eph = NULL;   // the mapped file
+static size_t ephsize = 0;
+
+// Same site if it's within ~10m, the table is only good to the second anyway.
+#define SAMESITE(a, b) (fabs((a) - (b)) < 0.0001)
+
+static int32_t toseconds(double hours)
+{
+    return (int32_t)floor(hours * 3600.0);
+}
+
+//
+// Computes the table with sunriset_batch() and writes it out.
+//
+bool ephemeris_write(const char *path, double lat, double lon, unsigned firstday, unsigned ndays)
+{
+    unsigned n = ndays * EPH_NUM_TWILIGHT;
+    double *lats = malloc(n * sizeof(double)), *lons = malloc(n * sizeof(double));
+    double *angles = malloc(n * sizeof(double));
+    unsigned int *days = malloc(n * sizeof(unsigned int));
+    double *rise = malloc(n * sizeof(double)), *noon = malloc(n * sizeof(double));
+    double *set = malloc(n * sizeof(double));
+    DayType *type = malloc(n * sizeof(DayType));
+    ephrecord_t *records = malloc(n * sizeof(ephrecord_t));
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        lats[i] = lat;
+        lons[i] = lon;
+        days[i] = firstday + i / EPH_NUM_TWILIGHT;
+        angles[i] = twilightangles[i % EPH_NUM_TWILIGHT];
+    }
+
+    sunbatch_t b = { n, lats, lons, days, angles, rise, noon, set, type };
+    sunriset_batch(&b);
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        records[i].rise = toseconds(rise[i]);
+        records[i].noon = toseconds(noon[i]);
+        records[i].set = toseconds(set[i]);
+        records[i].dayType = type[i];
+    }
+
+    ephheader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EPH_MAGIC, sizeof(header.magic));
+    header.version = EPH_VERSION;
+    header.firstday = firstday;
+    header.ndays = ndays;
+    header.ntwilight = EPH_NUM_TWILIGHT;
+    header.latitude = lat;
+    header.longitude = lon;
+
+    // write to the side and rename, so running daemons never map half a file
+    char *tmppath = malloc(strlen(path) + 5);
+    sprintf(tmppath, "%s.tmp", path);
+
+    bool ok = false;
+    FILE *f = fopen(tmppath, "wb");
+    if (f)
+    {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1
+          && fwrite(records, sizeof(ephrecord_t), n, f) == n;
+        ok = (fclose(f) == 0) && ok;
+        ok = ok && rename(tmppath, path) == 0;
+        if (!ok)
+            unlink(tmppath);
+    }
+    if (!ok)
+        fprintf(stderr, "Failed to write ephemeris file %s\n", path);
+
+    free(tmppath);
+    free(lats); free(lons); free(angles); free(days);
+    free(rise); free(noon); free(set); free(type); free(records);
+    return ok;
+}
+
+//
+// Maps the table. Returns false, and leaves lookups disabled, if the file
+// is missing or isn't one of ours.
+//
+bool ephemeris_open(const char *path)
+{
+    ephemeris_close();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ephheader_t))
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    const ephheader_t *h = p;
+    if (memcmp(h->magic, EPH_MAGIC, sizeof(h->magic)) || h->version != EPH_VERSION
+        || h->ntwilight != EPH_NUM_TWILIGHT
+        || (size_t)st.st_size < sizeof(ephheader_t) + (size_t)h->ndays * EPH_NUM_TWILIGHT * sizeof(ephrecord_t))
+    {
+        fprintf(stderr, "Ignoring %s, not a valid ephemeris file.\n", path);
+        munmap(p, st.st_size);
+        return false;
+    }
+
+    eph = h;
+    ephsize = st.st_size;
+    return true;
+}
+
+void ephemeris_close()
+{
+    if (eph)
+        munmap((void *)eph, ephsize);
+    eph = NULL;
+    ephsize = 0;
+}
+
+//
+// Fills in sr from the table if it covers this site, day and twilight angle.
+// sr->daysSince2000 and sr->twilightAngle must be set.
+//
+bool ephemeris_lookup(sunrise_t *sr, double lat, double lon)
+{
+    if (!eph || !SAMESITE(lat, eph->latitude) || !SAMESITE(lon, eph->longitude))
+        return false;
+    if (sr->daysSince2000 < eph->firstday || sr->daysSince2000 - eph->firstday >= eph->ndays)
+        return false;
+
+    unsigned t = 0;
+    while (t < EPH_NUM_TWILIGHT && sr->twilightAngle != twilightangles[t])
+        t++;
+    if (t == EPH_NUM_TWILIGHT)
+        return false;
+
+    const ephrecord_t *r = (const ephrecord_t *)(eph + 1)
+                         + (sr->daysSince2000 - eph->firstday) * EPH_NUM_TWILIGHT + t;
+    // middle of the stored second, so flooring to the minute later on
+    // lands where the unrounded time would have
+    sr->dayType = r->dayType;
+    sr->noonTime = (r->noon + 0.5) / 3600.0;
+    if (sr->dayType == DAYTYPE_NORMAL)
+    {
+        sr->riseTime = (r->rise + 0.5) / 3600.0;
+        sr->setTime = (r->set + 0.5) / 3600.0;
+    }
+    else
+    {
+        sr->riseTime = NOT_SET;
+        sr->setTime = NOT_SET;
+    }
+    return true;
+}
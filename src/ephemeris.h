@@ -0,0 +1,48 @@
+//
+//  ephemeris.h
+//
+//  Precomputed rise/noon/set table for one site, written once with
+//  --makeephemeris and mmap()ed read-only by every daemon on the host,
+//  so they share the pages instead of each redoing the solar math.
+//
+//  File layout, native byte order:
+//      ephheader_t
+//      ephrecord_t[ndays][EPH_NUM_TWILIGHT]
+//
+
+#ifndef EPHEMERIS_H
+  #define EPHEMERIS_H
+
+#include <stdint.h>
+#include "sunspy.h"
+
+#define EPH_MAGIC         "SUNSPYEP"
+#define EPH_VERSION       1
+#define EPH_NUM_TWILIGHT  4     // daylight, civil, nautical, astronomical
+#define EPH_DEFAULT_DAYS  800   // a bit over two years
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t firstday;      // daysSince2000 of the first row
+    uint32_t ndays;
+    uint32_t ntwilight;
+    double latitude;        // Degrees -S/N
+    double longitude;       // Degrees E/-W
+} ephheader_t;
+
+typedef struct
+{
+    int32_t rise;           // seconds GMT, NOT_SET hours when there's no rise
+    int32_t noon;
+    int32_t set;
+    int32_t dayType;
+} ephrecord_t;
+
+bool ephemeris_write(const char *path, double lat, double lon, unsigned firstday, unsigned ndays);
+bool ephemeris_open(const char *path);
+void ephemeris_close(void);
+bool ephemeris_lookup(sunrise_t *sr, double lat, double lon);
+
+#endif
@@ -0,0 +1,446 @@
+//
+//  http.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "sunspy.h"
+#include "loop.h"
+#include "log.h"
+#include "http.h"
+
+// Pooled handles, found by the scheme://host:port part of the url. A server
+// gets more than one handle only when requests to it run concurrently.
+typedef struct httpconn_t {
+    char *server;
+    CURL *crl;
+    bool busy;               // checked out by a request in flight
+    char *userpwd;           // copy of the credentials last set on crl
+    httpreq_t *req;          // the async request using it
+    struct httpconn_t *next; // sll
+} httpconn_t;
+
+static httpconn_t *pool = NULL;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+
+static CURLSH *share = NULL;
+static pthread_mutex_t sharelocks[CURL_LOCK_DATA_LAST];
+
+static __thread CURLM *multi = NULL;    // async requests, see http_submit()
+
+static void sharelock(CURL *crl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&sharelocks[data]);
+}
+
+static void shareunlock(CURL *crl, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&sharelocks[data]);
+}
+
+//
+// place holder fuction to keep curl from writing to stdout
+//
+size_t curlwritebogus(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    return size*nmemb;
+}
+
+//
+// Hands the reply to an async request that wants it.
+//
+static size_t onbody(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    httpconn_t *c = userdata;
+    if (c->req && c->req->body)
+        c->req->body(ptr, size * nmemb, c->req->userdata);
+    return size * nmemb;
+}
+
+//
+// Sets up curl and the share handle. Safe to call more than once.
+//
+void http_init()
+{
+    if (share)
+        return;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&sharelocks[i], NULL);
+
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, sharelock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, shareunlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+//
+// Closes all pooled connections.
+//
+void http_cleanup()
+{
+    http_threadcleanup();
+
+    pthread_mutex_lock(&poollock);
+    while (pool)
+    {
+        httpconn_t *c = pool;
+        pool = c->next;
+        curl_easy_cleanup(c->crl);
+        free(c->server);
+        free(c->userpwd);
+        free(c);
+    }
+    pthread_mutex_unlock(&poollock);
+
+    if (share)
+    {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+}
+
+//
+// Length of the scheme://host:port prefix of url.
+//
+static size_t serverlen(const char *url)
+{
+    const char *p = strstr(url, "://");
+    p = p ? p + 3 : url;
+    p += strcspn(p, "/?#");
+    return p - url;
+}
+
+//
+// Checks out an idle pooled handle for the server in url, creating one if
+// they're all busy. Give it back with releasehandle().
+//
+static CURL *gethandle(const char *url)
+{
+    size_t len = serverlen(url);
+    CURL *crl = NULL;
+
+    pthread_mutex_lock(&poollock);
+    for (httpconn_t *c = pool; c; c = c->next)
+    {
+        if (!c->busy && strlen(c->server) == len && !strncmp(c->server, url, len))
+        {
+            c->busy = true;
+            crl = c->crl;
+            break;
+        }
+    }
+
+    if (!crl)
+    {
+        http_init();
+
+        httpconn_t *c = malloc(sizeof(httpconn_t));
+        c->server = strndup(url, len);
+        c->crl = crl = curl_easy_init();
+        c->busy = true;
+        c->userpwd = NULL;
+        c->req = NULL;
+        curl_easy_setopt(crl, CURLOPT_SHARE, share);
+        curl_easy_setopt(crl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(crl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(crl, CURLOPT_WRITEFUNCTION, onbody);
+        curl_easy_setopt(crl, CURLOPT_WRITEDATA, c);
+        curl_easy_setopt(crl, CURLOPT_PRIVATE, c);
+        c->next = pool;
+        pool = c;
+    }
+    pthread_mutex_unlock(&poollock);
+
+    return crl;
+}
+
+static void releasehandle(CURL *crl)
+{
+    httpconn_t *c = NULL;
+    curl_easy_getinfo(crl, CURLINFO_PRIVATE, (char **)&c);
+    pthread_mutex_lock(&poollock);
+    c->busy = false;
+    pthread_mutex_unlock(&poollock);
+}
+
+//
+// Sets the url and credentials on a checked out handle. A handle that
+// already has the same credentials isn't given them again. They're
+// compared by value, a config reload can free the caller's copy.
+//
+static void prepare(CURL *crl, const char *url, const char *userpwd)
+{
+    httpconn_t *c = NULL;
+    curl_easy_getinfo(crl, CURLINFO_PRIVATE, (char **)&c);
+    curl_easy_setopt(crl, CURLOPT_URL, url);
+
+    if (userpwd ? !c->userpwd || strcmp(c->userpwd, userpwd) : c->userpwd != NULL) {
+        curl_easy_setopt(crl, CURLOPT_USERPWD, userpwd);
+        free(c->userpwd);
+        c->userpwd = userpwd ? strdup(userpwd) : NULL;
+    }
+}
+
+//
+// Call SecuritySpy webapi
+//
+int httpcmd(const char *url, const char *userpwd)
+{
+    CURL *crl = gethandle(url);
+    prepare(crl, url, userpwd);
+
+    int iret = curl_easy_perform(crl);
+    if (iret) {
+        logmsg(LEVEL_WARN, "curl failed for %s. %s", url, curl_easy_strerror(iret));
+        releasehandle(crl);
+        return false;
+    }
+
+    long httpcode = 0;
+    curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, &httpcode);
+    releasehandle(crl);
+
+    return (int)httpcode;
+}
+
+// Async requests wait here, per server, until there's room in flight.
+typedef struct httpserver_t {
+    char *server;
+    unsigned inflight;
+    httpreq_t *head, *tail;    // pending, fifo
+    struct httpserver_t *next; // sll
+} httpserver_t;
+
+// Async state is per thread: each worker drives its own multi from its
+// own loop. The connection pool and share handle above are common.
+static __thread httpserver_t *servers = NULL;
+static __thread unsigned outstanding = 0;   // submitted and not yet done
+static __thread loop_t *httploop = NULL;
+static unsigned maxinflight = 8;
+
+static void checkdone(void);
+
+//
+// At most this many requests in flight to any one server, the rest queue.
+//
+void http_setmaxinflight(unsigned n)
+{
+    maxinflight = n ? n : 1;
+}
+
+unsigned http_outstanding()
+{
+    return outstanding;
+}
+
+static httpserver_t *getserver(const char *url)
+{
+    size_t len = serverlen(url);
+    for (httpserver_t *sv = servers; sv; sv = sv->next)
+        if (strlen(sv->server) == len && !strncmp(sv->server, url, len))
+            return sv;
+
+    httpserver_t *sv = calloc(1, sizeof(httpserver_t));
+    sv->server = strndup(url, len);
+    sv->next = servers;
+    servers = sv;
+    return sv;
+}
+
+//
+// Frees this thread's async state, its multi and per server queues. For
+// a worker that's finishing, with nothing left outstanding.
+//
+void http_threadcleanup()
+{
+    if (multi)
+    {
+        curl_multi_cleanup(multi);
+        multi = NULL;
+    }
+    while (servers)
+    {
+        httpserver_t *sv = servers;
+        servers = sv->next;
+        free(sv->server);
+        free(sv);
+    }
+    httploop = NULL;
+    outstanding = 0;
+}
+
+static void onsocketready(loop_t *loop, int fd, unsigned events, void *userdata)
+{
+    int flags = ((events & LOOP_READ) ? CURL_CSELECT_IN : 0) | ((events & LOOP_WRITE) ? CURL_CSELECT_OUT : 0);
+    int running;
+    curl_multi_socket_action(multi, fd, flags, &running);
+    checkdone();
+}
+
+static int onsocket(CURL *crl, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+    unsigned events = 0;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+        events |= LOOP_READ;
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+        events |= LOOP_WRITE;
+    loop_watch(httploop, fd, events, onsocketready, NULL);
+    return 0;
+}
+
+static void ontimeout(loop_t *loop, void *userdata)
+{
+    int running;
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    checkdone();
+}
+
+static int ontimer(CURLM *m, long ms, void *userp)
+{
+    // curl wants this done from the loop, not from inside its own callback
+    loop_settimeout(httploop, ms, ontimeout, NULL);
+    return 0;
+}
+
+//
+// Runs async requests from the given loop. Creates a loop of its own if
+// never called.
+//
+void http_setloop(loop_t *loop)
+{
+    http_init();
+    httploop = loop;
+    if (!multi)
+    {
+        multi = curl_multi_init();
+        curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, onsocket);
+        curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, ontimer);
+#if LIBCURL_VERSION_NUM >= 0x072B00
+        // a server that speaks HTTP/2 gets a batch down its connections
+        // multiplexed, otherwise it goes over the kept-alive HTTP/1.1
+        // ones. No CURLOPT_PIPEWAIT, on HTTP/1.1 it would hold the rest
+        // of a batch until the first response is back.
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    }
+}
+
+static void start(httpserver_t *sv, httpreq_t *req)
+{
+    CURL *crl = gethandle(req->url);
+    httpconn_t *c = NULL;
+    curl_easy_getinfo(crl, CURLINFO_PRIVATE, (char **)&c);
+    c->req = req;
+    req->crl = crl;
+    prepare(crl, req->url, req->userpwd);
+    sv->inflight++;
+    curl_multi_add_handle(multi, crl);
+}
+
+//
+// Sends req without waiting. done(req, userdata) is called from the loop
+// once it completes or fails; req must stay valid until then.
+//
+void http_submit(httpreq_t *req, httpdone_t done, void *userdata)
+{
+    if (!httploop)
+        http_setloop(loop_new());
+
+    req->done = done;
+    req->userdata = userdata;
+    req->httpcode = 0;
+    req->curlcode = 0;
+    req->seconds = 0;
+    req->next = NULL;
+    outstanding++;
+
+    httpserver_t *sv = getserver(req->url);
+    if (sv->inflight < maxinflight)
+    {
+        start(sv, req);
+    }
+    else
+    {
+        if (sv->tail)
+            sv->tail->next = req;
+        else
+            sv->head = req;
+        sv->tail = req;
+    }
+}
+
+static void checkdone()
+{
+    CURLMsg *msg;
+    int msgsleft;
+    while ((msg = curl_multi_info_read(multi, &msgsleft)))
+    {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        CURL *crl = msg->easy_handle;
+        httpconn_t *c = NULL;
+        curl_easy_getinfo(crl, CURLINFO_PRIVATE, (char **)&c);
+        httpreq_t *req = c->req;
+
+        long httpcode = 0;
+        req->curlcode = msg->data.result;
+        curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, &httpcode);
+        curl_easy_getinfo(crl, CURLINFO_TOTAL_TIME, &req->seconds);
+        req->httpcode = req->curlcode ? 0 : (int)httpcode;
+
+        curl_multi_remove_handle(multi, crl);
+        c->req = NULL;
+        req->crl = NULL;
+        releasehandle(crl);
+
+        // next one waiting on this server
+        httpserver_t *sv = getserver(req->url);
+        sv->inflight--;
+        if (sv->head)
+        {
+            httpreq_t *next = sv->head;
+            sv->head = next->next;
+            if (!sv->head)
+                sv->tail = NULL;
+            next->next = NULL;
+            start(sv, next);
+        }
+
+        outstanding--;
+        if (req->done)
+            req->done(req, req->userdata);
+    }
+}
+
+static void batchdone(httpreq_t *req, void *userdata)
+{
+    (*(unsigned *)userdata)--;
+}
+
+//
+// Sends all the requests concurrently and waits for them all to complete
+// or fail.
+//
+void httpbatch(httpreq_t *reqs, unsigned count)
+{
+    unsigned remaining = count;
+    for (unsigned i = 0; i < count; i++)
+        http_submit(&reqs[i], batchdone, &remaining);
+    while (remaining)
+        loop_once(httploop, -1);
+}
@@ -0,0 +1,46 @@
+//
+//  http.h
+//
+//  SecuritySpy web api calls. Keeps one reusable curl handle per
+//  server_address so commands ride an already open (keep-alive)
+//  connection, with DNS, connections and TLS sessions shared between
+//  handles. Async requests run on curl multi, driven by the event loop.
+//
+
+#ifndef HTTP_H
+  #define HTTP_H
+
+#include "loop.h"
+
+struct httpreq_t;
+typedef void (*httpdone_t)(struct httpreq_t *req, void *userdata);
+typedef void (*httpbody_t)(const char *data, size_t len, void *userdata);
+
+// One async request. url/userpwd are filled in by the caller, the rest
+// is filled in when it completes.
+typedef struct httpreq_t {
+    const char *url;
+    const char *userpwd;    // "user:password", NULL for none
+    httpbody_t body;        // given the reply a piece at a time, NULL to ignore it
+    int httpcode;           // http response code, 0 if the request failed
+    int curlcode;           // CURLcode of the transfer
+    double seconds;         // total transfer time
+
+    httpdone_t done;        // private
+    void *userdata;
+    void *crl;
+    struct httpreq_t *next;
+} httpreq_t;
+
+void http_init(void);
+void http_setloop(loop_t *loop);
+void http_setmaxinflight(unsigned n);
+unsigned http_outstanding(void);
+void http_submit(httpreq_t *req, httpdone_t done, void *userdata);
+void http_cleanup(void);
+void http_threadcleanup(void);
+int httpcmd(const char *url, const char *userpwd);
+void httpbatch(httpreq_t *reqs, unsigned count);
+size_t curlwritebogus(char *ptr, size_t size, size_t nmemb, void *userdata);
+
+#endif
@@ -0,0 +1,422 @@
+//
+//  journal.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sunspy.h"
+#include "timer.h"
+#include "log.h"
+#include "journal.h"
+
+#define JOURNAL_LINE    512
+
+// What the journal says about one camera.
+typedef struct
+{
+    char *server;
+    unsigned camera;
+    mstime_t scheduled[2];      // next ACTIVE and PASSIVE, 0 if not queued
+    mstime_t due;               // latest sent
+    unsigned dueaction;
+    mstime_t done;              // latest that went through, or was skipped
+    unsigned doneaction;
+} camrec_t;
+
+typedef struct
+{
+    camrec_t *recs;
+    unsigned count;
+    unsigned alloc;
+    unsigned *index;            // open addressed, recs + 1, 0 for empty
+    unsigned mask;
+} table_t;
+
+static char *journalpath = NULL;
+static int fd = -1;
+static table_t replayed;        // as it was on open, read only once workers start
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static char *pending = NULL;    // records not yet written, guarded by lock
+static size_t pendinglen = 0, pendingalloc = 0;
+static bool stopping = false;
+static unsigned long records = 0, commits = 0;
+
+static unsigned hashkey(const char *server, unsigned camera)
+{
+    unsigned h = 2166136261u;
+    for (; *server; server++)
+        h = (h ^ (unsigned char)*server) * 16777619u;
+    return (h ^ camera) * 2654435761u;
+}
+
+static camrec_t *lookup(table_t *t, const char *server, unsigned camera, bool add)
+{
+    if (add && (t->count + 1) * 2 > t->mask)
+    {
+        // grow, and put everything back
+        free(t->index);
+        t->mask = t->mask ? t->mask * 2 + 1 : 63;
+        t->index = calloc(t->mask + 1, sizeof(unsigned));
+        for (unsigned i = 0; i < t->count; i++)
+        {
+            unsigned h = hashkey(t->recs[i].server, t->recs[i].camera) & t->mask;
+            while (t->index[h])
+                h = (h + 1) & t->mask;
+            t->index[h] = i + 1;
+        }
+    }
+    if (!t->index)
+        return NULL;
+
+    unsigned h = hashkey(server, camera) & t->mask;
+    for (; t->index[h]; h = (h + 1) & t->mask)
+    {
+        camrec_t *r = &t->recs[t->index[h] - 1];
+        if (r->camera == camera && !strcmp(r->server, server))
+            return r;
+    }
+    if (!add)
+        return NULL;
+
+    if (t->count == t->alloc)
+    {
+        t->alloc = t->alloc ? t->alloc * 2 : 64;
+        t->recs = realloc(t->recs, t->alloc * sizeof(camrec_t));
+    }
+    camrec_t *r = &t->recs[t->count];
+    memset(r, 0, sizeof(*r));
+    r->server = strdup(server);
+    r->camera = camera;
+    t->index[h] = ++t->count;
+    return r;
+}
+
+static void freetable(table_t *t)
+{
+    for (unsigned i = 0; i < t->count; i++)
+        free(t->recs[i].server);
+    free(t->recs);
+    free(t->index);
+    memset(t, 0, sizeof(*t));
+}
+
+//
+// Reads the journal at path into t. A line cut short by a crash, or
+// anything else that doesn't parse, is skipped. False if the file can't
+// be read, which is fine if it isn't there yet.
+//
+static bool replay(const char *path, table_t *t)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char line[JOURNAL_LINE];
+    unsigned long bad = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        char type;
+        long long when;
+        unsigned action, camera;
+        int used = 0;
+        size_t len = strlen(line);
+        if (len < 2 || line[len - 1] != '\n'
+            || sscanf(line, "%c %lld %u %u %n", &type, &when, &action, &camera, &used) < 4 || !used
+            || action < CAM_ACTION_ACTIVE || action > CAM_ACTION_PASSIVE)
+        {
+            bad++;
+            continue;
+        }
+        line[len - 1] = 0;
+        camrec_t *r = lookup(t, line + used, camera, true);
+
+        switch (type)
+        {
+            case JOURNAL_SCHEDULED:
+                r->scheduled[action - 1] = when;
+                break;
+            case JOURNAL_DUE:
+                if (when >= r->due)
+                {
+                    r->due = when;
+                    r->dueaction = action;
+                }
+                break;
+            case JOURNAL_DONE:
+            case JOURNAL_SKIPPED:
+                if (when >= r->done)
+                {
+                    r->done = when;
+                    r->doneaction = action;
+                }
+                break;
+            default:
+                bad++;
+        }
+    }
+    fclose(f);
+    if (bad)
+        logmsg(LEVEL_WARN, "Skipped %lu unreadable lines in journal %s", bad, path);
+    return true;
+}
+
+//
+// Whether camera r needs 'action', the state the schedule has put it in
+// since 'since'. It doesn't if the journal has a command for it going
+// through at or after then, say one forced, or the last one that went
+// through was 'action' and nothing else has been sent since.
+//
+static bool missed(const camrec_t *r, unsigned action, mstime_t since)
+{
+    if (r->due > r->done && r->dueaction != action)
+        return true;
+    return !(r->done && (r->done >= since || r->doneaction == action));
+}
+
+static bool syncdir(const char *path)
+{
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = 0;
+    else if (slash)
+        *slash = 0;
+    else
+        strcpy(dir, ".");
+    int dfd = open(dir, O_RDONLY);
+    free(dir);
+    if (dfd < 0)
+        return false;
+    fsync(dfd);
+    close(dfd);
+    return true;
+}
+
+//
+// Writes t out in place of the journal, the smallest file that replays
+// to the same thing, and reopens it for appending.
+//
+static bool rewrite(const table_t *t)
+{
+    size_t len = strlen(journalpath);
+    char *tmp = malloc(len + 5);
+    sprintf(tmp, "%s.new", journalpath);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        logmsg(LEVEL_WARN, "Can't write journal %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return false;
+    }
+
+    for (unsigned i = 0; i < t->count; i++)
+    {
+        const camrec_t *r = &t->recs[i];
+        if (r->done)
+            fprintf(f, "%c %lld %u %u %s\n", JOURNAL_DONE, r->done, r->doneaction, r->camera, r->server);
+        if (r->due > r->done)
+            fprintf(f, "%c %lld %u %u %s\n", JOURNAL_DUE, r->due, r->dueaction, r->camera, r->server);
+        for (unsigned a = 0; a < 2; a++)
+            if (r->scheduled[a])
+                fprintf(f, "%c %lld %u %u %s\n", JOURNAL_SCHEDULED, r->scheduled[a], a + 1, r->camera, r->server);
+    }
+
+    bool ok = fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, journalpath))
+    {
+        logmsg(LEVEL_WARN, "Can't write journal %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return false;
+    }
+    free(tmp);
+    syncdir(journalpath);
+
+    int newfd = open(journalpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (newfd < 0)
+        return false;
+    if (fd >= 0)
+        close(fd);
+    fd = newfd;
+    return true;
+}
+
+static void compact()
+{
+    table_t t;
+    memset(&t, 0, sizeof(t));
+    mstime_t t0 = timer_monotonic();
+    if (replay(journalpath, &t) && rewrite(&t))
+        logmsg(LEVEL_DEBUG, "Journal compacted to %u cameras in %lldms", t.count, timer_monotonic() - t0);
+    freetable(&t);
+}
+
+//
+// Group commit: everything that's built up while the last write and
+// sync were going on goes out in one more.
+//
+static void *writeloop(void *arg)
+{
+    char *mine = NULL;
+    size_t minealloc = 0;
+    size_t written = 0;
+    mstime_t lastsync = 0;
+
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        while (!pendinglen && !stopping)
+            pthread_cond_wait(&cond, &lock);
+        if (!pendinglen)
+            break;
+
+        // let more build up if the last sync was only just now
+        mstime_t wait = lastsync + JOURNAL_SYNC_MS - timer_monotonic();
+        if (wait > 0 && !stopping)
+        {
+            pthread_mutex_unlock(&lock);
+            usleep(wait * 1000);
+            pthread_mutex_lock(&lock);
+        }
+
+        // swap buffers, workers fill the other while this one's written
+        char *full = pending;
+        size_t fullalloc = pendingalloc, len = pendinglen;
+        pending = mine;
+        pendingalloc = minealloc;
+        pendinglen = 0;
+        mine = full;
+        minealloc = fullalloc;
+        pthread_mutex_unlock(&lock);
+
+        for (size_t off = 0; off < len; )
+        {
+            ssize_t n = write(fd, mine + off, len - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                logmsg(LEVEL_ERROR, "Can't write journal %s: %s", journalpath, strerror(errno));
+                break;
+            }
+            off += n;
+        }
+        fdatasync(fd);
+        lastsync = timer_monotonic();
+        commits++;
+        written += len;
+        if (written > JOURNAL_COMPACT)
+        {
+            compact();
+            written = 0;
+        }
+
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    free(mine);
+    return NULL;
+}
+
+//
+// Reads back the journal at path, for journal_missed(), and starts
+// appending to it. False, with a message, if it can't be written.
+//
+bool journal_open(const char *path)
+{
+    journalpath = strdup(path);
+    if (!replay(path, &replayed) && errno != ENOENT)
+        logmsg(LEVEL_WARN, "Can't read journal %s: %s", path, strerror(errno));
+
+    if (!rewrite(&replayed))
+    {
+        logmsg(LEVEL_ERROR, "Can't open journal %s, missed events won't be caught up", path);
+        free(journalpath);
+        journalpath = NULL;
+        return false;
+    }
+    stopping = false;
+    if (pthread_create(&writer, NULL, writeloop, NULL))
+    {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    logmsg(LEVEL_DEBUG, "Journal %s has %u cameras", path, replayed.count);
+    return true;
+}
+
+//
+// Writes out what's left and stops.
+//
+void journal_close()
+{
+    if (fd < 0)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    logmsg(LEVEL_DEBUG, "Journal: %lu records in %lu syncs", records, commits);
+    close(fd);
+    fd = -1;
+    free(pending);
+    pending = NULL;
+    pendinglen = pendingalloc = 0;
+    freetable(&replayed);
+    free(journalpath);
+    journalpath = NULL;
+}
+
+//
+// Adds a record for e. Does nothing unless the journal's open.
+//
+void journal_record(JournalRecord type, mstime_t when, const camevent_t *e)
+{
+    if (fd < 0)
+        return;
+    char line[JOURNAL_LINE];
+    int len = snprintf(line, sizeof(line), "%c %lld %u %u %s\n", type, when, e->action, e->camera, e->server->name);
+    if (len <= 0 || len >= (int)sizeof(line))
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (pendinglen + len > pendingalloc)
+    {
+        pendingalloc = pendingalloc ? pendingalloc * 2 : 4096;
+        while (pendingalloc < pendinglen + len)
+            pendingalloc *= 2;
+        pending = realloc(pending, pendingalloc);
+    }
+    memcpy(pending + pendinglen, line, len);
+    pendinglen += len;
+    records++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+//
+// Whether server's camera missed going to 'action', due since 'since',
+// while sunspy was down. Never for a camera the journal doesn't have.
+//
+bool journal_missed(const char *server, unsigned camera, unsigned action, mstime_t since)
+{
+    camrec_t *r = lookup(&replayed, server, camera, false);
+    return r && missed(r, action, since);
+}
@@ -0,0 +1,45 @@
+//
+//  journal.h
+//
+//  Append-only journal of what the workers have scheduled and sent, so
+//  a restart can send what came due while sunspy was down. One line per
+//  record:
+//
+//    S <when> <action> <camera> <server>   queued to go at when
+//    D <when> <action> <camera> <server>   came due and was sent at when
+//    C <when> <action> <camera> <server>   the one sent at when went through
+//    K <when> <action> <camera> <server>   came due while paused, not sent
+//
+//  Records are handed to a thread of their own, which writes whatever
+//  has built up and fdatasync()s it once, at most every JOURNAL_SYNC_MS,
+//  so a burst of events costs one sync rather than one each and workers
+//  never wait on the disk.
+//
+//  On open the journal is read back. The schedule says what state each
+//  camera should be in by now; the journal only says whether it got
+//  there, by a C since or already in that state. It's then rewritten
+//  with just what's needed to tell that again, as it is once it grows
+//  past JOURNAL_COMPACT.
+//
+
+#ifndef JOURNAL_H
+  #define JOURNAL_H
+
+#include "sunspy.h"
+
+#define JOURNAL_COMPACT     (1024*1024)     // bytes appended before it's rewritten
+#define JOURNAL_SYNC_MS     50              // at most one sync this often
+
+typedef enum
+{ JOURNAL_SCHEDULED = 'S'
+, JOURNAL_DUE       = 'D'
+, JOURNAL_DONE      = 'C'
+, JOURNAL_SKIPPED   = 'K'
+} JournalRecord;
+
+bool journal_open(const char *path);
+void journal_close(void);
+void journal_record(JournalRecord type, mstime_t when, const camevent_t *e);
+bool journal_missed(const char *server, unsigned camera, unsigned action, mstime_t since);
+
+#endif
@@ -0,0 +1,139 @@
+//
+//  listener.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sunspy.h"
+#include "loop.h"
+#include "listener.h"
+
+void listener_setnonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+//
+// A unix domain socket listening at path, replacing any stale one. -1,
+// with a message naming it 'what', if it can't be.
+//
+int listener_unix(const char *path, const char *what)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s socket path too long: %s\n", what, path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can't make %s socket: %s\n", what, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16))
+    {
+        fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void onaccept(loop_t *loop, int fd, unsigned events, void *userdata)
+{
+    listener_t *l = userdata;
+    int cfd;
+    while ((cfd = accept(fd, NULL, NULL)) >= 0)
+    {
+        listener_setnonblock(cfd);
+        if (cfd >= l->nconns)
+        {
+            int n = l->nconns ? l->nconns : 64;
+            while (n <= cfd)
+                n *= 2;
+            l->conns = realloc(l->conns, n * sizeof(void *));
+            memset(&l->conns[l->nconns], 0, (n - l->nconns) * sizeof(void *));
+            l->nconns = n;
+        }
+        l->conns[cfd] = calloc(1, l->connsize);
+        loop_watch(loop, cfd, LOOP_READ, l->onconn, NULL);
+    }
+}
+
+//
+// Accepts connections on the listening socket fd from loop, path being
+// its unix socket if it is one. Each gets a connsize block and onconn
+// called when there's something to read.
+//
+void listener_start(listener_t *l, loop_t *loop, int fd, const char *path,
+                    size_t connsize, loopfd_t onconn, void (*freeconn)(void *conn))
+{
+    listener_setnonblock(fd);
+    l->loop = loop;
+    l->fd = fd;
+    l->path = path ? strdup(path) : NULL;
+    l->connsize = connsize;
+    l->onconn = onconn;
+    l->freeconn = freeconn;
+    loop_watch(loop, fd, LOOP_READ, onaccept, l);
+}
+
+//
+// The state block of the connection on fd.
+//
+void *listener_conn(const listener_t *l, int fd)
+{
+    return l->conns[fd];
+}
+
+//
+// Closes the connection on fd and frees its block.
+//
+void listener_drop(listener_t *l, int fd)
+{
+    loop_watch(l->loop, fd, 0, NULL, NULL);
+    close(fd);
+    if (l->freeconn)
+        l->freeconn(l->conns[fd]);
+    free(l->conns[fd]);
+    l->conns[fd] = NULL;
+}
+
+//
+// Drops every connection and stops listening. Does nothing if it was
+// never started.
+//
+void listener_close(listener_t *l)
+{
+    if (!l->loop)
+        return;
+    for (int fd = 0; fd < l->nconns; fd++)
+        if (l->conns[fd])
+            listener_drop(l, fd);
+    loop_watch(l->loop, l->fd, 0, NULL, NULL);
+    close(l->fd);
+    if (l->path)
+    {
+        unlink(l->path);
+        free(l->path);
+    }
+    free(l->conns);
+    memset(l, 0, sizeof(*l));
+}
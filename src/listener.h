@@ -0,0 +1,35 @@
+//
+//  listener.h
+//
+//  A listening socket served from the event loop, and the connections
+//  accepted on it. Each connection gets a zeroed state block of its own,
+//  found again by its fd. The control socket and metrics both use one.
+//
+
+#ifndef LISTENER_H
+  #define LISTENER_H
+
+#include "sunspy.h"
+#include "loop.h"
+
+typedef struct
+{
+    loop_t *loop;           // NULL until started
+    int fd;                 // listening
+    char *path;             // unix socket to remove on close, NULL for tcp
+    size_t connsize;        // state block for each connection
+    loopfd_t onconn;        // watches each new connection for reading
+    void (*freeconn)(void *conn); // frees what a block points to, NULL if nothing
+    void **conns;           // indexed by fd
+    int nconns;
+} listener_t;
+
+void listener_setnonblock(int fd);
+int listener_unix(const char *path, const char *what);
+void listener_start(listener_t *l, loop_t *loop, int fd, const char *path,
+                    size_t connsize, loopfd_t onconn, void (*freeconn)(void *conn));
+void *listener_conn(const listener_t *l, int fd);
+void listener_drop(listener_t *l, int fd);
+void listener_close(listener_t *l);
+
+#endif
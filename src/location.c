@@ -0,0 +1,428 @@
+//
+//  location.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#include "sunspy.h"
+#include "location.h"
+#include "log.h"
+
+enum { FORMAT_UNKNOWN, FORMAT_JSON, FORMAT_CSV };
+
+// json parser states
+enum { J_SEEK, J_KEY, J_COLON, J_VALUE, J_STRING, J_BARE, J_SKIPSTRING };
+
+// csv parser states
+enum { C_FIELD, C_QUOTED, C_QUOTEEND, C_DONE };
+
+// Where json values we want go in fields[], and the keys services use
+// for them.
+enum { F_IP, F_LAT, F_LON, F_ZONE };
+static const struct { const char *key; int field; } jsonkeys[] =
+{ { "ip", F_IP }, { "query", F_IP }
+, { "latitude", F_LAT }, { "lat", F_LAT }
+, { "longitude", F_LON }, { "lon", F_LON }
+, { "time_zone", F_ZONE }, { "timezone", F_ZONE }
+};
+
+void location_parseinit(locparser_t *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+static void append(locparser_t *p, char c)
+{
+    // anything longer than a field is of no use to us, keep the start
+    if (p->tokenlen < LOCATION_FIELD - 1)
+        p->token[p->tokenlen++] = c;
+}
+
+static void endtoken(locparser_t *p, char *dest)
+{
+    p->token[p->tokenlen] = 0;
+    if (dest)
+        strcpy(dest, p->token);
+    p->tokenlen = 0;
+}
+
+static void jsonvalue(locparser_t *p)
+{
+    char *dest = NULL;
+    for (unsigned i = 0; i < sizeof(jsonkeys)/sizeof(jsonkeys[0]); i++)
+        if (!strcmp(p->key, jsonkeys[i].key))
+            dest = p->fields[jsonkeys[i].field];
+    endtoken(p, dest);
+}
+
+static void jsonchar(locparser_t *p, char c)
+{
+    switch (p->state)
+    {
+    case J_SEEK:
+        // between values, or somewhere inside a nested one
+        if (c == '{' || c == '[')
+            p->depth++;
+        else if (c == '}' || c == ']')
+            p->depth--;
+        else if (c == '"')
+            p->state = p->depth == 1 ? J_KEY : J_SKIPSTRING;
+        break;
+
+    case J_KEY:
+    case J_STRING:
+    case J_SKIPSTRING:
+        if (p->escape)
+        {
+            p->escape = false;
+            append(p, c);
+        }
+        else if (c == '\\')
+            p->escape = true;
+        else if (c != '"')
+            append(p, c);
+        else if (p->state == J_KEY)
+        {
+            endtoken(p, p->key);
+            p->state = J_COLON;
+        }
+        else
+        {
+            if (p->state == J_STRING)
+                jsonvalue(p);
+            else
+                endtoken(p, NULL);
+            p->state = J_SEEK;
+        }
+        break;
+
+    case J_COLON:
+        if (c == ':')
+            p->state = J_VALUE;
+        break;
+
+    case J_VALUE:
+        if (isspace((unsigned char)c))
+            break;
+        if (c == '"')
+            p->state = J_STRING;
+        else if (c == '{' || c == '[')
+        {
+            // an object or array we don't look inside
+            p->depth++;
+            p->state = J_SEEK;
+        }
+        else
+        {
+            append(p, c);
+            p->state = J_BARE;
+        }
+        break;
+
+    case J_BARE:
+        // numbers, true, false, null
+        if (c == ',' || c == '}' || c == ']' || isspace((unsigned char)c))
+        {
+            jsonvalue(p);
+            p->state = J_SEEK;
+            if (c == '}' || c == ']')
+                p->depth--;
+        }
+        else
+            append(p, c);
+        break;
+    }
+}
+
+static void csvfield(locparser_t *p)
+{
+    char *dest = NULL;
+    if (p->nfields < sizeof(p->fields)/sizeof(p->fields[0]))
+        dest = p->fields[p->nfields];
+    p->nfields++;
+    endtoken(p, dest);
+}
+
+static void csvchar(locparser_t *p, char c)
+{
+    switch (p->state)
+    {
+    case C_FIELD:
+        if (c == ',')
+            csvfield(p);
+        else if (c == '\n' || c == '\r')
+        {
+            // only the first line means anything
+            csvfield(p);
+            p->state = C_DONE;
+        }
+        else if (c == '"' && p->tokenlen == 0)
+            p->state = C_QUOTED;
+        else
+            append(p, c);
+        break;
+
+    case C_QUOTED:
+        if (c == '"')
+            p->state = C_QUOTEEND;
+        else
+            append(p, c);
+        break;
+
+    case C_QUOTEEND:
+        p->state = C_FIELD;
+        if (c == '"')
+        {
+            // "" inside quotes
+            append(p, c);
+            p->state = C_QUOTED;
+        }
+        else
+            csvchar(p, c);
+        break;
+
+    case C_DONE:
+        break;
+    }
+}
+
+//
+// Feeds the parser the next 'len' bytes of the reply, however it's
+// split up.
+//
+void location_parse(locparser_t *p, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = data[i];
+        if (p->format == FORMAT_UNKNOWN)
+        {
+            if (isspace((unsigned char)c))
+                continue;
+            if (c == '{')
+            {
+                p->format = FORMAT_JSON;
+                p->depth = 1;
+                p->state = J_SEEK;
+                continue;
+            }
+            p->format = FORMAT_CSV;
+            p->state = C_FIELD;
+        }
+
+        if (p->format == FORMAT_JSON)
+            jsonchar(p, c);
+        else
+            csvchar(p, c);
+    }
+}
+
+static bool todegrees(const char *str, double limit, double *deg)
+{
+    char *end;
+    double d = strtod(str, &end);
+    while (isspace((unsigned char)*end))
+        end++;
+    if (end == str || *end || d < -limit || d > limit)
+        return false;
+    *deg = d;
+    return true;
+}
+
+//
+// Pulls the location out once the whole reply has been through
+// location_parse(). False if it didn't have one.
+//
+bool location_parsed(locparser_t *p, location_t *loc)
+{
+    memset(loc, 0, sizeof(*loc));
+
+    const char *ip, *la, *lo, *zone = "";
+    if (p->format == FORMAT_JSON)
+    {
+        if (p->state == J_BARE)
+            jsonvalue(p);   // reply ended right after a number
+        ip = p->fields[F_IP];
+        la = p->fields[F_LAT];
+        lo = p->fields[F_LON];
+        zone = p->fields[F_ZONE];
+    }
+    else if (p->format == FORMAT_CSV)
+    {
+        if (p->state != C_DONE && (p->tokenlen || p->nfields))
+            csvfield(p);
+        p->state = C_DONE;
+
+        // freegeoip's csv, first
+        //   ip,country_code,country_name,region_code,region_name,city,zip,lat,lon,metro,area
+        // and the later one, with the time zone after the zip
+        //   ip,country_code,country_name,region_code,region_name,city,zip,time_zone,lat,lon,metro
+        double d;
+        ip = p->fields[0];
+        if (p->nfields >= 9 && todegrees(p->fields[7], 90, &d))
+        {
+            la = p->fields[7];
+            lo = p->fields[8];
+        }
+        else if (p->nfields >= 10)
+        {
+            zone = p->fields[7];
+            la = p->fields[8];
+            lo = p->fields[9];
+        }
+        else
+            return false;
+    }
+    else
+        return false;
+
+    if (!todegrees(la, 90, &loc->lat) || !todegrees(lo, 180, &loc->lon))
+        return false;
+    strcpy(loc->ip, ip);
+    strcpy(loc->zone, zone);
+    return true;
+}
+
+static size_t onreply(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    location_parse(userdata, ptr, size * nmemb);
+    return size * nmemb;
+}
+
+//
+// Asks the geolocation service at url where we are. Gives up after a
+// few seconds rather than hold anything up.
+//
+bool location_fetch(const char *url, location_t *loc)
+{
+    locparser_t parser;
+    location_parseinit(&parser);
+
+    CURL *crl = curl_easy_init();
+    curl_easy_setopt(crl, CURLOPT_URL, url);
+    curl_easy_setopt(crl, CURLOPT_WRITEFUNCTION, onreply);
+    curl_easy_setopt(crl, CURLOPT_WRITEDATA, &parser);
+    curl_easy_setopt(crl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(crl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(crl, CURLOPT_TIMEOUT, 10L);
+    curl_easy_setopt(crl, CURLOPT_NOSIGNAL, 1L);
+    CURLcode res = curl_easy_perform(crl);
+
+    long httpcode = 0;
+    curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, &httpcode);
+    curl_easy_cleanup(crl);
+
+    if (res != CURLE_OK)
+    {
+        logmsg(LEVEL_WARN, "Can't get location from %s. %s", url, curl_easy_strerror(res));
+        return false;
+    }
+    if (httpcode != 200)
+    {
+        logmsg(LEVEL_WARN, "Can't get location from %s. %ld", url, httpcode);
+        return false;
+    }
+    if (!location_parsed(&parser, loc))
+    {
+        logmsg(LEVEL_WARN, "No location in the reply from %s", url);
+        return false;
+    }
+    loc->fetched = time(NULL);
+    return true;
+}
+
+//
+// The cache is a few "key=value" lines.
+//
+bool location_read(const char *path, location_t *loc)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    memset(loc, 0, sizeof(*loc));
+    bool haslat = false, haslon = false;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        char *value = strchr(line, '=');
+        if (line[0] == '#' || !value)
+            continue;
+        *value++ = 0;
+        if (!strcmp(line, "ip"))
+            snprintf(loc->ip, sizeof(loc->ip), "%s", value);
+        else if (!strcmp(line, "lat"))
+            haslat = todegrees(value, 90, &loc->lat);
+        else if (!strcmp(line, "lon"))
+            haslon = todegrees(value, 180, &loc->lon);
+        else if (!strcmp(line, "zone"))
+            snprintf(loc->zone, sizeof(loc->zone), "%s", value);
+        else if (!strcmp(line, "fetched"))
+            loc->fetched = (time_t)strtoll(value, NULL, 10);
+    }
+    fclose(f);
+    return haslat && haslon;
+}
+
+//
+// Writes the cache to a temporary file and renames it over the old one,
+// so a reader never sees half of it.
+//
+bool location_write(const char *path, const location_t *loc)
+{
+    char *tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.new", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        free(tmp);
+        return false;
+    }
+    fprintf(f, "# sunspy's last detected location\n");
+    fprintf(f, "fetched=%lld\nip=%s\nlat=%f\nlon=%f\nzone=%s\n",
+            (long long)loc->fetched, loc->ip, loc->lat, loc->lon, loc->zone);
+    bool ok = fclose(f) == 0 && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+//
+// Hours from GMT in the named time zone at 'at'. Changes TZ for the
+// process while it works it out, so call it before starting threads.
+//
+bool location_zoneoffset(const char *zone, time_t at, double *hours)
+{
+    // an unknown zone would quietly come out as GMT
+    const char *dir = getenv("TZDIR") ? getenv("TZDIR") : "/usr/share/zoneinfo";
+    char *path = malloc(strlen(dir) + strlen(zone) + 2);
+    sprintf(path, "%s/%s", dir, zone);
+    bool known = zone[0] && !strstr(zone, "..") && access(path, R_OK) == 0;
+    free(path);
+    if (!known)
+        return false;
+
+    char *saved = getenv("TZ") ? strdup(getenv("TZ")) : NULL;
+    setenv("TZ", zone, 1);
+    tzset();
+    struct tm tm;
+    localtime_r(&at, &tm);
+    *hours = tm.tm_gmtoff / (60.0*60.0);
+    if (saved)
+        setenv("TZ", saved, 1);
+    else
+        unsetenv("TZ");
+    tzset();
+    free(saved);
+    return true;
+}
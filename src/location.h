@@ -0,0 +1,53 @@
+//
+//  location.h
+//
+//  Where we are, from an ip geolocation service, and an on-disk cache of
+//  it so a restart doesn't wait on the network. Replies are parsed as
+//  they arrive, either flat json ({"latitude": .., "longitude": ..}) or
+//  freegeoip style csv.
+//
+
+#ifndef LOCATION_H
+  #define LOCATION_H
+
+#include <stddef.h>
+#include <time.h>
+#include "sunspy.h"
+
+#define LOCATION_DEFAULT_URL    "http://freegeoip.net/csv"
+#define LOCATION_DEFAULT_TTL    (24*60*60)      // seconds
+#define LOCATION_FIELD          64
+
+typedef struct
+{
+    char ip[LOCATION_FIELD];        // our public address, as the service saw it
+    double lat;                     // Degrees -S/N
+    double lon;                     // Degrees E/-W
+    char zone[LOCATION_FIELD];      // i.e. "Europe/Berlin", empty if not given
+    time_t fetched;                 // when it was looked up
+} location_t;
+
+// Streaming reply parser, feed it the reply a piece at a time.
+typedef struct
+{
+    int format;                     // not known yet, json or csv
+    int state;
+    bool escape;                    // json, the last char was a backslash
+    int depth;                      // json, objects deep
+    char key[LOCATION_FIELD];       // json, key of the value being read
+    unsigned nfields;               // csv, fields so far
+    char fields[12][LOCATION_FIELD]; // csv fields or json values we want
+    char token[LOCATION_FIELD];     // being read
+    size_t tokenlen;
+} locparser_t;
+
+void location_parseinit(locparser_t *p);
+void location_parse(locparser_t *p, const char *data, size_t len);
+bool location_parsed(locparser_t *p, location_t *loc);
+
+bool location_fetch(const char *url, location_t *loc);
+bool location_read(const char *path, location_t *loc);
+bool location_write(const char *path, const location_t *loc);
+bool location_zoneoffset(const char *zone, time_t at, double *hours);
+
+#endif
@@ -0,0 +1,382 @@
+//
+//  log.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sunspy.h"
+#include "timer.h"
+#include "log.h"
+
+extern bool verbose;
+
+typedef struct
+{
+    volatile unsigned long seq;     // == position + 1 once written, see log_write()
+    mstime_t ts;
+    mstime_t at;
+    unsigned suppressed;
+    unsigned char level;
+    char msg[LOG_MSG];
+} logrec_t;
+
+static const char *levelnames[] = { "error", "warn", "info", "debug" };
+static const char *formatnames[] = { "text", "logfmt", "json" };
+
+static logrec_t ring[LOG_RING];
+static volatile unsigned long head = 0;     // next slot to write
+static volatile unsigned long tail = 0;     // next slot to read, only the writer moves it
+static volatile unsigned long dropped = 0;
+static volatile int maxlevel = LEVEL_DEBUG;
+static volatile int format = LOGFORMAT_TEXT;
+
+static pthread_t writer;
+static bool running = false;
+static volatile bool stopping = false;
+static volatile int sleeping = 0;           // writer is waiting on wake[0]
+static int wake[2] = { -1, -1 };
+
+bool log_enabled(LogLevel level)
+{
+    return level <= maxlevel && (level < LEVEL_DEBUG || verbose);
+}
+
+static bool byname(const char *name, const char **names, unsigned count, volatile int *dest)
+{
+    for (unsigned i = 0; i < count; i++)
+        if (!strcasecmp(name, names[i]))
+        {
+            *dest = i;
+            return true;
+        }
+    return false;
+}
+
+//
+// Logs messages this important or more, "error", "warn", "info" or
+// "debug". False if it isn't one of those.
+//
+bool log_setlevel(const char *name)
+{
+    return byname(name, levelnames, sizeof(levelnames)/sizeof(levelnames[0]), &maxlevel);
+}
+
+bool log_setformat(const char *name)
+{
+    return byname(name, formatnames, sizeof(formatnames)/sizeof(formatnames[0]), &format);
+}
+
+// ---- writing them out, on the writer thread
+
+typedef struct
+{
+    time_t second;
+    char str[40];
+} datecache_t;
+
+// "2026-10-17T19:01:00.250Z"
+static const char *isotime(datecache_t *c, mstime_t t)
+{
+    time_t secs = (time_t)(t / 1000);
+    if (secs != c->second)
+    {
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+        strftime(c->str, sizeof(c->str), "%Y-%m-%dT%H:%M:%S", &tm);
+        c->second = secs;
+    }
+    static char buf[48];
+    snprintf(buf, sizeof(buf), "%s.%03dZ", c->str, (int)(t % 1000));
+    return buf;
+}
+
+// Quotes a message for logfmt or json, both want " and \ escaped.
+static void putquoted(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c == '\t')
+            fputs("\\t", f);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// "2026-10-17T21:01:00.250+0200", local time for 'at'
+static const char *localiso(mstime_t t, char *dest)
+{
+    time_t secs = (time_t)(t / 1000);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    char date[24], zone[8];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    strftime(zone, sizeof(zone), "%z", &tm);
+    sprintf(dest, "%s.%03d%s", date, (int)(t % 1000), zone);
+    return dest;
+}
+
+static void emit(const logrec_t *r)
+{
+    static datecache_t tscache;
+    char at[48];
+    if (r->at && format == LOGFORMAT_TEXT)
+    {
+        timer_str(r->at, at);
+        at[strlen(at) - 1] = 0;
+    }
+    else if (r->at)
+        localiso(r->at, at);
+
+    if (format == LOGFORMAT_TEXT)
+    {
+        FILE *f = r->level <= LEVEL_WARN ? stderr : stdout;
+        if (r->level == LEVEL_ERROR)
+            fputs("Error: ", f);
+        else if (r->level == LEVEL_WARN)
+            fputs("Warning: ", f);
+        fputs(r->msg, f);
+        if (r->at)
+            fprintf(f, " at %s", at);
+        if (r->suppressed)
+            fprintf(f, " (%u more like this not logged)", r->suppressed);
+        fputc('\n', f);
+    }
+    else if (format == LOGFORMAT_LOGFMT)
+    {
+        printf("ts=%s level=%s msg=", isotime(&tscache, r->ts), levelnames[r->level]);
+        putquoted(stdout, r->msg);
+        if (r->at)
+        {
+            printf(" at=");
+            putquoted(stdout, at);
+        }
+        if (r->suppressed)
+            printf(" suppressed=%u", r->suppressed);
+        putchar('\n');
+    }
+    else
+    {
+        printf("{\"ts\":\"%s\",\"level\":\"%s\",\"msg\":", isotime(&tscache, r->ts), levelnames[r->level]);
+        putquoted(stdout, r->msg);
+        if (r->at)
+        {
+            printf(",\"at\":");
+            putquoted(stdout, at);
+        }
+        if (r->suppressed)
+            printf(",\"suppressed\":%u", r->suppressed);
+        puts("}");
+    }
+}
+
+//
+// Writes out everything in the ring. False if there was nothing.
+//
+static bool drain()
+{
+    bool any = false;
+    for (;;)
+    {
+        logrec_t *r = &ring[tail & (LOG_RING - 1)];
+        if (r->seq != tail + 1)
+            break;
+        __sync_synchronize();
+        emit(r);
+        __sync_synchronize();
+        r->seq = tail + LOG_RING;
+        tail++;
+        any = true;
+    }
+
+    unsigned long lost = __sync_lock_test_and_set(&dropped, 0);
+    if (lost)
+    {
+        logrec_t r;
+        memset(&r, 0, sizeof(r));
+        r.ts = timer_now();
+        r.level = LEVEL_WARN;
+        snprintf(r.msg, sizeof(r.msg), "%lu log messages dropped, output isn't keeping up", lost);
+        emit(&r);
+    }
+    if (any || lost)
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return any;
+}
+
+static void *writeloop(void *arg)
+{
+    for (;;)
+    {
+        if (drain())
+            continue;
+        if (stopping)
+            break;
+
+        // nothing to do, say so and look once more in case a message
+        // went in before anyone could see it
+        sleeping = 1;
+        __sync_synchronize();
+        if (ring[tail & (LOG_RING - 1)].seq == tail + 1 || stopping)
+        {
+            sleeping = 0;
+            continue;
+        }
+        struct pollfd pfd = { wake[0], POLLIN, 0 };
+        poll(&pfd, 1, 1000);
+        char buf[64];
+        while (read(wake[0], buf, sizeof(buf)) > 0)
+            ;
+        sleeping = 0;
+    }
+    return NULL;
+}
+
+static void wakewriter()
+{
+    if (sleeping && __sync_bool_compare_and_swap(&sleeping, 1, 0))
+    {
+        ssize_t n = write(wake[1], "", 1);
+        (void)n;    // a full pipe means it's awake anyway
+    }
+}
+
+//
+// Starts the writer thread. Messages before this, or if it can't be
+// started, are written straight out.
+//
+void log_open()
+{
+    for (unsigned long i = 0; i < LOG_RING; i++)
+        ring[i].seq = i;
+    if (pipe(wake))
+        return;
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    running = pthread_create(&writer, NULL, writeloop, NULL) == 0;
+    if (running)
+        atexit(log_close);
+}
+
+//
+// Waits for everything logged so far to be written, i.e. before
+// printing something that should come after it.
+//
+void log_flush()
+{
+    if (!running)
+        return;
+    unsigned long upto = head;
+    while (tail < upto)
+    {
+        wakewriter();
+        usleep(1000);
+    }
+}
+
+void log_close()
+{
+    if (!running)
+        return;
+    stopping = true;
+    ssize_t n = write(wake[1], "", 1);
+    (void)n;
+    pthread_join(writer, NULL);
+    running = false;
+    close(wake[0]);
+    close(wake[1]);
+}
+
+//
+// Formats the message into the next free slot. If there isn't one it's
+// counted and dropped rather than waited for.
+//
+void log_write(logsite_t *site, LogLevel level, mstime_t at, const char *fmt, ...)
+{
+    mstime_t now = timer_now();
+
+    // the first caller into a new second starts its count again
+    mstime_t second = now / 1000;
+    mstime_t was = site->second;
+    unsigned suppressed = 0;
+    if (was != second && __sync_bool_compare_and_swap(&site->second, was, second))
+    {
+        site->count = 0;
+        suppressed = __sync_lock_test_and_set(&site->suppressed, 0);
+    }
+    if (__sync_add_and_fetch(&site->count, 1) > LOG_BURST)
+    {
+        __sync_fetch_and_add(&site->suppressed, 1);
+        return;
+    }
+
+    va_list ap;
+    if (!running)
+    {
+        logrec_t r;
+        r.ts = now;
+        r.at = at;
+        r.suppressed = suppressed;
+        r.level = level;
+        va_start(ap, fmt);
+        vsnprintf(r.msg, sizeof(r.msg), fmt, ap);
+        va_end(ap);
+        emit(&r);
+        return;
+    }
+
+    // claim a slot, see Vyukov's bounded MPMC queue
+    logrec_t *r;
+    unsigned long pos;
+    for (;;)
+    {
+        pos = head;
+        r = &ring[pos & (LOG_RING - 1)];
+        long diff = (long)(r->seq - pos);
+        if (diff == 0 && __sync_bool_compare_and_swap(&head, pos, pos + 1))
+            break;
+        if (diff < 0)
+        {
+            __sync_fetch_and_add(&dropped, 1);
+            __sync_fetch_and_add(&site->suppressed, suppressed);
+            return;
+        }
+    }
+
+    r->ts = now;
+    r->at = at;
+    r->suppressed = suppressed;
+    r->level = level;
+    va_start(ap, fmt);
+    vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+    va_end(ap);
+    __sync_synchronize();
+    r->seq = pos + 1;
+    wakewriter();
+}
@@ -0,0 +1,70 @@
+//
+//  log.h
+//
+//  Logging that never holds up the thread doing it. Messages are
+//  formatted straight into a slot of a lock-free ring and a thread of
+//  their own writes them out, so a slow stdout or journald pipe only
+//  ever backs up the ring; when that's full messages are dropped and
+//  counted, never waited for.
+//
+//  Each call site is rate limited to LOG_BURST messages a second, the
+//  rest are counted and the count goes out with the next one that isn't.
+//  Debug messages are only logged with --verbose.
+//
+//  text   - the message as is, warnings and errors to stderr
+//  logfmt - ts=2026-10-17T19:01:00.250Z level=info msg="..."
+//  json   - {"ts":"2026-10-17T19:01:00.250Z","level":"info","msg":"..."}
+//
+//  Times are taken with timer_now() and only turned into dates by the
+//  writer.
+//
+
+#ifndef LOG_H
+  #define LOG_H
+
+#include "sunspy.h"
+
+#define LOG_RING    2048    // messages, a power of 2
+#define LOG_MSG     224     // longest message, the rest is cut off
+#define LOG_BURST   50      // per call site per second
+
+typedef enum
+{ LEVEL_ERROR   = 0
+, LEVEL_WARN    = 1
+, LEVEL_INFO    = 2
+, LEVEL_DEBUG   = 3
+} LogLevel;
+
+typedef enum
+{ LOGFORMAT_TEXT    = 0
+, LOGFORMAT_LOGFMT  = 1
+, LOGFORMAT_JSON    = 2
+} LogFormat;
+
+// Rate limit state, one per call site.
+typedef struct
+{
+    mstime_t second;
+    unsigned count;
+    unsigned suppressed;
+} logsite_t;
+
+// logat() adds a time to the message, " at Sat Oct 17 19:01:00.250 2026"
+// in text, at=... otherwise. It's only formatted by the writer.
+#define logmsg(level, ...) logat(level, 0, __VA_ARGS__)
+#define logat(level, at, ...)                                   \
+    do {                                                        \
+        static logsite_t site_;                                 \
+        if (log_enabled(level))                                 \
+            log_write(&site_, level, at, __VA_ARGS__);          \
+    } while (0)
+
+void log_open(void);
+void log_flush(void);
+void log_close(void);
+bool log_setlevel(const char *name);
+bool log_setformat(const char *name);
+bool log_enabled(LogLevel level);
+void log_write(logsite_t *site, LogLevel level, mstime_t at, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+#endif
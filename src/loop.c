@@ -0,0 +1,282 @@
+//
+//  loop.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#if defined(__linux__)
+  #include <sys/epoll.h>
+  #include <sys/timerfd.h>
+  #ifndef TFD_TIMER_CANCEL_ON_SET
+    #define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+  #endif
+#else
+  #include <poll.h>
+#endif
+
+#include "sunspy.h"
+#include "timer.h"
+#include "log.h"
+#include "loop.h"
+
+typedef struct
+{
+    loopfd_t cb;
+    void *userdata;
+    unsigned events;
+} watch_t;
+
+struct loop_t
+{
+    watch_t *watches;           // indexed by fd
+    int nwatches;
+    bool running;
+
+    mstime_t deadline;          // wall clock, for the event scheduler
+    looptimer_t deadlinecb;
+    void *deadlineud;
+
+    mstime_t timeout;           // monotonic, for curl
+    looptimer_t timeoutcb;
+    void *timeoutud;
+
+    mstime_t drift;             // realtime - monotonic, to spot clock changes
+#if defined(__linux__)
+    int epfd;
+    int tfd;                    // timerfd for the deadline
+#endif
+};
+
+loop_t *loop_new()
+{
+    loop_t *loop = calloc(1, sizeof(loop_t));
+    loop->drift = timer_now() - timer_monotonic();
+#if defined(__linux__)
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->epfd < 0 || loop->tfd < 0)
+    {
+        perror("sunspy: event loop");
+        exit(-1);
+    }
+    struct epoll_event ev = { EPOLLIN, { .fd = loop->tfd } };
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev);
+#endif
+    return loop;
+}
+
+void loop_free(loop_t *loop)
+{
+#if defined(__linux__)
+    close(loop->tfd);
+    close(loop->epfd);
+#endif
+    free(loop->watches);
+    free(loop);
+}
+
+//
+// Calls cb when fd is readable/writable. events of 0 stops watching fd.
+//
+void loop_watch(loop_t *loop, int fd, unsigned events, loopfd_t cb, void *userdata)
+{
+    if (fd >= loop->nwatches)
+    {
+        int n = loop->nwatches ? loop->nwatches : 64;
+        while (n <= fd)
+            n *= 2;
+        loop->watches = realloc(loop->watches, n * sizeof(watch_t));
+        memset(&loop->watches[loop->nwatches], 0, (n - loop->nwatches) * sizeof(watch_t));
+        loop->nwatches = n;
+    }
+
+    watch_t *w = &loop->watches[fd];
+#if defined(__linux__)
+    struct epoll_event ev = { 0, { .fd = fd } };
+    if (events & LOOP_READ)
+        ev.events |= EPOLLIN;
+    if (events & LOOP_WRITE)
+        ev.events |= EPOLLOUT;
+    int op = !events ? EPOLL_CTL_DEL : w->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if ((events || w->events) && epoll_ctl(loop->epfd, op, fd, &ev) && errno != EBADF)
+        perror("sunspy: epoll_ctl");
+#endif
+    w->events = events;
+    w->cb = events ? cb : NULL;
+    w->userdata = userdata;
+}
+
+#if defined(__linux__)
+static void armtimerfd(loop_t *loop)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (loop->deadlinecb)
+    {
+        mstime_t when = loop->deadline > 0 ? loop->deadline : 1;
+        its.it_value.tv_sec = when / 1000;
+        its.it_value.tv_nsec = (when % 1000) * 1000000;
+    }
+    timerfd_settime(loop->tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+#endif
+
+//
+// Calls cb once the wall clock reaches 'when'. A NULL cb cancels.
+//
+void loop_setdeadline(loop_t *loop, mstime_t when, looptimer_t cb, void *userdata)
+{
+    loop->deadline = when;
+    loop->deadlinecb = cb;
+    loop->deadlineud = userdata;
+#if defined(__linux__)
+    armtimerfd(loop);
+#endif
+}
+
+//
+// Calls cb after ms milliseconds. A negative ms cancels.
+//
+void loop_settimeout(loop_t *loop, long ms, looptimer_t cb, void *userdata)
+{
+    loop->timeoutcb = ms < 0 ? NULL : cb;
+    loop->timeout = timer_monotonic() + (ms < 0 ? 0 : ms);
+    loop->timeoutud = userdata;
+}
+
+static void firetimers(loop_t *loop)
+{
+    if (loop->timeoutcb && timer_monotonic() >= loop->timeout)
+    {
+        looptimer_t cb = loop->timeoutcb;
+        loop->timeoutcb = NULL;
+        cb(loop, loop->timeoutud);
+    }
+    if (loop->deadlinecb && timer_now() >= loop->deadline)
+    {
+        looptimer_t cb = loop->deadlinecb;
+        loop->deadlinecb = NULL;
+        cb(loop, loop->deadlineud);
+    }
+}
+
+static void checkclock(loop_t *loop)
+{
+    mstime_t drift = timer_now() - timer_monotonic();
+    mstime_t jump = drift - loop->drift;
+    if (jump > TIMER_JUMP_MS || jump < -TIMER_JUMP_MS)
+    {
+        logmsg(LEVEL_INFO, "Clock changed by %+lldms, re-arming.", jump);
+        loop->drift = drift;
+#if defined(__linux__)
+        armtimerfd(loop);
+#endif
+    }
+}
+
+//
+// Waits up to maxwait ms (-1 for no limit) for something to happen and
+// runs its callbacks.
+//
+void loop_once(loop_t *loop, long maxwait)
+{
+    long wait = maxwait;
+    if (loop->timeoutcb)
+    {
+        mstime_t left = loop->timeout - timer_monotonic();
+        if (left < 0)
+            left = 0;
+        if (wait < 0 || left < wait)
+            wait = (long)left;
+    }
+
+#if defined(__linux__)
+    struct epoll_event evs[64];
+    int n = epoll_wait(loop->epfd, evs, 64, (int)wait);
+    for (int i = 0; i < n; i++)
+    {
+        int fd = evs[i].data.fd;
+        if (fd == loop->tfd)
+        {
+            uint64_t expirations;
+            if (read(loop->tfd, &expirations, sizeof(expirations)) < 0 && errno == ECANCELED)
+                armtimerfd(loop); // the clock was set, aim at the deadline again
+            continue;
+        }
+        if (fd >= loop->nwatches || !loop->watches[fd].cb)
+            continue; // stopped watching during this round
+        unsigned events = 0;
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            events |= LOOP_READ;
+        if (evs[i].events & EPOLLOUT)
+            events |= LOOP_WRITE;
+        loop->watches[fd].cb(loop, fd, events, loop->watches[fd].userdata);
+    }
+#else
+    // no way to sleep to a wall clock time here, wake at least once a
+    // second to notice the deadline and any clock change
+    if (loop->deadlinecb)
+    {
+        mstime_t left = loop->deadline - timer_now();
+        if (left < 0)
+            left = 0;
+        if (left > 1000)
+            left = 1000;
+        if (wait < 0 || left < wait)
+            wait = (long)left;
+    }
+
+    struct pollfd *pfds = malloc((loop->nwatches + 1) * sizeof(struct pollfd));
+    int npfds = 0;
+    for (int fd = 0; fd < loop->nwatches; fd++)
+    {
+        if (!loop->watches[fd].cb)
+            continue;
+        pfds[npfds].fd = fd;
+        pfds[npfds].events = ((loop->watches[fd].events & LOOP_READ) ? POLLIN : 0)
+                           | ((loop->watches[fd].events & LOOP_WRITE) ? POLLOUT : 0);
+        pfds[npfds].revents = 0;
+        npfds++;
+    }
+    int n = poll(pfds, npfds, (int)wait);
+    for (int i = 0; i < npfds && n > 0; i++)
+    {
+        int fd = pfds[i].fd;
+        if (!pfds[i].revents || !loop->watches[fd].cb)
+            continue;
+        unsigned events = 0;
+        if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            events |= LOOP_READ;
+        if (pfds[i].revents & POLLOUT)
+            events |= LOOP_WRITE;
+        loop->watches[fd].cb(loop, fd, events, loop->watches[fd].userdata);
+    }
+    free(pfds);
+#endif
+
+    checkclock(loop);
+    firetimers(loop);
+}
+
+//
+// Runs callbacks until loop_stop() is called.
+//
+void loop_run(loop_t *loop)
+{
+    loop->running = true;
+    while (loop->running)
+        loop_once(loop, -1);
+}
+
+void loop_stop(loop_t *loop)
+{
+    loop->running = false;
+}
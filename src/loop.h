@@ -0,0 +1,33 @@
+//
+//  loop.h
+//
+//  Single threaded event loop. Watches file descriptors, a wall clock
+//  deadline for the event scheduler and a relative timeout for curl, and
+//  calls back when any of them fire. epoll + timerfd on Linux, poll()
+//  everywhere else.
+//
+
+#ifndef LOOP_H
+  #define LOOP_H
+
+#include "sunspy.h"
+
+#define LOOP_READ   1
+#define LOOP_WRITE  2
+
+typedef struct loop_t loop_t;
+typedef void (*loopfd_t)(loop_t *loop, int fd, unsigned events, void *userdata);
+typedef void (*looptimer_t)(loop_t *loop, void *userdata);
+
+loop_t *loop_new(void);
+void loop_free(loop_t *loop);
+
+void loop_watch(loop_t *loop, int fd, unsigned events, loopfd_t cb, void *userdata);
+void loop_setdeadline(loop_t *loop, mstime_t when, looptimer_t cb, void *userdata);
+void loop_settimeout(loop_t *loop, long ms, looptimer_t cb, void *userdata);
+
+void loop_once(loop_t *loop, long maxwait);
+void loop_run(loop_t *loop);
+void loop_stop(loop_t *loop);
+
+#endif
@@ -0,0 +1,411 @@
+//
+//  metrics.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "sunspy.h"
+#include "timer.h"
+#include "timeexpr.h"
+#include "listener.h"
+#include "metrics.h"
+
+#define METRICS_REQUEST_MAX 2048    // of the request head, the rest is ignored
+
+// Bucket upper bounds, in us.
+static const long long latebounds[METRICS_BUCKETS] =
+{ 1000, 2000, 5000, 10000, 50000, 100000, 500000, 1000000
+, 5000000, 10000000, 60000000, 300000000 };
+static const long long httpbounds[METRICS_BUCKETS] =
+{ 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+, 2500000, 5000000, 10000000, 30000000 };
+static const long long solarbounds[METRICS_BUCKETS] =
+{ 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000 };
+
+static histogram_t lateness[NUM_ANCHORS] = { [0 ... NUM_ANCHORS - 1] = { latebounds } };
+static histogram_t solarcalc = { solarbounds };
+static srvmetrics_t *registry = NULL;
+static pthread_mutex_t registrylock = PTHREAD_MUTEX_INITIALIZER;
+
+static void observe(histogram_t *h, long long us)
+{
+    if (us < 0)
+        us = 0;
+    unsigned i = 0;
+    while (i < METRICS_BUCKETS && us > h->bounds[i])
+        i++;
+    __sync_fetch_and_add(&h->counts[i], 1);
+    __sync_fetch_and_add(&h->sum, (unsigned long long)us);
+    unsigned long long max;
+    while ((max = h->max) < (unsigned long long)us && !__sync_bool_compare_and_swap(&h->max, max, us))
+        ;
+}
+
+//
+// The metrics for the named server, made the first time it's asked for.
+// Call from the main thread as servers are loaded, workers only record
+// into what they're given.
+//
+srvmetrics_t *metrics_server(const char *name)
+{
+    pthread_mutex_lock(&registrylock);
+    srvmetrics_t *m;
+    for (m = registry; m; m = m->next)
+        if (!strcmp(m->name, name))
+            break;
+    if (!m)
+    {
+        m = calloc(1, sizeof(srvmetrics_t));
+        m->name = strdup(name);
+        for (unsigned i = 0; i < NUM_ENDPOINTS; i++)
+            m->http[i].bounds = httpbounds;
+        m->next = registry;
+        registry = m;
+    }
+    pthread_mutex_unlock(&registrylock);
+    return m;
+}
+
+void metrics_lateness(int anchor, mstime_t late)
+{
+    if (anchor >= 0 && anchor < NUM_ANCHORS)
+        observe(&lateness[anchor], late * 1000);
+}
+
+//
+// Lateness over every anchor, for timer_report().
+//
+void metrics_alllateness(histogram_t *all)
+{
+    memset(all, 0, sizeof(*all));
+    all->bounds = latebounds;
+    for (unsigned a = 0; a < NUM_ANCHORS; a++)
+    {
+        for (unsigned i = 0; i <= METRICS_BUCKETS; i++)
+            all->counts[i] += lateness[a].counts[i];
+        all->sum += lateness[a].sum;
+        if (lateness[a].max > all->max)
+            all->max = lateness[a].max;
+    }
+}
+
+void metrics_http(srvmetrics_t *m, Endpoint endpoint, int httpcode, double seconds)
+{
+    observe(&m->http[endpoint], (long long)(seconds * 1000000));
+
+    // claim a slot for a code the first time it's seen, a full table drops it
+    int key = httpcode + 1;
+    for (unsigned i = 0; i < METRICS_CODES; i++)
+    {
+        int code = m->codes[i].code;
+        if (!code)
+            code = __sync_val_compare_and_swap(&m->codes[i].code, 0, key) ?: key;
+        if (code == key)
+        {
+            __sync_fetch_and_add(&m->codes[i].count, 1);
+            return;
+        }
+    }
+}
+
+void metrics_solarcalc(long long us)
+{
+    observe(&solarcalc, us);
+}
+
+//
+// Microseconds on the monotonic clock, to time things by.
+//
+long long metrics_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// ---- serving them
+
+typedef struct
+{
+    char in[METRICS_REQUEST_MAX];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outalloc;
+    size_t sent;
+} scraper_t;
+
+static server_t *metricsservers = NULL;
+static listener_t listener;
+
+static void freescraper(void *conn)
+{
+    free(((scraper_t *)conn)->out);
+}
+
+static void put(scraper_t *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void put(scraper_t *s, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if (s->outlen + len + 1 > s->outalloc)
+    {
+        s->outalloc = s->outalloc ? s->outalloc : 4096;
+        while (s->outalloc < s->outlen + len + 1)
+            s->outalloc *= 2;
+        s->out = realloc(s->out, s->outalloc);
+    }
+    va_start(ap, fmt);
+    vsnprintf(s->out + s->outlen, len + 1, fmt, ap);
+    va_end(ap);
+    s->outlen += len;
+}
+
+// Label values are quoted, server names could have anything in them.
+static const char *label(const char *value, char *dest, size_t size)
+{
+    size_t n = 0;
+    for (; *value && n + 3 < size; value++)
+    {
+        if (*value == '\\' || *value == '"' || *value == '\n')
+            dest[n++] = '\\';
+        dest[n++] = *value == '\n' ? 'n' : *value;
+    }
+    dest[n] = 0;
+    return dest;
+}
+
+static void puthistogram(scraper_t *s, const char *name, const char *labels, const histogram_t *h)
+{
+    unsigned long long total = 0;
+    const char *sep = labels[0] ? "," : "";
+    for (unsigned i = 0; i < METRICS_BUCKETS; i++)
+    {
+        total += h->counts[i];
+        put(s, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, h->bounds[i] / 1e6, total);
+    }
+    total += h->counts[METRICS_BUCKETS];
+    put(s, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, total);
+    const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+    put(s, "%s_sum%s%s%s %.6f\n", name, open, labels, close, h->sum / 1e6);
+    put(s, "%s_count%s%s%s %llu\n", name, open, labels, close, total);
+}
+
+static void putheader(scraper_t *s, const char *name, const char *type, const char *help)
+{
+    put(s, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// One line per server of a value the workers publish in server_t.
+#define PUTSERVERS(s, metric, type, help, fmt, field)                           \
+    do {                                                                        \
+        putheader(s, metric, type, help);                                       \
+        for (server_t *sv = metricsservers; sv; sv = sv->next)                  \
+        {                                                                       \
+            char l[256];                                                        \
+            put(s, "%s{server=\"%s\"} " fmt "\n", metric, label(sv->name, l, sizeof(l)), sv->field); \
+        }                                                                       \
+    } while (0)
+
+static void exposition(scraper_t *s)
+{
+    static const char *endpoints[NUM_ENDPOINTS] = { "ssControlActiveMode", "ssControlPassiveMode", "systemInfo" };
+    char labels[300], l[256];
+
+    putheader(s, "sunspy_dispatch_lateness_seconds", "histogram",
+              "How long after its time an event was sent, by the sun time it follows (dusk is sunset).");
+    for (unsigned a = 0; a < NUM_ANCHORS; a++)
+    {
+        snprintf(labels, sizeof(labels), "anchor=\"%s\"", timeexpr_anchorname(a));
+        puthistogram(s, "sunspy_dispatch_lateness_seconds", labels, &lateness[a]);
+    }
+
+    pthread_mutex_lock(&registrylock);
+    srvmetrics_t *servers = registry;
+    pthread_mutex_unlock(&registrylock);
+
+    putheader(s, "sunspy_http_request_seconds", "histogram", "Time taken by requests to SecuritySpy.");
+    for (srvmetrics_t *m = servers; m; m = m->next)
+        for (unsigned i = 0; i < NUM_ENDPOINTS; i++)
+        {
+            snprintf(labels, sizeof(labels), "server=\"%s\",endpoint=\"%s\"",
+                     label(m->name, l, sizeof(l)), endpoints[i]);
+            puthistogram(s, "sunspy_http_request_seconds", labels, &m->http[i]);
+        }
+
+    putheader(s, "sunspy_http_responses_total", "counter", "Replies from SecuritySpy by http code, 0 for none.");
+    for (srvmetrics_t *m = servers; m; m = m->next)
+        for (unsigned i = 0; i < METRICS_CODES && m->codes[i].code; i++)
+            put(s, "sunspy_http_responses_total{server=\"%s\",code=\"%d\"} %llu\n",
+                label(m->name, l, sizeof(l)), m->codes[i].code - 1, m->codes[i].count);
+
+    putheader(s, "sunspy_solar_calc_seconds", "histogram", "Time taken to work out a day's sun times.");
+    puthistogram(s, "sunspy_solar_calc_seconds", "", &solarcalc);
+
+    PUTSERVERS(s, "sunspy_queued_events", "gauge", "Events in the schedule.", "%u", queued);
+    PUTSERVERS(s, "sunspy_inflight_requests", "gauge", "Requests waiting on an answer.", "%u", inflight);
+    PUTSERVERS(s, "sunspy_waiting_commands", "gauge", "Failed or held commands waiting to go again.", "%u", waiting);
+    PUTSERVERS(s, "sunspy_breaker_open", "gauge", "1 while commands are held because the server is down.", "%d", breakeropen);
+    PUTSERVERS(s, "sunspy_events_total", "counter", "Events that have come due.", "%lu", events);
+    PUTSERVERS(s, "sunspy_requests_total", "counter", "Requests sent for them, after batching.", "%lu", requests);
+    PUTSERVERS(s, "sunspy_retries_total", "counter", "Failed commands sent again.", "%lu", retries);
+    PUTSERVERS(s, "sunspy_breaker_trips_total", "counter", "Times the circuit breaker opened.", "%lu", trips);
+    PUTSERVERS(s, "sunspy_reconciled_total", "counter", "Commands sent to put a camera in the right mode.", "%lu", reconciled);
+
+    putheader(s, "sunspy_startup_armed_seconds", "gauge", "Time from starting to the first event being armed.");
+    put(s, "sunspy_startup_armed_seconds %.3f\n", timer_armed() / 1000.0);
+}
+
+//
+// Builds the whole reply once the request head is in. Anything but a
+// GET of / or /metrics is a 404.
+//
+static void respond(scraper_t *s)
+{
+    char method[8] = "", path[64] = "";
+    sscanf(s->in, "%7s %63s", method, path);
+    char *query = strchr(path, '?');
+    if (query)
+        *query = 0;
+
+    scraper_t body;
+    memset(&body, 0, sizeof(body));
+    const char *status = "200 OK";
+    if (strcmp(method, "GET") || (strcmp(path, "/") && strcmp(path, "/metrics")))
+    {
+        status = "404 Not Found";
+        put(&body, "not found\n");
+    }
+    else
+        exposition(&body);
+
+    put(s, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", status, body.outlen);
+    put(s, "%.*s", (int)body.outlen, body.out);
+    free(body.out);
+}
+
+static void onscraper(loop_t *loop, int fd, unsigned events, void *userdata)
+{
+    scraper_t *s = listener_conn(&listener, fd);
+
+    if (!s->out && (events & LOOP_READ))
+    {
+        ssize_t n = read(fd, s->in + s->inlen, sizeof(s->in) - 1 - s->inlen);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            listener_drop(&listener, fd);
+            return;
+        }
+        if (n > 0)
+            s->inlen += n;
+        s->in[s->inlen] = 0;
+        if (strstr(s->in, "\r\n\r\n") || strstr(s->in, "\n\n") || s->inlen == sizeof(s->in) - 1)
+            respond(s);
+    }
+
+    if (s->out)
+    {
+        ssize_t n = write(fd, s->out + s->sent, s->outlen - s->sent);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            listener_drop(&listener, fd);
+            return;
+        }
+        if (n > 0)
+            s->sent += n;
+        if (s->sent == s->outlen)
+        {
+            listener_drop(&listener, fd);
+            return;
+        }
+    }
+    loop_watch(loop, fd, s->out ? LOOP_WRITE : LOOP_READ, onscraper, NULL);
+}
+
+static int listentcp(const char *addr)
+{
+    // "port" or "host:port", only this host unless told otherwise
+    char host[256] = "127.0.0.1";
+    const char *port = addr;
+    const char *colon = strrchr(addr, ':');
+    if (colon)
+    {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        port = colon + 1;
+        if (host[0] == '[' && host[strlen(host) - 1] == ']')
+        {
+            memmove(host, host + 1, strlen(host));
+            host[strlen(host) - 1] = 0;
+        }
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err)
+    {
+        fprintf(stderr, "Bad metrics address %s: %s\n", addr, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int on = 1;
+    if (fd >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 16))
+    {
+        fprintf(stderr, "Can't listen on %s: %s\n", addr, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+//
+// Serves metrics at addr, a path for a unix socket, otherwise "port" or
+// "host:port". Reports queue state for the given servers.
+//
+bool metrics_open(loop_t *loop, const char *addr, server_t *servers)
+{
+    bool local = strchr(addr, '/') != NULL;
+    int fd = local ? listener_unix(addr, "Metrics") : listentcp(addr);
+    if (fd < 0)
+        return false;
+    metricsservers = servers;
+    listener_start(&listener, loop, fd, local ? addr : NULL, sizeof(scraper_t), onscraper, freescraper);
+    return true;
+}
+
+//
+// Servers to report on from now on, after a config reload.
+//
+void metrics_setservers(server_t *servers)
+{
+    metricsservers = servers;
+}
+
+void metrics_close()
+{
+    listener_close(&listener);
+}
@@ -0,0 +1,61 @@
+//
+//  metrics.h
+//
+//  Counters and histograms for scraping by Prometheus. Workers record
+//  with atomic adds and never take a lock; the main thread serves them
+//  as text exposition format over HTTP on a local port or unix socket.
+//
+//    sunspy_dispatch_lateness_seconds{anchor="sunset"}  how late events went out
+//    sunspy_http_request_seconds{server,endpoint}        command and probe times
+//    sunspy_http_responses_total{server,code}            code 0 is no answer
+//    sunspy_solar_calc_seconds                           calc_sunrise_sunset()
+//
+//  Queue depth, retries and the breaker are read from each server_t when
+//  scraped.
+//
+
+#ifndef METRICS_H
+  #define METRICS_H
+
+#include "sunspy.h"
+#include "loop.h"
+
+#define METRICS_BUCKETS     12      // histogram bounds, +Inf is extra
+#define METRICS_CODES       16      // distinct http codes per server
+
+typedef enum
+{ ENDPOINT_ACTIVE   = 0     // ++ssControlActiveMode
+, ENDPOINT_PASSIVE  = 1     // ++ssControlPassiveMode
+, ENDPOINT_INFO     = 2     // ++systemInfo
+, NUM_ENDPOINTS     = 3
+} Endpoint;
+
+typedef struct
+{
+    const long long *bounds;                // upper bounds, in us
+    unsigned long long counts[METRICS_BUCKETS + 1];
+    unsigned long long sum;                 // us
+    unsigned long long max;                 // us
+} histogram_t;
+
+// Kept by server name, so it carries on across config reloads.
+typedef struct srvmetrics_t
+{
+    const char *name;
+    histogram_t http[NUM_ENDPOINTS];
+    struct { int code; unsigned long long count; } codes[METRICS_CODES]; // code+1, 0 until claimed
+    struct srvmetrics_t *next;
+} srvmetrics_t;
+
+srvmetrics_t *metrics_server(const char *name);
+void metrics_lateness(int anchor, mstime_t late);
+void metrics_alllateness(histogram_t *all);
+void metrics_http(srvmetrics_t *m, Endpoint endpoint, int httpcode, double seconds);
+void metrics_solarcalc(long long us);
+long long metrics_us(void);
+
+bool metrics_open(loop_t *loop, const char *addr, server_t *servers);
+void metrics_setservers(server_t *servers);
+void metrics_close(void);
+
+#endif
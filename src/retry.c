@@ -0,0 +1,95 @@
+//
+//  retry.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sunspy.h"
+#include "retry.h"
+
+//
+// Milliseconds to wait before retry number 'attempt' (from 1). Doubles
+// each time up to RETRY_MAX_MS, and is picked at random from the upper
+// half of that so cameras that failed together don't all come back at
+// once.
+//
+mstime_t retry_backoff(unsigned attempt, unsigned *seed)
+{
+    mstime_t delay = RETRY_BASE_MS;
+    for (unsigned i = 1; i < attempt && delay < RETRY_MAX_MS; i++)
+        delay *= 2;
+    if (delay > RETRY_MAX_MS)
+        delay = RETRY_MAX_MS;
+    return delay / 2 + (mstime_t)(rand_r(seed) % (unsigned)(delay / 2 + 1));
+}
+
+//
+// True if a request that got 'httpcode' might go through next time. No
+// answer, a server error or being told to slow down, but not a request
+// the server didn't like, that will get the same answer again.
+//
+bool retry_worthwhile(int httpcode)
+{
+    return httpcode == 0 || httpcode == 408 || httpcode == 429 || httpcode >= 500;
+}
+
+void breaker_init(breaker_t *b)
+{
+    b->state = BREAKER_CLOSED;
+    b->failures = 0;
+    b->cooldown = BREAKER_COOLDOWN_MS;
+    b->until = 0;
+    b->trips = 0;
+}
+
+//
+// True once an open breaker's cooldown is up, it's now half open and
+// the caller should check whether the server is back.
+//
+bool breaker_trial(breaker_t *b, mstime_t now)
+{
+    if (b->state != BREAKER_OPEN || now < b->until)
+        return false;
+    b->state = BREAKER_HALFOPEN;
+    return true;
+}
+
+//
+// Records how a request went, 'ok' if the server answered at all. True
+// if that opened or closed the breaker.
+//
+bool breaker_record(breaker_t *b, bool ok, mstime_t now)
+{
+    if (ok)
+    {
+        b->failures = 0;
+        if (b->state == BREAKER_CLOSED)
+            return false;
+        b->state = BREAKER_CLOSED;
+        b->cooldown = BREAKER_COOLDOWN_MS;
+        return true;
+    }
+
+    b->failures++;
+    if (b->state == BREAKER_OPEN)
+        return false;   // stragglers sent before it opened
+    if (b->state == BREAKER_CLOSED && b->failures < BREAKER_FAILURES)
+        return false;
+
+    // a failed check keeps it open for longer
+    if (b->state == BREAKER_HALFOPEN)
+    {
+        b->cooldown *= 2;
+        if (b->cooldown > BREAKER_MAX_COOLDOWN_MS)
+            b->cooldown = BREAKER_MAX_COOLDOWN_MS;
+    }
+    else
+        b->trips++;
+    b->state = BREAKER_OPEN;
+    b->until = now + b->cooldown;
+    return true;
+}
@@ -0,0 +1,44 @@
+//
+//  retry.h
+//
+//  When to try a failed command again, and a circuit breaker per server
+//  so one that's down isn't sent everything as it comes due. After
+//  BREAKER_FAILURES failures in a row the breaker opens and commands are
+//  held; once the cooldown is up a single health check goes out, and if
+//  it's answered the breaker closes and the held commands are sent.
+//
+
+#ifndef RETRY_H
+  #define RETRY_H
+
+#include "sunspy.h"
+
+#define RETRY_BASE_MS           2000            // first retry, doubles each time
+#define RETRY_MAX_MS            (5*60*1000)
+#define BREAKER_FAILURES        5
+#define BREAKER_COOLDOWN_MS     (30*1000)       // first cooldown, doubles while it stays down
+#define BREAKER_MAX_COOLDOWN_MS (10*60*1000)
+
+typedef enum
+{ BREAKER_CLOSED    = 0 // sending as normal
+, BREAKER_OPEN      = 1 // holding commands until 'until'
+, BREAKER_HALFOPEN  = 2 // a health check is out
+} BreakerState;
+
+typedef struct
+{
+    BreakerState state;
+    unsigned failures;      // in a row
+    mstime_t cooldown;      // ms, how long it opens for next time
+    mstime_t until;         // while open
+    unsigned long trips;    // times it's opened
+} breaker_t;
+
+mstime_t retry_backoff(unsigned attempt, unsigned *seed);
+bool retry_worthwhile(int httpcode);
+
+void breaker_init(breaker_t *b);
+bool breaker_trial(breaker_t *b, mstime_t now);
+bool breaker_record(breaker_t *b, bool ok, mstime_t now);
+
+#endif
@@ -0,0 +1,186 @@
+//
+//  scheduler.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sunspy.h"
+#include "scheduler.h"
+
+// A queued event's slot and starttime are stored atomically, the control
+// socket reads them from another thread, see listnext().
+#define setslot(e, v)   __atomic_store_n(&(e)->slot, (v), __ATOMIC_RELAXED)
+
+// One queue per thread, so each server's worker has its own.
+static __thread camevent_t **heap = NULL;
+static __thread unsigned heapsize = 0;
+static __thread unsigned heapalloc = 0;
+static __thread unsigned long nextseq = 0;
+
+//
+// true if a should fire before b
+//
+static inline bool before(const camevent_t *a, const camevent_t *b)
+{
+    if (a->starttime != b->starttime)
+        return a->starttime < b->starttime;
+    return a->seq < b->seq;
+}
+
+static inline void place(camevent_t *event, unsigned slot)
+{
+    heap[slot] = event;
+    setslot(event, slot);
+}
+
+static void siftup(unsigned slot)
+{
+    camevent_t *e = heap[slot];
+    while (slot > 0)
+    {
+        unsigned parent = (slot - 1) / 2;
+        if (!before(e, heap[parent]))
+            break;
+        place(heap[parent], slot);
+        slot = parent;
+    }
+    place(e, slot);
+}
+
+static void siftdown(unsigned slot)
+{
+    camevent_t *e = heap[slot];
+    while (true)
+    {
+        unsigned child = slot * 2 + 1;
+        if (child >= heapsize)
+            break;
+        if (child + 1 < heapsize && before(heap[child + 1], heap[child]))
+            child++;
+        if (!before(heap[child], e))
+            break;
+        place(heap[child], slot);
+        slot = child;
+    }
+    place(e, slot);
+}
+
+//
+// Queue an event. The event must not already be queued.
+//
+void sched_add(camevent_t *event)
+{
+    if (heapsize == heapalloc)
+    {
+        heapalloc = heapalloc ? heapalloc * 2 : 64;
+        heap = realloc(heap, heapalloc * sizeof(camevent_t *));
+        if (!heap)
+        {
+            fprintf(stderr, "Out of memory growing event queue.\n");
+            exit(-1);
+        }
+    }
+    event->seq = nextseq++;
+    heap[heapsize] = event;
+    setslot(event, heapsize);
+    siftup(heapsize++);
+}
+
+//
+// Cancel a queued event, does not free.
+//
+void sched_remove(camevent_t *event)
+{
+    unsigned slot = event->slot;
+    if (slot == SCHED_NONE || slot >= heapsize || heap[slot] != event)
+        return;
+
+    setslot(event, SCHED_NONE);
+    if (slot == --heapsize)
+        return;
+
+    // move the last event into the hole and restore heap order
+    place(heap[heapsize], slot);
+    if (slot > 0 && before(heap[slot], heap[(slot - 1) / 2]))
+        siftup(slot);
+    else
+        siftdown(slot);
+}
+
+//
+// Move an event to a new time. Queues it if it isn't already.
+// A rescheduled event goes behind others already due at the same time.
+//
+void sched_reschedule(camevent_t *event, mstime_t starttime)
+{
+    sched_remove(event);
+    __atomic_store_n(&event->starttime, starttime, __ATOMIC_RELAXED);
+    sched_add(event);
+}
+
+//
+// Puts event in old's place in the queue, same time and order, and
+// takes old out. For swapping in a reloaded copy of an event.
+//
+void sched_replace(camevent_t *old, camevent_t *event)
+{
+    unsigned slot = old->slot;
+    if (slot == SCHED_NONE || slot >= heapsize || heap[slot] != old)
+        return;
+
+    __atomic_store_n(&event->starttime, old->starttime, __ATOMIC_RELAXED);
+    event->seq = old->seq;
+    setslot(old, SCHED_NONE);
+    place(event, slot);
+}
+
+//
+// Next event to fire, or NULL.
+//
+camevent_t *sched_peek(void)
+{
+    return heapsize ? heap[0] : NULL;
+}
+
+//
+// Remove and return the next event to fire, or NULL.
+//
+camevent_t *sched_pop(void)
+{
+    camevent_t *e = sched_peek();
+    if (e)
+        sched_remove(e);
+    return e;
+}
+
+unsigned sched_count(void)
+{
+    return heapsize;
+}
+
+//
+// Drops all events, does not free them.
+//
+void sched_clear(void)
+{
+    for (unsigned i = 0; i < heapsize; i++)
+        setslot(heap[i], SCHED_NONE);
+    heapsize = 0;
+}
+
+//
+// Drops all events and frees this thread's queue, for a worker that's
+// finishing.
+//
+void sched_free(void)
+{
+    sched_clear();
+    free(heap);
+    heap = NULL;
+    heapalloc = 0;
+    nextseq = 0;
+}
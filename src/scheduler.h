@@ -0,0 +1,26 @@
+//
+//  scheduler.h
+//
+//  Event queue for camevent_t records. Binary min-heap ordered by
+//  starttime (ties broken by insertion order), so insert, pop and
+//  cancel are all O(log n). Each thread has a queue of its own.
+//
+
+#ifndef SCHEDULER_H
+  #define SCHEDULER_H
+
+#include "sunspy.h"
+
+#define SCHED_NONE ((unsigned)-1)   // camevent_t.slot when not queued
+
+void sched_add(camevent_t *event);
+void sched_remove(camevent_t *event);
+void sched_reschedule(camevent_t *event, mstime_t starttime);
+void sched_replace(camevent_t *old, camevent_t *event);
+camevent_t *sched_peek(void);
+camevent_t *sched_pop(void);
+unsigned sched_count(void);
+void sched_clear(void);
+void sched_free(void);
+
+#endif
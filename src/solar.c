@@ -0,0 +1,153 @@
+//
+//  solar.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "sunspy.h"
+#include "sunriset.h"
+#include "solar.h"
+
+#define JD_2000_JAN_0   2451543.5   // daysSince2000 0, at 0h UT
+#define NOAA_ITERATIONS 3           // each gets ~100x closer, seconds after two
+#define NOAA_DAYLIGHT   -0.833      // sun's center at rise and set, refraction and radius
+
+static const struct
+{
+    const char *name;
+    void (*riset)(sunrise_t *sr);
+} engines[NUM_SOLAR_ENGINES] = {
+    { "fast", sunriset },
+    { "noaa", sunriset_noaa },
+};
+
+bool solar_byname(const char *name, SolarEngine *engine)
+{
+    for (unsigned i = 0; i < NUM_SOLAR_ENGINES; i++)
+        if (!strcasecmp(name, engines[i].name))
+        {
+            *engine = i;
+            return true;
+        }
+    return false;
+}
+
+const char *solar_name(SolarEngine engine)
+{
+    return engines[engine].name;
+}
+
+void solar_riset(SolarEngine engine, sunrise_t *sr)
+{
+    engines[engine].riset(sr);
+}
+
+//
+// The sun's declination (degrees), the equation of time (minutes) and
+// its distance (AU) at Julian day jd, UT. NOAA's spreadsheet formulas.
+//
+static void noaa_sun(double jd, double *decl, double *eqtime, double *r)
+{
+    double T = (jd - 2451545.0) / 36525.0;  // Julian centuries from J2000
+
+    double L0 = revolution(280.46646 + T * (36000.76983 + T * 0.0003032));  // mean longitude
+    double M = 357.52911 + T * (35999.05029 - 0.0001537 * T);               // mean anomaly
+    double e = 0.016708634 - T * (0.000042037 + 0.0000001267 * T);          // orbit eccentricity
+    double C = sind(M) * (1.914602 - T * (0.004817 + 0.000014 * T))
+             + sind(2 * M) * (0.019993 - 0.000101 * T)
+             + sind(3 * M) * 0.000289;                                      // equation of center
+    *r = 1.000001018 * (1 - e * e) / (1 + e * cosd(M + C));
+
+    double omega = 125.04 - 1934.136 * T;
+    double lambda = L0 + C - 0.00569 - 0.00478 * sind(omega);               // apparent longitude
+    double eps0 = 23.0 + (26.0 + (21.448 - T * (46.815 + T * (0.00059 - T * 0.001813))) / 60.0) / 60.0;
+    double eps = eps0 + 0.00256 * cosd(omega);                              // corrected obliquity
+    *decl = asind(sind(eps) * sind(lambda));
+
+    double y = tand(eps / 2);
+    y *= y;
+    *eqtime = 4.0 * RADIAN_TO_DEGREE * (y * sind(2 * L0) - 2 * e * sind(M) + 4 * e * y * sind(M) * cosd(2 * L0)
+                                        - 0.5 * y * y * sind(4 * L0) - 1.25 * e * e * sind(2 * M));
+}
+
+//
+// Solar noon, in hours GMT, for the sun as it is 'at' hours into the day.
+//
+static double noaa_noon(double jd0, double lon, double at, double *decl, double *r)
+{
+    double eqtime;
+    noaa_sun(jd0 + at / 24.0, decl, &eqtime, r);
+    return (720.0 - 4.0 * lon - eqtime) / 60.0;
+}
+
+//
+// The hour angle, in hours, at which the sun's center crosses altit.
+// False if it doesn't, cost says which way.
+//
+static bool hourangle(double lat, double decl, double altit, double *ha, double *cost)
+{
+    *cost = (sind(altit) - sind(lat) * sind(decl)) / (cosd(lat) * cosd(decl));
+    if (fabs(*cost) >= 1.0)
+        return false;
+    *ha = acosd(*cost) / 15.0;
+    return true;
+}
+
+//
+// sunriset() with NOAA's formulas, the sun's position taken at each
+// event instead of once for the day. Times are on the same day as
+// sunriset()'s, noon in 0..24 hours GMT, and a twilight angle is for
+// the sun's center. Daylight is NOAA's -0.833 degrees, which allows for
+// refraction and the sun's radius both, rather than sunriset()'s upper
+// limb at -50'.
+//
+void sunriset_noaa(sunrise_t *sr)
+{
+    double jd0 = JD_2000_JAN_0 + sr->daysSince2000;
+    double lat = sr->latitude, lon = rev180(sr->longitude);
+    double decl, r, ha, cost;
+
+    double noon = 12.0 - lon / 15.0;
+    for (int i = 0; i < NOAA_ITERATIONS; i++)
+        noon = noaa_noon(jd0, lon, noon, &decl, &r);
+    noon -= 24.0 * floor(noon / 24.0);
+    noaa_noon(jd0, lon, noon, &decl, &r);
+    sr->noonTime = noon;
+
+    double altit = sr->twilightAngle;
+    if (altit == TWILIGHT_ANGLE_DAYLIGHT)
+        altit = NOAA_DAYLIGHT;
+
+    if (!hourangle(lat, decl, altit, &ha, &cost))
+    {
+        sr->dayType = cost >= 1.0 ? DAYTYPE_POLAR_NIGHT : DAYTYPE_POLAR_DAY;
+        sr->riseTime = NOT_SET;
+        sr->setTime = NOT_SET;
+        return;
+    }
+    sr->dayType = DAYTYPE_NORMAL;
+
+    // rise and set each from where the sun is then, starting from noon's
+    for (int side = -1; side <= 1; side += 2)
+    {
+        double t = noon + side * ha;
+        for (int i = 0; i < NOAA_ITERATIONS; i++)
+        {
+            double d, h, c;
+            double n = noaa_noon(jd0, lon, t, &d, &r);
+            if (!hourangle(lat, d, altit, &h, &c))
+                break;  // only just rises or sets, noon's will do
+            t = n + (n - noon > 12.0 ? -24.0 : n - noon < -12.0 ? 24.0 : 0.0) + side * h;
+        }
+        if (side < 0)
+            sr->riseTime = t;
+        else
+            sr->setTime = t;
+    }
+}
@@ -0,0 +1,34 @@
+//
+//  solar.h
+//
+//  Solar engines, chosen with solar_engine in the config. Each fills in
+//  a sunrise_t's rise, noon and set times and day type from its site,
+//  day and twilight angle, the same way sunriset() does.
+//
+//    fast - Paul Schlyter's sunriset(). The sun's position is taken once
+//           a day at 0h UT and cached for every site, so it's cheap but
+//           can be a minute or more out, worse towards the poles.
+//    noaa - NOAA's solar calculator (after Meeus), with the sun's
+//           position worked out again at each event. Within seconds of
+//           the full algorithm, below +/-72 degrees latitude.
+//
+//  --benchmark compares them over latitudes and years.
+//
+
+#ifndef SOLAR_H
+  #define SOLAR_H
+
+#include "sunspy.h"
+
+typedef enum
+{ SOLAR_FAST        = 0
+, SOLAR_NOAA        = 1
+, NUM_SOLAR_ENGINES = 2
+} SolarEngine;
+
+bool solar_byname(const char *name, SolarEngine *engine);
+const char *solar_name(SolarEngine engine);
+void solar_riset(SolarEngine engine, sunrise_t *sr);
+void sunriset_noaa(sunrise_t *sr);
+
+#endif
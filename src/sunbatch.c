@@ -0,0 +1,346 @@
+//
+//  sunbatch.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+//  The per day part of sunriset() (GMST0, the Sun's RA/dec/distance) is
+//  worked out once per distinct day in the batch. The per site part (local
+//  sidereal time, diurnal arc) runs four sites at a time on vectors, using
+//  polynomial sin/acos instead of libm.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "sunspy.h"
+#include "sunriset.h"
+#include "sunbatch.h"
+
+#if defined(__GNUC__)
+  #define ALWAYS  static inline __attribute__((always_inline))
+#else
+  #define ALWAYS  static inline
+#endif
+
+#define CHUNK     256   // sites per pass, sizes the scratch arrays below
+#define DAYCACHE  512   // direct mapped, a bit more than a year of days
+
+// The parts of sunriset() that only depend on the day. Backed by the shared
+// sun_dayterms() cache, this copy adds the trig and skips its lock.
+typedef struct
+{
+    unsigned int day;
+    bool valid;
+    double gmst0;
+    double sra;
+    double sindec, cosdec;
+    double sradius;
+} dayterms_t;
+
+static void getdayterms(dayterms_t *cache, unsigned int day, dayterms_t **out)
+{
+    dayterms_t *dt = &cache[day % DAYCACHE];
+    if (!dt->valid || dt->day != day)
+    {
+        double sr, sdec;
+        dt->day = day;
+        dt->valid = true;
+        sun_dayterms(day, &dt->gmst0, &dt->sra, &sdec, &sr);
+        dt->sindec = sind(sdec);
+        dt->cosdec = cosd(sdec);
+        dt->sradius = 0.2666 / sr;
+    }
+    *out = dt;
+}
+
+// Scratch arrays for one chunk, padded so the vector loop can run past count.
+typedef struct
+{
+    double lat[CHUNK], lon[CHUNK];
+    double gmst0[CHUNK], sra[CHUNK];
+    double sindec[CHUNK], cosdec[CHUNK];
+    double altit[CHUNK];
+} scratch_t;
+
+static unsigned fillscratch(const sunbatch_t *b, unsigned start, dayterms_t *cache, scratch_t *s)
+{
+    unsigned n = b->count - start;
+    if (n > CHUNK)
+        n = CHUNK;
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        dayterms_t *dt;
+        getdayterms(cache, b->daysSince2000[start + i], &dt);
+
+        double angle = b->twilightAngle[start + i];
+        s->lat[i] = b->latitude[start + i];
+        s->lon[i] = b->longitude[start + i];
+        s->gmst0[i] = dt->gmst0;
+        s->sra[i] = dt->sra;
+        s->sindec[i] = dt->sindec;
+        s->cosdec[i] = dt->cosdec;
+        // do correction for upper limb, same as sunriset()
+        s->altit[i] = (angle == TWILIGHT_ANGLE_DAYLIGHT) ? angle - dt->sradius : angle;
+    }
+    for (unsigned i = n; i < CHUNK; i++)
+    {
+        s->lat[i] = s->lon[i] = s->gmst0[i] = s->sra[i] = s->altit[i] = 0;
+        s->sindec[i] = 0;
+        s->cosdec[i] = 1;
+    }
+    return n;
+}
+
+ALWAYS void storeresult(const sunbatch_t *b, unsigned i, double tsouth, double cost, double t)
+{
+    if (fabs(cost) < 1.0)
+    {
+        b->dayType[i]  = DAYTYPE_NORMAL;
+        b->riseTime[i] = tsouth - t;
+        b->noonTime[i] = tsouth;
+        b->setTime[i]  = tsouth + t;
+    }
+    else
+    {
+        b->dayType[i]  = (cost >= 1.0) ? DAYTYPE_POLAR_NIGHT : DAYTYPE_POLAR_DAY;
+        b->riseTime[i] = NOT_SET;
+        b->noonTime[i] = tsouth;
+        b->setTime[i]  = NOT_SET;
+    }
+}
+
+//
+// Scalar fallback, the same math as sunriset() with libm.
+//
+static void chunk_scalar(const sunbatch_t *b, unsigned start, unsigned n, const scratch_t *s)
+{
+    for (unsigned i = 0; i < n; i++)
+    {
+        double sidtime = revolution(s->gmst0[i] + 180.0 + s->lon[i]);
+        double tsouth = 12.0 - rev180(sidtime - s->sra[i])/15.0;
+        double cost = (sind(s->altit[i]) - sind(s->lat[i]) * s->sindec[i]) / (cosd(s->lat[i]) * s->cosdec[i]);
+        double t = fabs(cost) < 1.0 ? acosd(cost)/15.0 : 0;
+        storeresult(b, start + i, tsouth, cost, t);
+    }
+}
+
+#if defined(__GNUC__)
+
+#if !defined(__clang__)
+  // everything taking vectors is inlined, the ABI note doesn't apply
+  #pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+typedef double vd __attribute__((vector_size(32)));
+typedef long long vl __attribute__((vector_size(32)));
+#define VW 4
+
+#define VSPLAT(x)   ((vd){(x), (x), (x), (x)})
+
+ALWAYS vd vload(const double *p) { vd v; memcpy(&v, p, sizeof(v)); return v; }
+ALWAYS vd vsel(vl mask, vd a, vd b) { return (vd)(((vl)a & mask) | ((vl)b & ~mask)); }
+ALWAYS vd vabs(vd x) { return vsel(x < 0.0, -x, x); }
+
+ALWAYS vd vfloor(vd x)
+{
+    // round to nearest by pushing the fraction off the end of the mantissa,
+    // good for |x| < 2^51 which is plenty for angles.
+    const vd magic = VSPLAT(6755399441055744.0);
+    vd r = (x + magic) - magic;
+    return r - vsel(r > x, VSPLAT(1.0), VSPLAT(0.0));
+}
+
+ALWAYS vd vrevolution(vd x) { return x - 360.0 * vfloor(x / 360.0); }
+
+ALWAYS vd vrev180(vd x)
+{
+    vd y = vrevolution(x);
+    return vsel(y <= 180.0, y, y - 360.0);
+}
+
+#if defined(__SSE2__)
+ALWAYS vd vsqrt(vd x)
+{
+    // stay in registers, libm sqrt() means a call and an AVX/SSE switch per lane
+    __m128d lo = _mm_sqrt_pd((__m128d){ x[0], x[1] });
+    __m128d hi = _mm_sqrt_pd((__m128d){ x[2], x[3] });
+    return (vd){ lo[0], lo[1], hi[0], hi[1] };
+}
+#else
+ALWAYS vd vsqrt(vd x)
+{
+    for (int i = 0; i < VW; i++)
+        x[i] = sqrt(x[i]);
+    return x;
+}
+#endif
+
+//
+// sin of an angle in degrees. Folds into -90..90 and uses the Taylor series
+// to x^15, error < 1e-11.
+//
+ALWAYS vd vsind(vd x)
+{
+    x = x - 360.0 * vfloor(x / 360.0 + 0.5);
+    x = vsel(x > 90.0, 180.0 - x, x);
+    x = vsel(x < -90.0, -180.0 - x, x);
+
+    vd r = x * DEGREE_TO_RADIAN;
+    vd z = r * r;
+    vd p = VSPLAT(-1.0/1307674368000.0);
+    p = p * z + 1.0/6227020800.0;
+    p = p * z - 1.0/39916800.0;
+    p = p * z + 1.0/362880.0;
+    p = p * z - 1.0/5040.0;
+    p = p * z + 1.0/120.0;
+    p = p * z - 1.0/6.0;
+    return r + r * z * p;
+}
+
+ALWAYS vd vcosd(vd x) { return vsind(x + 90.0); }
+
+//
+// acos in degrees for -1 <= x <= 1, via the Cephes asin() rational
+// approximations.
+//
+ALWAYS vd vacosd(vd x)
+{
+    vd a = vabs(x);
+
+    // |x| <= 0.625
+    vd z = a * a;
+    vd pn = ((((4.253011369004428248960E-3 * z - 6.019598008014123785661E-1) * z
+              + 5.444622390564711410273E0) * z - 1.626247967210700244449E1) * z
+              + 1.956261983317594739197E1) * z - 8.198089802484824371615E0;
+    vd pd = ((((z - 1.474091372988853791896E1) * z + 7.049610280856842141659E1) * z
+              - 1.471791292232726029859E2) * z + 1.395105614657485689735E2) * z
+              - 4.918853881490881290097E1;
+    vd small = a + a * z * pn / pd;
+
+    // |x| > 0.625
+    vd zz = 1.0 - a;
+    vd rn = (((2.967721961301243206100E-3 * zz - 5.634242780008963776856E-1) * zz
+              + 6.968710824104713396794E0) * zz - 2.556901049652824852289E1) * zz
+              + 2.853665548261061424989E1;
+    vd rd = (((zz - 2.194779531642920639778E1) * zz + 1.470656354026814941758E2) * zz
+              - 3.838770957603691357202E2) * zz + 3.424398657913078477438E2;
+    vd p = zz * rn / rd;
+    zz = vsqrt(zz + zz);
+    vd big = (PI/4 - zz) - (zz * p - 6.123233995736765886130E-17) + PI/4;
+
+    vd asin = vsel(a > 0.625, big, small);
+    asin = vsel(x < 0.0, -asin, asin);
+    return (PI/2 - asin) * RADIAN_TO_DEGREE;
+}
+
+ALWAYS void chunk_vector(const sunbatch_t *b, unsigned start, unsigned n, const scratch_t *s)
+{
+    for (unsigned i = 0; i < n; i += VW)
+    {
+        vd lat = vload(&s->lat[i]);
+
+        // compute local sideral time of this moment, then when the sun is at south
+        vd sidtime = vrevolution(vload(&s->gmst0[i]) + 180.0 + vload(&s->lon[i]));
+        vd tsouth = 12.0 - vrev180(sidtime - vload(&s->sra[i])) / 15.0;
+
+        // the diurnal arc that the sun traverses to reach the specified altitide
+        vd cost = (vsind(vload(&s->altit[i])) - vsind(lat) * vload(&s->sindec[i]))
+                / (vcosd(lat) * vload(&s->cosdec[i]));
+        vd clamped = vsel(cost > 1.0, VSPLAT(1.0), cost);
+        clamped = vsel(clamped < -1.0, VSPLAT(-1.0), clamped);
+        vd t = vacosd(clamped) / 15.0;
+
+        for (unsigned j = 0; j < VW && i + j < n; j++)
+            storeresult(b, start + i + j, tsouth[j], cost[j], t[j]);
+    }
+}
+
+static void chunk_baseline(const sunbatch_t *b, unsigned start, unsigned n, const scratch_t *s)
+{
+    chunk_vector(b, start, n, s);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_AVX2_CLONE 1
+__attribute__((target("avx2,fma")))
+static void chunk_avx2(const sunbatch_t *b, unsigned start, unsigned n, const scratch_t *s)
+{
+    chunk_vector(b, start, n, s);
+}
+#endif
+
+#endif // __GNUC__
+
+static SunbatchIsa selected = SUNBATCH_AUTO;
+
+//
+// Picks the kernel to use, SUNBATCH_AUTO for the best available.
+// Returns what was actually picked.
+//
+SunbatchIsa sunbatch_isa(SunbatchIsa want)
+{
+    SunbatchIsa best = SUNBATCH_SCALAR;
+#if defined(__GNUC__)
+    best = SUNBATCH_VECTOR;
+  #ifdef HAVE_AVX2_CLONE
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        best = SUNBATCH_AVX2;
+  #endif
+#endif
+    selected = (want == SUNBATCH_AUTO || want > best) ? best : want;
+    return selected;
+}
+
+const char *sunbatch_isaname(SunbatchIsa isa)
+{
+    switch (isa)
+    {
+        case SUNBATCH_SCALAR: return "scalar";
+        case SUNBATCH_VECTOR: return "vector";
+        case SUNBATCH_AVX2:   return "avx2";
+        default:              return "auto";
+    }
+}
+
+//
+// Fills in rise, noon, set and day type for every entry in the batch.
+//
+void sunriset_batch(const sunbatch_t *b)
+{
+    if (selected == SUNBATCH_AUTO)
+        sunbatch_isa(SUNBATCH_AUTO);
+
+    dayterms_t *cache = calloc(DAYCACHE, sizeof(dayterms_t));
+    scratch_t *s = malloc(sizeof(scratch_t));
+
+    for (unsigned start = 0; start < b->count; start += CHUNK)
+    {
+        unsigned n = fillscratch(b, start, cache, s);
+        switch (selected)
+        {
+#if defined(__GNUC__)
+  #ifdef HAVE_AVX2_CLONE
+            case SUNBATCH_AVX2:
+                chunk_avx2(b, start, n, s);
+                break;
+  #endif
+            case SUNBATCH_VECTOR:
+                chunk_baseline(b, start, n, s);
+                break;
+#endif
+            default:
+                chunk_scalar(b, start, n, s);
+                break;
+        }
+    }
+
+    free(s);
+    free(cache);
+}
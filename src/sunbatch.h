@@ -0,0 +1,42 @@
+//
+//  sunbatch.h
+//
+//  Batch version of sunriset() for precomputing many sites and days at
+//  once. Inputs and outputs are structure-of-arrays; results match
+//  sunriset() to within SUNBATCH_MAX_ERROR hours.
+//
+
+#ifndef SUNBATCH_H
+  #define SUNBATCH_H
+
+#include "sunspy.h"
+
+#define SUNBATCH_MAX_ERROR  (1e-6)  // hours, ~4ms
+
+typedef enum
+{ SUNBATCH_AUTO   = 0   // best the cpu supports
+, SUNBATCH_SCALAR = 1   // plain sunriset() math, one at a time
+, SUNBATCH_VECTOR = 2   // 4 wide compiler vectors on the baseline instruction set
+, SUNBATCH_AVX2   = 3
+} SunbatchIsa;
+
+typedef struct
+{
+    unsigned count;
+
+    const double *latitude;             // Degrees -S/N
+    const double *longitude;            // Degrees E/-W
+    const unsigned int *daysSince2000;
+    const double *twilightAngle;        // Degrees, -ve = below horizon
+
+    double *riseTime;                   // Unit: hours, GMT, NOT_SET if no rise
+    double *noonTime;
+    double *setTime;
+    DayType *dayType;
+} sunbatch_t;
+
+SunbatchIsa sunbatch_isa(SunbatchIsa want);
+const char *sunbatch_isaname(SunbatchIsa isa);
+void sunriset_batch(const sunbatch_t *batch);
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 #include "sunspy.h"
 #include "sunriset.h"
 
@@ -56,11 +57,13 @@ void sunriset (sunrise_t *pTarget)
   double sidtime;    /* local sidereal time */
   double altit;      /* sun's altitude: angle to the sun relative to the mathematical (flat-earth) horizon */
 
-  /* compute local sideral time of this moment. */
-  sidtime = revolution (GMST0(pTarget->daysSince2000) + 180.0 + pTarget->longitude);
+  double gmst0;
+
+  /* sun's ra + decl and GMST0 at this moment, these only depend on the day */
+  sun_dayterms (pTarget->daysSince2000, &gmst0, &sra, &sdec, &sr);
 
-  /* compute sun's ra + decl at this moment */
-  sun_RA_dec (pTarget->daysSince2000, &sra, &sdec, &sr );
+  /* compute local sideral time of this moment. */
+  sidtime = revolution (gmst0 + 180.0 + pTarget->longitude);
 
   /* compute time when sun is at south - in hours GMT. "12.00" == noon. "15" == 180degrees/12hours */
   tsouth = 12.0 - rev180(sidtime - sra)/15.0;
@@ -77,7 +80,7 @@ void sunriset (sunrise_t *pTarget)
   /* compute the diurnal arc that the sun traverses to reach the specified altitide altit: */
   double cost = (sind(altit) - sind(pTarget->latitude) * sind(sdec)) / (cosd(pTarget->latitude) * cosd(sdec));
 
-  if (abs(cost) < 1.0)
+  if (fabs(cost) < 1.0)
   { pTarget->dayType = DAYTYPE_NORMAL; 
     t = acosd(cost)/15.0;    /* the diurnal arc, hours */
 
@@ -131,7 +134,7 @@ void sunpos (double d, double *lon, double *r)
 void sun_RA_dec (double d, double *RA, double *dec, double *r)
 {
   double lon, obl_ecl;
-  double xs, ys, zs;
+  double xs, ys;
   double xe, ye, ze;
   
   /* Compute Sun's ecliptical coordinates */
@@ -140,7 +143,7 @@ void sun_RA_dec (double d, double *RA, double *dec, double *r)
   /* Compute ecliptic rectangular coordinates */
   xs = *r * cosd(lon);
   ys = *r * sind(lon);
-  zs = 0; /* because the Sun is always in the ecliptic plane! */
+  /* zs = 0, because the Sun is always in the ecliptic plane! */
 
   /* Compute obliquity of ecliptic (inclination of Earth's axis) */
   obl_ecl = 23.4393 - 3.563E-7 * d;
@@ -156,6 +159,61 @@ void sun_RA_dec (double d, double *RA, double *dec, double *r)
       
 }
 
+/************************************************************************/
+/* Day keyed cache of GMST0 and the Sun's RA, declination and distance. */
+/* None of these depend on the site or twilight angle, so every camera, */
+/* every twilight type and the today/tomorrow pair share one           */
+/* computation per day. Direct mapped, a bit over a year of days.      */
+/************************************************************************/
+#define DAYTERMS_CACHE 512
+
+typedef struct
+{ unsigned int day;
+  int    valid;
+  double gmst0, RA, dec, r;
+} dayterms_t;
+
+static dayterms_t dayterms[DAYTERMS_CACHE];
+static unsigned long dayterms_hits, dayterms_misses;
+static pthread_mutex_t dayterms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sun_dayterms (unsigned int day, double *gmst0, double *RA, double *dec, double *r)
+{
+  pthread_mutex_lock (&dayterms_lock);
+  dayterms_t *dt = &dayterms[day % DAYTERMS_CACHE];
+  if (dt->valid && dt->day == day)
+    dayterms_hits++;
+  else
+  { dayterms_misses++;
+    dt->day   = day;
+    dt->valid = 1;
+    dt->gmst0 = GMST0 (day);
+    sun_RA_dec (day, &dt->RA, &dt->dec, &dt->r);
+  }
+  *gmst0 = dt->gmst0;
+  *RA    = dt->RA;
+  *dec   = dt->dec;
+  *r     = dt->r;
+  pthread_mutex_unlock (&dayterms_lock);
+}
+
+void sun_dayterms_stats (unsigned long *hits, unsigned long *misses)
+{
+  pthread_mutex_lock (&dayterms_lock);
+  *hits   = dayterms_hits;
+  *misses = dayterms_misses;
+  pthread_mutex_unlock (&dayterms_lock);
+}
+
+void sun_dayterms_flush (void)
+{
+  pthread_mutex_lock (&dayterms_lock);
+  for (int i = 0; i < DAYTERMS_CACHE; i++)
+    dayterms[i].valid = 0;
+  dayterms_hits = dayterms_misses = 0;
+  pthread_mutex_unlock (&dayterms_lock);
+}
+
 double revolution (double x)
 /*****************************************/
 /* Reduce angle to within 0..360 degrees */
@@ -220,10 +278,14 @@ unsigned int daysSince2000 (unsigned int pYear, unsigned int pMonth, unsigned in
 { 
   unsigned int yearsSince2000 = pYear - 2000;
 
+  /* Leap days in the years before this one, 2000 itself was a leap year */
+  /* with the 400 rule, and this year's once it's past February          */
   unsigned int leapDaysSince2000 
-    = (unsigned int) floor (yearsSince2000/4)        /* Every evenly divisible 4 years is a leap-year */
-    - (unsigned int) floor (yearsSince2000/100)      /* Except centuries, unless evenly diviable by 400 */
-    + (unsigned int) floor (yearsSince2000/400) +1;  /* 2000 itself was a leap year with the 400 rule */;
+    = (yearsSince2000 + 3) / 4                       /* Every evenly divisible 4 years is a leap-year */
+    - (yearsSince2000 + 99) / 100                    /* Except centuries, unless evenly diviable by 400 */
+    + (yearsSince2000 + 399) / 400;
+  if (pMonth > 2 && pYear % 4 == 0 && (pYear % 100 != 0 || pYear % 400 == 0))
+    leapDaysSince2000++;
 
   unsigned int monthDays = 0;
   switch (pMonth)
@@ -242,7 +304,7 @@ unsigned int daysSince2000 (unsigned int pYear, unsigned int pMonth, unsigned in
     default: printf ("Error: Number of month is out of range\n");
   }
 
-  return (yearsSince2000 * 365) + leapDaysSince2000 + monthDays + pDay -1; /* -1 : Don't include today in count */
+  return (yearsSince2000 * 365) + leapDaysSince2000 + monthDays + pDay; /* 2000 Jan 1 is day 1 */
 }
 
 
@@ -30,6 +30,9 @@ double revolution (double x);
 double rev180 (double x);
 double GMST0 (double d);
 void sun_RA_dec (double d, double *RA, double *dec, double *r);
+void sun_dayterms (unsigned int day, double *gmst0, double *RA, double *dec, double *r);
+void sun_dayterms_stats (unsigned long *hits, unsigned long *misses);
+void sun_dayterms_flush (void);
 int hours   (double d);
 int minutes (double d);
 int seconds (double d);
@@ -16,48 +16,62 @@
 #include <getopt.h>
 #include <pwd.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
 
-#include "libconfig.h"
+#ifndef _PASSWORD_LEN
+  #define _PASSWORD_LEN 128     // BSD's pwd.h has it, glibc's doesn't
+#endif
+
+#ifndef WITHOUT_LIBCONFIG
+  #include "libconfig.h"
+#endif
 #include "sunspy.h"
 #include "sunriset.h"
+#include "scheduler.h"
+#include "http.h"
+#include "bench.h"
+#include "test.h"
+#include "ephemeris.h"
+#include "solar.h"
+#include "timer.h"
+#include "loop.h"
+#include "control.h"
+#include "timeexpr.h"
+#include "arena.h"
+#include "location.h"
+#include "retry.h"
+#include "sysinfo.h"
+#include "metrics.h"
+#include "journal.h"
+#include "log.h"
 
 float version = 1.0;
 
-// Basic Camera info
-typedef struct camera_t {
-    const char *name;       // securityspy text name
-    unsigned number;        // securityspy camera number
-    const char *str_start;  // unparsed start time i.e "sunrise+30"
-    const char *str_stop;   // unparsed stop time
-    time_t start;           // computed next start time
-    time_t stop;            // computed next stop time
-    struct camera_t *next;  // sll
-} camera_t;
-
-camera_t *cameralist = NULL;
-int numcams = 0;
-
-// Event info.
-// At this time we only support two events, set the camera
-// ACTIVE or PASSIVE
-#define CAM_ACTION_ACTIVE 1
-#define CAM_ACTION_PASSIVE 2
-typedef struct camevent_t {
-    unsigned action;        // active or passive
-    unsigned camera;        // camera id
-    time_t  starttime;      // computed execution time
-    const char *str_time;   // unparsed execution time i.e. "sunrise+30"
-    struct camevent_t *next; // sll
-} camevent_t;
-
-camevent_t *camevents = NULL;
-
-//ttSunrise is today's sunrise. ttNextSunrise is the next
-// sunrise that will occur. If we're past today's sunrise already,
-// then ttNextSunrise will have tomorrow's sunrise time.
-time_t ttSunrise, ttNextSunrise;
-time_t ttSunset, ttNextSunset;
-time_t ttNoon, ttNextNoon;
+// A loaded config. Every server, camera and event in it lives in its
+// arena. The main thread holds a reference to the current one and each
+// worker to those its queue or requests still point into; the last to
+// let go frees it.
+typedef struct fleet_t {
+    arena_t *arena;
+    volatile int refs;
+} fleet_t;
+
+fleet_t *fleet = NULL;             // the current config
+arena_t *configarena = NULL;       // its arena, what's being loaded goes here
+camera_t *cameralist = NULL;       // cameras on the top level / command line server
+unsigned numcameralist = 0;
+server_t *serverlist = NULL;
+unsigned numservers = 0;
+
+// ttToday[ANCHOR_SUNRISE] is today's sunrise, ttTomorrow[] tomorrow's,
+// likewise for the other anchors, see timeexpr.h. ttReference is the
+// time they were worked out for, times at or before it are of no use.
+mstime_t ttToday[NUM_ANCHORS], ttTomorrow[NUM_ANCHORS];
+mstime_t ttReference;
+unsigned anchorsused = 1 << ANCHOR_SUNRISE;     // bit per TimeAnchor in the config
 
 // Values pased in via the command line override the config file.
 #define BOGUS   255
@@ -75,8 +89,28 @@ char *camera_stop = NULL;           //commandline flag.
 char *configfile = NULL;            //commandline flag.
 char *userip = NULL;                // detected user IP
 bool forceaction = false;           // command line flag. Forces action to happen now, no sleeping.
+unsigned camaction = 0;             // commandline flag. --action, sends just this now and exits.
 char *defaultconfigpath = NULL;
+char *defaultgeocachepath = NULL;
 bool askforpassword = false;        // if -p or --password is specificed without a password, ask
+unsigned maxinflight = 8;           // concurrent requests per server when events coincide
+unsigned batchwindow = 250;         // ms, events this close together go out as one batch
+char *ephemerisfile = NULL;         // precomputed sun times, see ephemeris.h
+char *solarname = NULL;             // which solar engine, see solar.h
+SolarEngine solarengine = SOLAR_FAST;
+char *makeephemeris = NULL;         // commandline flag. Write an ephemeris file and exit.
+unsigned simulatedays = 0;          // commandline flag. Replay this many days without waiting.
+char *controlsocket = NULL;         // unix domain socket for status and commands, see control.h
+char *metricsaddr = NULL;           // where to serve metrics, see metrics.h
+char *journalfile = NULL;           // what's been sent, to catch up after a restart, see journal.h
+char *loglevel = NULL;              // see log.h
+char *logformat = NULL;
+unsigned badtimes = 0;              // start/stop times that didn't parse while loading
+bool reconcile = true;              // check cameras are in the right mode when a server's (back) up
+char *geocache = NULL;              // last detected location, see location.h
+char *geourl = LOCATION_DEFAULT_URL; // geolocation service
+int geottl = LOCATION_DEFAULT_TTL;  // seconds the cached location is good for
+bool refreshlocation = false;       // cached location is out of date, look again once running
 
 void usage()
 {
@@ -106,6 +140,9 @@ void usage()
     printf(" --cameraid  SecuritySpy Camera Id. Useful when just doing one\n");
     printf(" -i             camera from the command line.\n");
     printf("\n");
+    printf(" --action    active or passive. Sets the cameras (or just --cameraid)\n");
+    printf(" -a             to it now and exits.\n");
+    printf("\n");
     printf(" --user      Security Spy User\n");
     printf(" -u\n");
     printf("\n");
@@ -117,10 +154,13 @@ void usage()
     printf("\n");
     printf(" --start    Time to start or stop (set camera to ACTIVE or PASSIVE).\n");
     printf(" --stop     Times are all sunrise or sunset relative. You can also specify\n");
-    printf("            a hour or minute modifier. examples:\n");
+    printf("            a hour or minute modifier, or a 24h time. examples:\n");
     printf("                sunrise         Event happens at sunrise\n");
     printf("                sunset-30m      Event happens 30 minutes before sunset\n");
     printf("                noon+1h         Event happens 1 hour after noon\n");
+    printf("                dusk+1h30m      Event happens 1 1/2 hours after civil dusk\n");
+    printf("                nautical_dawn   Also astronomical_dawn/dusk\n");
+    printf("                20:30           Event happens at 8:30pm\n");
     printf("                +8h             Event happens 8 hour after the start event,\n");
     printf("                                    only valid for stop events.\n");
     printf("\n");
@@ -130,6 +170,34 @@ void usage()
     printf(" --timezone If not supplied, we will automatically detect your timezone.\n");
     printf(" -t         Hours from GMT.\n");
     printf(" \n");
+    printf(" --benchmark Runs the built-in benchmarks and exits. With =json the\n");
+    printf("            results go to stdout as json for regression tracking.\n");
+    printf(" --test     Runs the self tests and exits, non-zero if any failed.\n");
+    printf(" \n");
+    printf(" --makeephemeris Precomputes two years of sun times for lat/lon into\n");
+    printf("            the given file and exits.\n");
+    printf(" --ephemeris Look up sun times in a file made with --makeephemeris.\n");
+    printf("            Daemons on the same host share the mapped file.\n");
+    printf(" --solar    How sun times are worked out: fast (the default) or noaa,\n");
+    printf("            seconds more accurate for about 30x the time. --benchmark\n");
+    printf("            compares them.\n");
+    printf(" \n");
+    printf(" --simulate Replays this many days of the schedule against a simulated\n");
+    printf("            clock in a few seconds, sends nothing, and reports events\n");
+    printf("            that skip a day, fire twice or stall (polar days, clock\n");
+    printf("            changes). --trace prints every event.\n");
+    printf(" \n");
+    printf(" --control  Path of a unix domain socket to take commands on while\n");
+    printf("            running (i.e. \"/var/run/sunspy.sock\"). Try \"help\".\n");
+    printf(" --metrics  Serve Prometheus metrics over http at [host:]port, 127.0.0.1\n");
+    printf("            if no host is given, or on a unix socket if it's a path.\n");
+    printf(" --journal  File to keep a record of commands sent in. After a crash or\n");
+    printf("            reboot, cameras that missed a change while sunspy was down\n");
+    printf("            are sent the one they should be in.\n");
+    printf(" \n");
+    printf(" --loglevel error, warn, info or debug (the default, with --verbose).\n");
+    printf(" --logformat text (the default), logfmt or json lines.\n");
+    printf(" \n");
     exit(0);
 }
 
@@ -146,15 +214,16 @@ char *prettyHour(double t, char *dest)
     return dest;
 }
 
-// Takes the double hour value and replaces the hour and minute value in the provided time_t.
-// Seconds are set to 0.
-time_t convertTime(time_t day, double hour)
+// Takes the double hour value and replaces the time of day in the provided time_t.
+// Result is in milliseconds.
+mstime_t convertTime(time_t day, double hour)
 {
     struct tm tmDate = *localtime(&day);
     tmDate.tm_hour = floor(hour);
-    tmDate.tm_min = floor((hour - tmDate.tm_hour) * 60);
-    tmDate.tm_sec = 0;
-    return mktime(&tmDate);
+    long ms = lround((hour - tmDate.tm_hour) * 60*60*1000);
+    tmDate.tm_min = (int)(ms / (60*1000));
+    tmDate.tm_sec = (int)(ms / 1000 % 60);
+    return (mstime_t)mktime(&tmDate) * 1000 + ms % 1000;
 }
 
 /*
@@ -185,332 +254,1814 @@ void calctime(sunrise_t *sr, double lat, double lon, const char *twilight_type,
         sr->twilightAngle = angle;
     }
     
-    // Co-ordinates must be in 0 to 360 range
-    sr->latitude  = revolution (sr->latitude);
-    sr->longitude = revolution (sr->longitude);
-    
     if (sr->twilightAngle <= -90 || sr->twilightAngle >= 90)
     {
         fprintf(stderr, "Error: Twilight angle must be between -90 and +90 (-ve = below horizon), your setting: %f\n", sr->twilightAngle);
         sr->twilightAngle = TWILIGHT_ANGLE_DAYLIGHT;
     }
-    
-    sunriset (sr);
+
+    // Precomputed? The tables are the fast engine's.
+    if (solarengine == SOLAR_FAST && ephemeris_lookup(sr, lat, lon))
+        return;
+
+    solar_riset(solarengine, sr);
 }
 
 /*
- * Initializes ttSunset, ttNoon, ttSunrise.
- *
- * If the current time is greater than any of the events, the time
- * is calculated for tomorrows event. If it's after sunrise when this
- * executes, then it calcuates the sunrise for tomorrow, the past is
- * of no use to us.
+ * Initializes ttToday[] and ttTomorrow[] for the anchors in use.
  */
 void calc_sunrise_sunset(time_t tt)
 {
-    // set date for sunrise/sunset prediction
-    struct tm tmLocal = *localtime (&tt);
-    sunrise_t sr;
-    
-    // Calc sunrise/sunset for today
-    calctime(&sr, lat, lon, "civil", 0, &tt);
-    double riseToday = sr.riseTime + tz;
-    double noonToday = sr.noonTime + tz;
-    double setToday = sr.setTime + tz;
-    
+    time_t tt2 = tt + (60*60*24); // + 24hrs to now in seconds
+    double today[NUM_ANCHORS], tomorrow[NUM_ANCHORS];
+    long long t0 = metrics_us();
+    ttReference = tt * 1000LL;
 
-    ttSunrise = convertTime(tt, riseToday);
-    ttNextSunrise = ttSunrise;
-
-    ttNoon = convertTime(tt, noonToday);
-    ttNextNoon = ttNoon;
-  
-    ttSunset = convertTime(tt, setToday);
-    ttNextSunset = ttSunset;
-  
-    // Calc sunrise/sunset for tomorrow
-    time_t ttTomorrow = tt + (60*60*24); // + 24hrs to now in seconds
-    
-    calctime(&sr, lat, lon, "civil", 0, &ttTomorrow);
-    double riseTomrrow = sr.riseTime + tz;
-    double noonTomorrow = sr.noonTime + tz;
-    double setTomorrow = sr.setTime + tz;
-    
-    if (verbose)
+    // one sunriset() a day for each twilight, it gives rise, noon and set
+    unsigned worked = 0;
+    for (unsigned a = 0; a < ANCHOR_CLOCK; a++)
+    {
+        if (a > ANCHOR_SUNSET && !(anchorsused & (1 << a)))
+            continue;   // civil is always worked out, for the verbose output
+        if (!(worked & (1 << a)))
+        {
+            const char *twilight = timeexpr_twilight(a);
+            sunrise_t sr, srTomorrow;
+            calctime(&sr, lat, lon, twilight, 0, &tt);
+            calctime(&srTomorrow, lat, lon, twilight, 0, &tt2);
+            for (unsigned b = a; b < ANCHOR_CLOCK; b++)
+            {
+                if (strcmp(timeexpr_twilight(b), twilight))
+                    continue;
+                SunEvent ev = timeexpr_event(b);
+                today[b] = (ev == SUN_RISE ? sr.riseTime : ev == SUN_NOON ? sr.noonTime : sr.setTime) + tz;
+                tomorrow[b] = (ev == SUN_RISE ? srTomorrow.riseTime : ev == SUN_NOON ? srTomorrow.noonTime : srTomorrow.setTime) + tz;
+                worked |= 1 << b;
+            }
+        }
+        ttToday[a] = convertTime(tt, today[a]);
+        ttTomorrow[a] = convertTime(tt2, tomorrow[a]);
+    }
+    metrics_solarcalc(metrics_us() - t0);
+
+    if (log_enabled(LEVEL_DEBUG))
     {
         char srise[10], snoon[10], sset[10];
-        printf ("Today \t\tsunrise: %s\tnoon: %s\tsunset: %s\n", prettyHour(riseToday, srise), prettyHour(noonToday, snoon), prettyHour(setToday, sset));
-        printf ("Tomorrow \tsunrise: %s\tnoon: %s\tsunset: %s\n", prettyHour(riseTomrrow, srise), prettyHour(noonTomorrow, snoon), prettyHour(setTomorrow, sset));
+        logmsg(LEVEL_DEBUG, "Today \t\tsunrise: %s\tnoon: %s\tsunset: %s", prettyHour(today[ANCHOR_SUNRISE], srise), prettyHour(today[ANCHOR_NOON], snoon), prettyHour(today[ANCHOR_SUNSET], sset));
+        logmsg(LEVEL_DEBUG, "Tomorrow \tsunrise: %s\tnoon: %s\tsunset: %s", prettyHour(tomorrow[ANCHOR_SUNRISE], srise), prettyHour(tomorrow[ANCHOR_NOON], snoon), prettyHour(tomorrow[ANCHOR_SUNSET], sset));
     }
-    
-    // If we are already past the events, pick up the time for tomorrow
-    double currentTime = tmLocal.tm_hour + tmLocal.tm_min/60.0 + tmLocal.tm_sec/3600;
-    if (riseToday <= currentTime)
-        ttNextSunrise = convertTime(ttTomorrow, riseTomrrow);
-    if (noonToday <= currentTime)
-        ttNextNoon = convertTime(ttTomorrow, noonTomorrow);
-    if (setToday <= currentTime)
-        ttNextSunset = convertTime(ttTomorrow, setTomorrow);
- }
+}
 
 //
-// Converts from [sunrise|sunset][+|-][number][h|m] to an actual time.
+// When a compiled start/stop time next comes round after ttReference,
+// from the times calc_sunrise_sunset() last worked out. Today's if
+// that's still to come, otherwise tomorrow's.
 //
-time_t decodetime(const char *timestr)
+mstime_t evaltime(const timeexpr_t *te)
 {
-    const char *org = timestr;
-    time_t result = 0;
-    int mod = 1;         // default to positive
-    int diffseconds = 0; // number of seconds to modify the time with
-    
-    while (*timestr)
+    if (te->anchor == ANCHOR_CLOCK)
+    {
+        // wall clock, so it stays put across a DST change
+        time_t tt = (time_t)(ttReference / 1000);
+        mstime_t t = convertTime(tt, te->offset / 3600.0);
+        if (t <= ttReference)
+            t = convertTime(tt + 60*60*24, te->offset / 3600.0);
+        return t;
+    }
+
+    mstime_t t = ttToday[te->anchor] + te->offset * 1000LL;
+    if (t <= ttReference)
+        t = ttTomorrow[te->anchor] + te->offset * 1000LL;
+    return t;
+}
+
+//
+// Add camera to the end of a camera array, which has room for it
+//
+void addcamera(camera_t *cameras, unsigned *count, const char *name, unsigned number, const char *start, const char *stop)
+{
+    camera_t *new = &cameras[(*count)++];
+    new->name = name;
+    new->number = number;
+    new->str_start = start;
+    new->str_stop  = stop;
+    if (!timeexpr_parse(start, &new->start) || !timeexpr_parse(stop, &new->stop))
+    {
+        logmsg(LEVEL_ERROR, "Bad start/stop time for camera #%u", number);
+        badtimes++;
+    }
+    anchorsused |= (1 << new->start.anchor) | (1 << new->stop.anchor);
+}
+
+//
+// Add a server, and its cameras, to our list
+//
+server_t *addserver(const char *name, const char *url, const char *user, const char *password, camera_t *cameras, unsigned numcameras)
+{
+    server_t *new = arena_alloc(configarena, sizeof(server_t));
+    new->fleet = fleet;
+    new->name = name;
+    new->url = url;
+    new->user = user;
+    new->password = password;
+    new->cameras = cameras;
+    new->numcameras = numcameras;
+
+    // keep config order, it's the order they're reported in
+    server_t **tail = &serverlist;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = new;
+    numservers++;
+    return new;
+}
+
+//
+// Builds everything a server's requests need up front, in the config
+// arena, so sending an event is just pointing curl at it: the
+// user:password for curl, the health check and each camera's ACTIVE and
+// PASSIVE commands.
+// Also lays out the server's events, two per camera.
+//
+void prepareserver(server_t *sv)
+{
+    static const char active[] = "%s/++ssControlActiveMode?cameraNum=%u";
+    static const char passive[] = "%s/++ssControlPassiveMode?cameraNum=%u";
+    static const char info[] = "%s/++systemInfo";
+
+    size_t size = snprintf(NULL, 0, info, sv->url) + 1;
+    if (sv->user && sv->password)
+        size += strlen(sv->user) + strlen(sv->password) + 2;
+    for (unsigned i = 0; i < sv->numcameras; i++)
+    {
+        size += snprintf(NULL, 0, active, sv->url, sv->cameras[i].number) + 1;
+        size += snprintf(NULL, 0, passive, sv->url, sv->cameras[i].number) + 1;
+    }
+
+    sv->camevents = arena_array(configarena, sv->numcameras * 2, sizeof(camevent_t));
+    sv->metrics = metrics_server(sv->name);
+    char *p = arena_alloc(configarena, size);
+    sv->infourl = p;
+    p += sprintf(p, info, sv->url) + 1;
+    sv->userpwd = NULL;
+    if (sv->user && sv->password)
+    {
+        sv->userpwd = p;
+        p += sprintf(p, "%s:%s", sv->user, sv->password) + 1;
+    }
+    for (unsigned i = 0; i < sv->numcameras; i++)
+    {
+        camera_t *cam = &sv->cameras[i];
+        cam->activeurl = p;
+        p += sprintf(p, active, sv->url, cam->number) + 1;
+        cam->passiveurl = p;
+        p += sprintf(p, passive, sv->url, cam->number) + 1;
+    }
+}
+
+//
+// Starts an empty config for servers and cameras to be loaded into.
+// Makes it the current one, see fleet_t.
+//
+fleet_t *newfleet()
+{
+    fleet = malloc(sizeof(fleet_t));
+    fleet->arena = configarena = arena_new(0);
+    fleet->refs = 1;
+    return fleet;
+}
+
+void holdfleet(fleet_t *f)
+{
+    __sync_add_and_fetch(&f->refs, 1);
+}
+
+void releasefleet(fleet_t *f)
+{
+    if (__sync_sub_and_fetch(&f->refs, 1) == 0)
+    {
+        arena_free(f->arena);
+        free(f);
+    }
+}
+
+// ttToday[] and friends are shared by the workers, hold this to
+// recalculate them and decode times against them.
+static pthread_mutex_t sunlock = PTHREAD_MUTEX_INITIALIZER;
+
+// Events being dispatched together, and their requests. Per worker.
+static __thread camevent_t **batch = NULL;
+static __thread httpreq_t *batchreqs = NULL;
+static __thread bool *batchskip = NULL;     // superseded by a later event in the batch
+static __thread unsigned batchalloc = 0;
+
+//
+// Pops every event due at or before 'due' off the queue into the batch
+// arrays, growing them as needed. Returns the number of events taken.
+//
+unsigned collectdue(mstime_t due)
+{
+    unsigned count = 0;
+    camevent_t *e;
+    while ((e = sched_peek()) && e->starttime <= due)
     {
-        if (*timestr == '+')
+        if (count == batchalloc)
         {
-            timestr++;
-        } else if (*timestr == '-') {
-            mod *= -1;
-            timestr++;
-        } else if (isdigit(*timestr)) {
-            int  i = 0;
-            char numstr[10];
-            while (i < 9 && isdigit(*timestr))
-            {
-                numstr[i++] = *timestr++;
-            }
-            numstr[i] = 0;
-            mod *= atoi(numstr);
-            
-        } else if (!strncasecmp("sunrise", timestr, 7)) {
-            result = ttNextSunrise;
-            timestr += 7;
-        } else if (!strncasecmp("noon", timestr, 4)) {
-            result = ttNextNoon;
-            timestr += 4;
-        } else if (!strncasecmp("sunset", timestr, 6)) {
-            result = ttNextSunset;
-            timestr += 6;
-        } else if (!strcasecmp("h", timestr)) {
-            diffseconds = 60*60; //seconds in an hour;
-            break; // this has to be last.
-        } else if (!strcasecmp("m", timestr)) {
-            diffseconds = 60; //seconds in a minute;
-            break;
-        } else {
-            fprintf(stderr, "Unknown time '%s'\n", org);
-            break;
+            batchalloc = batchalloc ? batchalloc * 2 : 16;
+            batch = realloc(batch, batchalloc * sizeof(camevent_t *));
+            batchreqs = realloc(batchreqs, batchalloc * sizeof(httpreq_t));
+            batchskip = realloc(batchskip, batchalloc * sizeof(bool));
         }
-        
+        batch[count++] = sched_pop();
     }
-    
-    // Allow for a time of "+5h" which we interpert to be "sunrise+5h".
-    if (result == 0)
+    return count;
+}
+
+// Batch index + 1 of each camera kept while merging a batch, open
+// addressing.
+static __thread unsigned *seen = NULL;
+static __thread unsigned seenalloc = 0;
+
+//
+// Only the last event for each camera in a batch matters, an ACTIVE
+// then a PASSIVE inside the window is just a PASSIVE. Marks the ones
+// that needn't be sent in batchskip[], returns how many do.
+//
+unsigned mergebatch(unsigned count)
+{
+    unsigned need = 16;
+    while (need < count * 2)
+        need *= 2;
+    if (need > seenalloc)
     {
-        // Make sure we haven't passed this event
-        // This needs to be refactored to live elsewhere.
-        if ((ttSunrise + (mod * diffseconds)) > time(NULL))
-            result = ttSunrise;
-        else
-            result = ttNextSunrise;
+        seenalloc = need;
+        seen = realloc(seen, seenalloc * sizeof(unsigned));
     }
-    
-    result += mod * diffseconds;
-    return result;
+    memset(seen, 0, need * sizeof(unsigned));
+
+    unsigned sending = 0;
+    for (unsigned i = count; i-- > 0; )
+    {
+        const camevent_t *e = batch[i];
+        unsigned h = ((e->camera + 1) * 2654435761u ^ (unsigned)(uintptr_t)e->server) & (need - 1);
+        while (seen[h] && !(batch[seen[h] - 1]->camera == e->camera && batch[seen[h] - 1]->server == e->server))
+            h = (h + 1) & (need - 1);
+
+        batchskip[i] = seen[h] != 0;
+        if (!batchskip[i])
+        {
+            seen[h] = i + 1;
+            sending++;
+        }
+    }
+    return sending;
 }
 
 //
-// place holder fuction to keep curl from writing to stdout
+// Frees this worker's batch arrays, when it's finishing.
 //
-size_t curlwritebogus(char *ptr, size_t size, size_t nmemb, void *userdata)
+static void freebatch()
 {
-    return size*nmemb;
+    free(batch);
+    free(batchreqs);
+    free(batchskip);
+    free(seen);
+    batch = NULL;
+    batchreqs = NULL;
+    batchskip = NULL;
+    seen = NULL;
+    batchalloc = seenalloc = 0;
 }
+
 //
-// Call SecuritySpy webapi
+// Fills in one of camera i's events, unqueued.
 //
-int httpcmd(const char *url, const char *user, const char *password)
+static void initevent(camevent_t *e, server_t *sv, unsigned i, unsigned action)
 {
-    CURL *crl = curl_easy_init();
-    curl_easy_setopt(crl, CURLOPT_URL, url);
-    
-    if (user && password) {
-        char *userpass = malloc(strlen(user)+ strlen(password) + 2);
-        sprintf (userpass, "%s:%s", user,password);
-        curl_easy_setopt (crl, CURLOPT_USERPWD, userpass);
-        free (userpass);
-    }
-    curl_easy_setopt(crl, CURLOPT_WRITEFUNCTION, curlwritebogus);
-    int iret = curl_easy_perform(crl);
-    if (iret) {
-        fprintf(stderr, "curl failed. [%d]\n", iret);
-        return false;
+    camera_t *cam = &sv->cameras[i];
+    e->action = action;
+    e->camera = cam->number;
+    e->cam = i;
+    e->server = sv;
+    e->lasttime = 0;
+    e->slot = SCHED_NONE;
+    if (action == CAM_ACTION_ACTIVE)
+    {
+        e->when = &cam->start;
+        e->url = cam->activeurl;
+        e->str_time = cam->str_start;
+    }
+    else
+    {
+        e->when = &cam->stop;
+        e->url = cam->passiveurl;
+        e->str_time = cam->str_stop;
     }
-    
-    int httpcode = 0;
-    curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, &httpcode);
-    curl_easy_cleanup(crl);
-    
-    return httpcode;
 }
 
 //
-// Check to see if we can connet to the server
+// Queues an event at its next time. Hold sunlock.
 //
-bool isconnected()
+static void queueevent(camevent_t *e)
 {
-    if (noaction)
-        return true;
-    
-    char strip[1000]; // yeah, i know.
-    // build command string for ss web api
-    sprintf(strip, "%s/++systemInfo", url);
-    
-    if (verbose)
-        printf("Checking connection. %s @ %s\n", user, url);
-    
-    int httpcode = httpcmd(strip, user, password);
-    
-    if (httpcode != 200)
-        printf("Failed to connect to server. %d\n", httpcode);
-    else if (verbose)
-        printf("Passed.\n");
+    __atomic_store_n(&e->starttime, evaltime(e->when), __ATOMIC_RELAXED);
+    sched_add(e);
+    journal_record(JOURNAL_SCHEDULED, e->starttime, e);
+
+    logat(LEVEL_DEBUG, e->starttime, "Set %s camera #%d to %s", e->server->name, e->camera,
+          e->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE");
+}
+
+//
+// Queues the start and stop events for each of a server's cameras on
+// this thread's scheduler.
+//
+void queuecameras(server_t *sv)
+{
+    pthread_mutex_lock(&sunlock);
+    for (unsigned i = 0; i < sv->numcameras; i++)
+    {
+        // Add start time
+        camevent_t *e = &sv->camevents[i * 2];
+        initevent(e, sv, i, CAM_ACTION_ACTIVE);
+        queueevent(e);
 
-    return httpcode == 200;
+        // Add stop time
+        e = &sv->camevents[i * 2 + 1];
+        initevent(e, sv, i, CAM_ACTION_PASSIVE);
+        queueevent(e);
+    }
+    pthread_mutex_unlock(&sunlock);
+}
+
+void reportresult(const camevent_t *e, const httpreq_t *req)
+{
+    if (req->httpcode != 200)
+        logmsg(LEVEL_WARN, "%s camera #%d %s, server returned %d", e->server->name, e->camera,
+               e->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE", req->httpcode);
+    else
+        logmsg(LEVEL_DEBUG, "%s camera #%d %s done in %.0fms", e->server->name, e->camera,
+               e->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE", req->seconds * 1000);
+}
+
+//
+// --noaction and --force: every queued event once, right now, in order.
+// With --action only that command, to the --cameraid camera if given.
+//
+void runonce()
+{
+    camevent_t *e;
+    while ((e = sched_peek()))
+    {
+        unsigned count = collectdue(e->starttime);
+        unsigned n = 0;
+        for (unsigned i = 0; i < count; i++)
+        {
+            e = batch[i];
+            if (camaction && (e->action != camaction || (camera_id && e->camera != (unsigned)atoi(camera_id))))
+                continue;
+            batch[n] = e;
+            logat(LEVEL_INFO, e->starttime, "Event %s, %s @ %s, scheduled", e->str_time, e->server->user, e->url);
+
+            batchreqs[n].url = e->url;
+            batchreqs[n].userpwd = e->server->userpwd;
+            batchreqs[n].body = NULL;
+            n++;
+        }
+
+        if (!noaction && n)
+        {
+            httpbatch(batchreqs, n);
+            for (unsigned i = 0; i < n; i++)
+                reportresult(batch[i], &batchreqs[i]);
+        }
+    }
+}
+
+// A request out on the wire. Kept on a free list once done, so a
+// worker only ever holds as many as it has had in flight at once.
+typedef struct dispatch_t {
+    httpreq_t req;
+    camevent_t *event;
+    mstime_t firedat;       // the event's lasttime once it's sent
+    mstime_t sentat;        // when it went out, for the journal
+    bool retry;
+    struct dispatch_t *next;
+} dispatch_t;
+
+// Something the control socket wants a worker to do, see postorder().
+typedef struct order_t {
+    OrderType type;
+    long camera;            // camera number or ORDER_ALL
+    struct order_t *next;
+} order_t;
+
+// A server's worker thread and its mailbox, where a reload leaves it
+// the server's new config and the control socket its orders.
+typedef struct worker_t {
+    pthread_t thread;
+    int wake[2];                // pipe, written when there's mail
+    pthread_mutex_t lock;       // guards the rest
+    bool haspending;
+    server_t *pending;          // new config, NULL to stop
+    order_t *orders;            // newest first
+    bool exited;
+    struct worker_t *next;      // sll, every worker started
+} worker_t;
+
+static worker_t *workers = NULL;    // main thread only
+static volatile int runningworkers = 0;
+
+static __thread dispatch_t *freedispatch = NULL;
+static __thread unsigned dispatchpool = 0;     // buffers this worker has made
+static __thread loop_t *workerloop = NULL;
+static __thread server_t *workerserver = NULL;
+static __thread worker_t *self = NULL;
+static __thread server_t *heldservers = NULL;   // replaced copies of workerserver, via ->retired
+static __thread unsigned inflightnow = 0;       // requests sent for workerserver
+static __thread unsigned inflightold = 0;       // and for the held copies
+
+// Commands that failed, or were held while the server was down, waiting
+// to go again. Few, and gone once the server's back, so just an array.
+static __thread breaker_t breaker;
+static __thread camevent_t **retrylist = NULL;
+static __thread unsigned nretry = 0;
+static __thread unsigned retryalloc = 0;
+static __thread unsigned retryinflight = 0;
+static __thread unsigned retryseed = 0;
+static __thread bool probing = false;
+
+// Each camera's mode as the server last reported it, see reconcile().
+typedef struct {
+    unsigned number;
+    unsigned action;        // CAM_ACTION_ACTIVE or CAM_ACTION_PASSIVE
+} camstate_t;
+
+static __thread sysinfo_t sysinfo;
+static __thread camstate_t *camstates = NULL;
+static __thread unsigned ncamstates = 0;
+static __thread unsigned camstatealloc = 0;
+
+// Cameras whose events aren't being sent, by number so it carries on
+// across reloads. Paused from the control socket, so few.
+typedef struct {
+    long camera;            // or ORDER_ALL
+    mstime_t since;
+} pause_t;
+
+static __thread pause_t *paused = NULL;
+static __thread unsigned npaused = 0;
+
+static void armnext(void);
+static void ondone(httpreq_t *req, void *userdata);
+
+//
+// Copies this worker's queue state where the control socket can see it.
+//
+static void publish()
+{
+    camevent_t *e = sched_peek();
+    workerserver->queued = sched_count();
+    workerserver->inflight = http_outstanding();
+    workerserver->nextevent = e ? e->starttime : 0;
+    workerserver->waiting = nretry;
+    workerserver->trips = breaker.trips;
+    workerserver->breakeropen = breaker.state != BREAKER_CLOSED;
+    workerserver->paused = npaused;
+}
+
+//
+// Lets go of the configs this worker has moved on from, once nothing in
+// flight points into them.
+//
+static void releaseheld()
+{
+    while (heldservers)
+    {
+        server_t *sv = heldservers;
+        heldservers = sv->retired;
+        releasefleet(sv->fleet);
+    }
+}
+
+//
+// A request for sv is back. Once nothing's queued, in flight or waiting
+// to be retried the worker is done.
+//
+static void landed(const server_t *sv)
+{
+    if (sv == workerserver)
+        inflightnow--;
+    else if (--inflightold == 0)
+        releaseheld();
+
+    publish();
+    if (!sched_count() && !http_outstanding() && !nretry)
+        loop_stop(workerloop);
+}
+
+//
+// The camera's other event, its PASSIVE for an ACTIVE and vice versa.
+//
+static camevent_t *sibling(const camevent_t *e)
+{
+    return &e->server->camevents[e->cam * 2 + (e->action == CAM_ACTION_ACTIVE ? 1 : 0)];
+}
+
+//
+// The pause covering camera number 'camera', NULL if it's not paused.
+//
+static pause_t *pausefor(unsigned camera)
+{
+    for (unsigned i = 0; i < npaused; i++)
+        if (paused[i].camera == ORDER_ALL || paused[i].camera == camera)
+            return &paused[i];
+    return NULL;
+}
+
+//
+// The current config's copy of e, which may be from one since reloaded.
+// NULL if its camera's gone.
+//
+static camevent_t *current(camevent_t *e)
+{
+    if (e->server == workerserver)
+        return e;
+    for (unsigned i = 0; i < workerserver->numcameras; i++)
+        if (workerserver->cameras[i].number == e->camera)
+            return &workerserver->camevents[i * 2 + (e->action == CAM_ACTION_ACTIVE ? 0 : 1)];
+    return NULL;
+}
+
+static void addretry(camevent_t *e, mstime_t when)
+{
+    if (!e->retryat)
+    {
+        if (nretry == retryalloc)
+        {
+            retryalloc = retryalloc ? retryalloc * 2 : 16;
+            retrylist = realloc(retrylist, retryalloc * sizeof(camevent_t *));
+        }
+        retrylist[nretry++] = e;
+    }
+    e->retryat = when;
+}
+
+static void dropretry(camevent_t *e)
+{
+    if (!e->retryat)
+        return;
+    for (unsigned i = 0; i < nretry; i++)
+        if (retrylist[i] == e)
+        {
+            retrylist[i] = retrylist[--nretry];
+            break;
+        }
+    e->retryat = 0;
+}
+
+//
+// Puts 'e' in place of 'was', a copy of it from before a reload, in the
+// retry list.
+//
+static void swapretry(camevent_t *was, camevent_t *e)
+{
+    e->attempts = was->attempts;
+    if (!was->retryat)
+        return;
+    for (unsigned i = 0; i < nretry; i++)
+        if (retrylist[i] == was)
+            retrylist[i] = e;
+    e->retryat = was->retryat;
+    was->retryat = 0;
+}
+
+//
+// Retries get at most half the requests a server is allowed in flight,
+// the rest are left for events coming due on time.
+//
+static unsigned retrycap()
+{
+    return maxinflight > 1 ? maxinflight / 2 : 1;
+}
+
+//
+// When the worker next has retry work to do, 0 for none.
+//
+static mstime_t nextretry()
+{
+    if (breaker.state == BREAKER_OPEN)
+        return breaker.until;
+    if (breaker.state == BREAKER_HALFOPEN || retryinflight >= retrycap())
+        return 0;   // waiting on a request to come back
+    mstime_t when = 0;
+    for (unsigned i = 0; i < nretry; i++)
+        if (!when || retrylist[i]->retryat < when)
+            when = retrylist[i]->retryat;
+    return when;
+}
+
+static void dispatch(camevent_t *e, mstime_t firedat, bool retry)
+{
+    dispatch_t *d = freedispatch;
+    if (d)
+        freedispatch = d->next;
+    else
+    {
+        d = malloc(sizeof(dispatch_t));
+        workerserver->allocs++;
+        dispatchpool++;
+    }
+
+    // everything the request needs was built by prepareserver()
+    inflightnow++;
+    d->event = e;
+    d->firedat = firedat;
+    d->sentat = timer_now();
+    d->retry = retry;
+    d->req.url = e->url;
+    d->req.userpwd = e->server->userpwd;
+    d->req.body = NULL;
+    http_submit(&d->req, ondone, d);
+}
+
+static void probeserver(void);
+
+//
+// Sends what's due to be retried, or checks whether a server that's
+// been down is back.
+//
+static void runretries(mstime_t now)
+{
+    if (breaker_trial(&breaker, now))
+    {
+        if (!probing)
+            probeserver();
+        return;
+    }
+    if (breaker.state != BREAKER_CLOSED)
+        return;
+
+    for (unsigned i = 0; i < nretry && retryinflight < retrycap(); )
+    {
+        camevent_t *e = retrylist[i];
+        if (e->retryat > now)
+        {
+            i++;
+            continue;
+        }
+        retrylist[i] = retrylist[--nretry];
+        e->retryat = 0;
+        logmsg(LEVEL_DEBUG, "%s %s camera #%d %s, attempt %u", e->attempts ? "Retrying" : "Sending",
+               e->server->name, e->camera, e->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE",
+               e->attempts + 1);
+        retryinflight++;
+        if (e->attempts)
+            workerserver->retries++;
+        dispatch(e, e->lasttime, true);
+    }
+}
+
+//
+// The breaker opened or closed. Once the server's back everything held
+// goes out, it's the state the cameras should be in now.
+//
+static void breakerchanged(mstime_t now)
+{
+    if (breaker.state == BREAKER_OPEN)
+    {
+        logmsg(LEVEL_WARN, "%s isn't answering, holding commands for %llds",
+               workerserver->name, (breaker.until - now) / 1000);
+        return;
+    }
+
+    logmsg(LEVEL_INFO, "%s is back, sending %u held commands", workerserver->name, nretry);
+    for (unsigned i = 0; i < nretry; i++)
+        retrylist[i]->retryat = now;
+    runretries(now);
+}
+
+static void ondone(httpreq_t *req, void *userdata)
+{
+    dispatch_t *d = userdata;
+    camevent_t *e = d->event;
+    reportresult(e, req);
+    metrics_http(e->server->metrics, e->action == CAM_ACTION_ACTIVE ? ENDPOINT_ACTIVE : ENDPOINT_PASSIVE,
+                 req->httpcode, req->seconds);
+    d->next = freedispatch;
+    freedispatch = d;
+    if (d->retry)
+        retryinflight--;
+
+    mstime_t now = timer_now();
+    bool again = retry_worthwhile(req->httpcode);
+    bool changed = breaker_record(&breaker, !again, now);
+
+    // Try again unless the camera's had a newer command since, this one
+    // firing again or its other one.
+    camevent_t *cur = current(e);
+    if (cur && req->httpcode >= 200 && req->httpcode < 300)
+        journal_record(JOURNAL_DONE, d->sentat, e);
+    if (cur && cur->lasttime == d->firedat && sibling(cur)->lasttime <= d->firedat)
+    {
+        if (!again)
+            cur->attempts = 0;
+        else
+        {
+            cur->attempts++;
+            addretry(cur, now + retry_backoff(cur->attempts, &retryseed));
+            if (breaker.state == BREAKER_CLOSED)
+                logmsg(LEVEL_DEBUG, "Will retry %s camera #%d in %llds", cur->server->name, cur->camera,
+                       (cur->retryat - now + 999) / 1000);
+        }
+    }
+
+    if (changed)
+        breakerchanged(now);
+    else
+        runretries(now);
+    if (again || changed || d->retry)
+        armnext();
+    landed(e->server);
+}
+
+static void oncamstate(unsigned number, unsigned action, void *userdata)
+{
+    if (ncamstates == camstatealloc)
+    {
+        camstatealloc = camstatealloc ? camstatealloc * 2 : 64;
+        camstates = realloc(camstates, camstatealloc * sizeof(camstate_t));
+    }
+    camstates[ncamstates].number = number;
+    camstates[ncamstates].action = action;
+    ncamstates++;
+}
+
+static void onsysinfo(const char *data, size_t len, void *userdata)
+{
+    sysinfo_parse(&sysinfo, data, len);
+}
+
+static int bynumber(const void *a, const void *b)
+{
+    unsigned x = ((const camstate_t *)a)->number, y = ((const camstate_t *)b)->number;
+    return x < y ? -1 : x > y;
+}
+
+//
+// Puts right every camera the server says is in the wrong mode, and
+// only those. Where each should be is whichever of its events went
+// last, i.e. the one furthest off next. Commands waiting to be retried
+// for cameras the server listed are dropped, they're either done or
+// replaced. The rest go out through the retry list so they don't hold
+// up events coming due.
+//
+static void reconcilecameras(mstime_t now)
+{
+    qsort(camstates, ncamstates, sizeof(camstate_t), bynumber);
+
+    unsigned right = 0, wrong = 0;
+    for (unsigned i = 0; i < workerserver->numcameras; i++)
+    {
+        camevent_t *start = &workerserver->camevents[i * 2];
+        camevent_t *stop = &workerserver->camevents[i * 2 + 1];
+        if (start->slot == SCHED_NONE || stop->slot == SCHED_NONE || start->starttime == stop->starttime)
+            continue;
+
+        camstate_t key = { workerserver->cameras[i].number, 0 };
+        camstate_t *state = bsearch(&key, camstates, ncamstates, sizeof(camstate_t), bynumber);
+        if (!state || pausefor(key.number))
+            continue;
+
+        camevent_t *want = start->starttime > stop->starttime ? start : stop;
+        dropretry(start);
+        dropretry(stop);
+        start->attempts = stop->attempts = 0;
+        if (state->action == want->action)
+            right++;
+        else
+        {
+            wrong++;
+            addretry(want, now);
+        }
+    }
+
+    workerserver->reconciled += wrong;
+    logmsg(LEVEL_INFO, "%s: %u cameras in the right mode, %u to change, %u not listed",
+           workerserver->name, right, wrong, workerserver->numcameras - right - wrong);
+}
+
+//
+// Checks the server is there. Goes out once the schedule is armed so it
+// holds nothing up, and whenever the breaker's cooldown is up to see if
+// a server that was down is back. The reply says what mode each camera
+// is in, see reconcilecameras().
+//
+static void onprobe(httpreq_t *req, void *userdata)
+{
+    server_t *sv = userdata;
+    probing = false;
+    metrics_http(sv->metrics, ENDPOINT_INFO, req->httpcode, req->seconds);
+    if (req->httpcode != 200)
+        logmsg(LEVEL_WARN, "Failed to connect to server %s. %d", sv->name, req->httpcode);
+    else
+        logmsg(LEVEL_DEBUG, "Connected to %s in %.0fms.", sv->name, req->seconds * 1000);
+
+    mstime_t now = timer_now();
+    if (req->httpcode == 200 && ncamstates && sv == workerserver)
+    {
+        reconcilecameras(now);
+        if (breaker.state == BREAKER_CLOSED)
+            runretries(now);
+        armnext();
+    }
+    if (breaker_record(&breaker, !retry_worthwhile(req->httpcode), now))
+    {
+        breakerchanged(now);
+        armnext();
+    }
+    landed(sv);
+}
+
+static void probeserver()
+{
+    static __thread httpreq_t probe;
+    logmsg(LEVEL_DEBUG, "Checking connection. %s @ %s", workerserver->user, workerserver->url);
+    probing = true;
+    inflightnow++;
+    ncamstates = 0;
+    sysinfo_init(&sysinfo, oncamstate, NULL);
+    probe.url = workerserver->infourl;
+    probe.userpwd = workerserver->userpwd;
+    probe.body = reconcile ? onsysinfo : NULL;
+    http_submit(&probe, onprobe, workerserver);
+    publish();
+}
+
+static unsigned long retried = 0;   // reschedules that needed a later day
+
+//
+// Next time the schedule comes round after 'after'. Expects the sun
+// times calculated for an hour past 'after', which is enough unless the
+// schedule is more than an hour ahead of its anchor, i.e. "noon-90m";
+// then it looks a day on and puts the sun times back. Hold sunlock.
+//
+mstime_t nexttime(const camevent_t *e, mstime_t after)
+{
+    mstime_t t = evaltime(e->when);
+    if (t > after)
+        return t;
+
+    time_t tt = (time_t)(after / 1000) + (60*60);
+    bool wasverbose = verbose;
+    verbose = false;
+    for (int day = 1; day <= 2 && t <= after; day++)
+    {
+        calc_sunrise_sunset(tt + day * 60*60*24);
+        t = evaltime(e->when);
+    }
+    calc_sunrise_sunset(tt);
+    verbose = wasverbose;
+
+    retried++;
+    if (t <= after)
+    {
+        logat(LEVEL_WARN, after, "Can't find the next '%s'", e->str_time);
+        t = after + 60*60*24*1000LL;
+    }
+    return t;
+}
+
+typedef void (*sendevent_t)(camevent_t *e, mstime_t now);
+
+//
+// Fires everything due by 'now', or inside the batch window after it,
+// through send() and puts the events back in the queue at their next
+// times. Returns how many came due.
+//
+unsigned firebatch(mstime_t now, sendevent_t send)
+{
+    // Everything that's come due, or will inside the batch window, goes
+    // out together, so cameras sharing a schedule flip at the same time
+    // instead of one after another and the server sees one burst.
+    unsigned count = collectdue(now + batchwindow);
+    unsigned sending = mergebatch(count);
+    if (sending < count)
+        logmsg(LEVEL_DEBUG, "Merged %u events into %u requests", count, sending);
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        camevent_t *e = batch[i];
+        e->server->events++;
+        if (batchskip[i])
+            logmsg(LEVEL_DEBUG, "Event %s for camera #%d superseded", e->str_time, e->camera);
+        else
+        {
+            e->server->requests++;
+            send(e, now);
+        }
+    }
+
+    if (count)
+    {
+        // recalc times from an hour past the batch, so we don't pick
+        // up the events we just ran, and put them back in the queue.
+        time_t tt = (time_t)(now / 1000) + (60*60);
+        pthread_mutex_lock(&sunlock);
+        calc_sunrise_sunset(tt);
+        for (unsigned i = 0; i < count; i++)
+        {
+            batch[i]->lasttime = now;
+            sched_reschedule(batch[i], nexttime(batch[i], now));
+            journal_record(JOURNAL_SCHEDULED, batch[i]->starttime, batch[i]);
+        }
+        pthread_mutex_unlock(&sunlock);
+    }
+    return count;
+}
+
+//
+// Sends an event as it comes due. A newer command for the camera means
+// any older one still waiting to be retried can go. While the server's
+// down it's held with the rest.
+//
+static void submitevent(camevent_t *e, mstime_t now)
+{
+    dropretry(e);
+    dropretry(sibling(e));
+    e->attempts = 0;
+
+    logat(LEVEL_DEBUG, e->starttime, "Event %s, %s @ %s, scheduled", e->str_time, e->server->user, e->url);
+
+    metrics_lateness(e->when->anchor, now - e->starttime);
+    if (npaused && pausefor(e->camera))
+    {
+        logmsg(LEVEL_DEBUG, "Not sending it, %s camera #%d is paused", e->server->name, e->camera);
+        journal_record(JOURNAL_SKIPPED, now, e);
+        return;
+    }
+    journal_record(JOURNAL_DUE, now, e);
+    if (breaker.state != BREAKER_CLOSED)
+    {
+        logmsg(LEVEL_DEBUG, "Holding it, %s is down", e->server->name);
+        addretry(e, now);
+        return;
+    }
+    dispatch(e, now, false);
+}
+
+static void ondue(loop_t *loop, void *userdata)
+{
+    mstime_t now = timer_now();
+    if (log_enabled(LEVEL_DEBUG) && sched_peek() && sched_peek()->starttime <= now + batchwindow)
+        logat(LEVEL_DEBUG, now, "%s woke up", workerserver->name);
+    firebatch(now, submitevent);
+    runretries(now);
+    armnext();
+}
+
+//
+// Sets the loop's deadline for the next event or retry, whichever's
+// first.
+//
+static void armnext()
+{
+    static __thread mstime_t announced = 0;
+    camevent_t *e = sched_peek();
+    mstime_t retry = nextretry();
+    publish();
+    if (e)
+    {
+        if (e->starttime != announced)
+            logat(LEVEL_INFO, e->starttime, "%s sleeping until %s", workerserver->name, e->str_time);
+        announced = e->starttime;
+        loop_setdeadline(workerloop, retry && retry < e->starttime ? retry : e->starttime, ondue, NULL);
+        if (timer_markarmed())
+            logmsg(LEVEL_DEBUG, "First event armed %lldms after start", timer_armed());
+    }
+    else if (retry)
+        loop_setdeadline(workerloop, retry, ondue, NULL);
+    else
+    {
+        loop_setdeadline(workerloop, 0, NULL, NULL);
+        if (!http_outstanding() && !nretry)
+            loop_stop(workerloop);
+    }
+}
+
+//
+// Tops the free list up to a request buffer per camera. Merging means a
+// batch never sends more than that, so only a server that's fallen
+// behind by more than a batch ever needs another.
+//
+static void growdispatch(unsigned count)
+{
+    for (; dispatchpool < count; dispatchpool++)
+    {
+        dispatch_t *d = malloc(sizeof(dispatch_t));
+        d->next = freedispatch;
+        freedispatch = d;
+        workerserver->allocs++;
+    }
+}
+
+//
+// Finds camera 'number' among old's cameras not yet taken, the hash
+// holds index + 1.
+//
+static int findcamera(const server_t *old, const unsigned *hash, unsigned mask, bool *taken, unsigned number)
+{
+    for (unsigned h = (number * 2654435761u) & mask; hash[h]; h = (h + 1) & mask)
+    {
+        unsigned j = hash[h] - 1;
+        if (old->cameras[j].number == number && !taken[j])
+        {
+            taken[j] = true;
+            return (int)j;
+        }
+    }
+    return -1;
+}
+
+static bool sametime(const timeexpr_t *a, const timeexpr_t *b)
+{
+    return a->anchor == b->anchor && a->offset == b->offset;
+}
+
+//
+// Moves the worker onto its server's reloaded config. Cameras are
+// matched by number: an event whose time hasn't changed keeps its place
+// in the queue, so nothing fires twice or goes missing, others are
+// removed, added or rescheduled. NULL means the server's gone; its
+// events are dropped and the worker stops once its requests are done.
+//
+static void adopt(server_t *sv)
+{
+    server_t *old = workerserver;
+    if (!sv)
+    {
+        for (unsigned i = 0; i < old->numcameras * 2; i++)
+            sched_remove(&old->camevents[i]);
+        while (nretry)
+            dropretry(retrylist[0]);
+        logmsg(LEVEL_INFO, "%s removed from the config, stopping", old->name);
+        armnext();
+        return;
+    }
+
+    mstime_t t0 = timer_monotonic();
+    unsigned mask = 16;
+    while (mask < old->numcameras * 2)
+        mask *= 2;
+    unsigned *hash = calloc(mask--, sizeof(unsigned));
+    bool *taken = calloc(old->numcameras + 1, sizeof(bool));
+    for (unsigned j = 0; j < old->numcameras; j++)
+    {
+        unsigned h = (old->cameras[j].number * 2654435761u) & mask;
+        while (hash[h])
+            h = (h + 1) & mask;
+        hash[h] = j + 1;
+    }
+
+    unsigned kept = 0, changed = 0, added = 0, removed = 0;
+    mstime_t now = timer_now();
+    pthread_mutex_lock(&sunlock);
+    calc_sunrise_sunset((time_t)(now / 1000));
+    for (unsigned i = 0; i < sv->numcameras; i++)
+    {
+        int j = findcamera(old, hash, mask, taken, sv->cameras[i].number);
+        bool same = true;
+        for (unsigned k = 0; k < 2; k++)
+        {
+            camevent_t *e = &sv->camevents[i * 2 + k];
+            initevent(e, sv, i, k ? CAM_ACTION_PASSIVE : CAM_ACTION_ACTIVE);
+            camevent_t *was = j < 0 ? NULL : &old->camevents[j * 2 + k];
+            if (was)
+                swapretry(was, e);
+            if (was && sametime(e->when, was->when) && was->slot != SCHED_NONE)
+            {
+                e->lasttime = was->lasttime;
+                sched_replace(was, e);
+                continue;
+            }
+            if (was)
+            {
+                e->lasttime = was->lasttime;
+                sched_remove(was);
+            }
+            same = false;
+            queueevent(e);
+        }
+        if (j < 0)
+            added++;
+        else if (same)
+            kept++;
+        else
+            changed++;
+    }
+    pthread_mutex_unlock(&sunlock);
+
+    for (unsigned j = 0; j < old->numcameras; j++)
+    {
+        if (taken[j])
+            continue;
+        sched_remove(&old->camevents[j * 2]);
+        sched_remove(&old->camevents[j * 2 + 1]);
+        dropretry(&old->camevents[j * 2]);
+        dropretry(&old->camevents[j * 2 + 1]);
+        removed++;
+    }
+    free(hash);
+    free(taken);
+
+    sv->events = old->events;
+    sv->requests = old->requests;
+    sv->allocs = old->allocs;
+    sv->retries = old->retries;
+    sv->reconciled = old->reconciled;
+
+    // hold on to the old config until its requests are back
+    old->retired = heldservers;
+    heldservers = old;
+    inflightold += inflightnow;
+    inflightnow = 0;
+    workerserver = sv;
+    if (!inflightold)
+        releaseheld();
+    growdispatch(sv->numcameras);
+
+    logmsg(LEVEL_INFO, "%s reloaded in %lldms: %u cameras kept, %u rescheduled, %u added, %u removed",
+           sv->name, timer_monotonic() - t0, kept, changed, added, removed);
+    armnext();
+}
+
+//
+// Sends camera i's 'action' command now, as a retry so it's held with
+// the rest if the server's down. Anything waiting to go for the camera
+// is replaced by it.
+//
+static void forcecamera(unsigned i, unsigned action, mstime_t now)
+{
+    camevent_t *e = &workerserver->camevents[i * 2 + (action == CAM_ACTION_ACTIVE ? 0 : 1)];
+    dropretry(e);
+    dropretry(sibling(e));
+    e->attempts = 0;
+    e->lasttime = now;      // so a reply to anything older doesn't retry over it
+    addretry(e, now);
+    journal_record(JOURNAL_DUE, now, e);
+}
+
+#define CATCHUP_DAYS    2   // days back catchup() looks, two as day lengths change
+
+//
+// When each of the server's events last came round at or before 'now',
+// into last[], 0 for any that didn't in the CATCHUP_DAYS before. The
+// next time after a day back is that day's, or the next day's if it had
+// already gone. Puts the sun times back as they were. Hold sunlock.
+//
+static void lasttimes(mstime_t now, mstime_t *last)
+{
+    mstime_t today[NUM_ANCHORS], tomorrow[NUM_ANCHORS], reference = ttReference;
+    memcpy(today, ttToday, sizeof(today));
+    memcpy(tomorrow, ttTomorrow, sizeof(tomorrow));
+    bool wasverbose = verbose;
+    verbose = false;
+
+    unsigned count = workerserver->numcameras * 2;
+    memset(last, 0, count * sizeof(mstime_t));
+    for (int day = CATCHUP_DAYS; day >= 1; day--)
+    {
+        calc_sunrise_sunset((time_t)(now / 1000) - day * 60*60*24);
+        for (unsigned i = 0; i < count; i++)
+        {
+            mstime_t t = evaltime(workerserver->camevents[i].when);
+            if (t <= now && t > last[i])
+                last[i] = t;
+        }
+    }
+
+    verbose = wasverbose;
+    memcpy(ttToday, today, sizeof(today));
+    memcpy(ttTomorrow, tomorrow, sizeof(tomorrow));
+    ttReference = reference;
+}
+
+//
+// Puts each camera in the state the schedule has it in now, if the
+// journal doesn't have it there already. However long sunspy was down,
+// that's whichever of its start and stop came round last.
+//
+static void catchup(mstime_t now)
+{
+    if (!journalfile)
+        return;
+    mstime_t *last = malloc(workerserver->numcameras * 2 * sizeof(mstime_t));
+    pthread_mutex_lock(&sunlock);
+    lasttimes(now, last);
+    pthread_mutex_unlock(&sunlock);
+
+    unsigned count = 0;
+    for (unsigned i = 0; i < workerserver->numcameras; i++)
+    {
+        mstime_t start = last[i * 2], stop = last[i * 2 + 1];
+        if (!start && !stop)
+            continue;
+        unsigned action = start > stop ? CAM_ACTION_ACTIVE : CAM_ACTION_PASSIVE;
+        mstime_t since = start > stop ? start : stop;
+        if (!journal_missed(workerserver->name, workerserver->cameras[i].number, action, since))
+            continue;
+        logat(LEVEL_DEBUG, since, "%s camera #%u missed going %s", workerserver->name,
+              workerserver->cameras[i].number, action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE");
+        forcecamera(i, action, now);
+        count++;
+    }
+    free(last);
+    if (count)
+        logmsg(LEVEL_INFO, "%s: sending %u commands missed while sunspy was down", workerserver->name, count);
+}
+
+static void pausecamera(long camera, mstime_t now)
+{
+    if (npaused && pausefor(camera))
+        return;
+    paused = realloc(paused, (npaused + 1) * sizeof(pause_t));
+    paused[npaused].camera = camera;
+    paused[npaused].since = now;
+    npaused++;
+
+    // held commands for it would undo the pause
+    for (unsigned i = 0; i < workerserver->numcameras; i++)
+        if (camera == ORDER_ALL || workerserver->cameras[i].number == camera)
+        {
+            dropretry(&workerserver->camevents[i * 2]);
+            dropretry(&workerserver->camevents[i * 2 + 1]);
+        }
+}
+
+//
+// Lifts the pauses on 'camera', or all of them. A camera that had an
+// event come due, or was forced, while it was paused is sent the latest.
+//
+static void resumecamera(long camera, mstime_t now)
+{
+    for (unsigned i = 0; i < workerserver->numcameras; i++)
+    {
+        unsigned number = workerserver->cameras[i].number;
+        pause_t *p = pausefor(number);
+        if (!p || (camera != ORDER_ALL && camera != number))
+            continue;
+
+        camevent_t *start = &workerserver->camevents[i * 2];
+        camevent_t *stop = &workerserver->camevents[i * 2 + 1];
+        camevent_t *last = start->lasttime > stop->lasttime ? start : stop;
+        if (last->lasttime >= p->since)
+            forcecamera(i, last->action, now);
+    }
+
+    for (unsigned i = 0; i < npaused; )
+    {
+        if (camera == ORDER_ALL || paused[i].camera == camera)
+            paused[i] = paused[--npaused];
+        else
+            i++;
+    }
+}
+
+//
+// Carries out the control socket's orders, oldest first.
+//
+static void runorders(order_t *orders)
+{
+    order_t *o = NULL;
+    while (orders)
+    {
+        order_t *next = orders->next;
+        orders->next = o;
+        o = orders;
+        orders = next;
+    }
+
+    mstime_t now = timer_now();
+    while (o)
+    {
+        const char *what = o->type == ORDER_ACTIVE ? "ACTIVE" : o->type == ORDER_PASSIVE ? "PASSIVE"
+                         : o->type == ORDER_PAUSE ? "paused" : "resumed";
+        if (o->camera == ORDER_ALL)
+            logmsg(LEVEL_INFO, "%s all cameras %s from the control socket", workerserver->name, what);
+        else
+            logmsg(LEVEL_INFO, "%s camera #%ld %s from the control socket", workerserver->name, o->camera, what);
+
+        if (o->type == ORDER_PAUSE)
+            pausecamera(o->camera, now);
+        else if (o->type == ORDER_RESUME)
+            resumecamera(o->camera, now);
+        else
+        {
+            for (unsigned i = 0; i < workerserver->numcameras; i++)
+                if (o->camera == ORDER_ALL || workerserver->cameras[i].number == o->camera)
+                    forcecamera(i, o->type, now);
+        }
+
+        order_t *done = o;
+        o = o->next;
+        free(done);
+    }
+    runretries(now);
+    armnext();
+}
+
+//
+// Takes the mail. True if there was any, in which case it's been acted on.
+//
+static bool checkmail()
+{
+    pthread_mutex_lock(&self->lock);
+    bool has = self->haspending;
+    server_t *sv = self->pending;
+    order_t *orders = self->orders;
+    self->haspending = false;
+    self->pending = NULL;
+    self->orders = NULL;
+    pthread_mutex_unlock(&self->lock);
+
+    if (has)
+        adopt(sv);
+    if (orders && (!has || sv))
+        runorders(orders);
+    else
+    {
+        while (orders)
+        {
+            order_t *o = orders;
+            orders = o->next;
+            free(o);
+        }
+    }
+    return has || orders;
+}
+
+static void onmail(loop_t *loop, int fd, unsigned events, void *userdata)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    checkmail();
+}
+
+//
+// One per server. Its scheduler, curl multi and loop are all its own, so
+// a slow or dead server only ever holds up its own events.
+//
+static void *serverworker(void *arg)
+{
+    self = arg;
+    pthread_mutex_lock(&self->lock);
+    workerserver = self->pending;
+    self->pending = NULL;
+    self->haspending = false;
+    self->exited = !workerserver;   // stopped by a reload before it began
+    pthread_mutex_unlock(&self->lock);
+    if (!workerserver)
+    {
+        __sync_sub_and_fetch(&runningworkers, 1);
+        return NULL;
+    }
+
+    workerloop = loop_new();
+    http_setloop(workerloop);
+    loop_watch(workerloop, self->wake[0], LOOP_READ, onmail, NULL);
+    growdispatch(workerserver->numcameras);
+    breaker_init(&breaker);
+    retryseed = (unsigned)timer_monotonic() ^ (unsigned)(uintptr_t)self;
+
+    queuecameras(workerserver);
+    catchup(timer_now());
+    armnext();
+    probeserver();
+    while (true)
+    {
+        loop_run(workerloop);
+
+        // mail that came in as the queue ran dry still counts
+        pthread_mutex_lock(&self->lock);
+        self->exited = !self->haspending && !self->orders;
+        pthread_mutex_unlock(&self->lock);
+        if (self->exited)
+            break;
+        checkmail();
+    }
+
+    while (freedispatch)
+    {
+        dispatch_t *d = freedispatch;
+        freedispatch = d->next;
+        free(d);
+    }
+    http_threadcleanup();
+    loop_free(workerloop);
+    sched_free();
+    freebatch();
+    free(retrylist);
+    free(camstates);
+    free(paused);
+    releaseheld();
+    releasefleet(workerserver->fleet);
+    __sync_sub_and_fetch(&runningworkers, 1);
+    return NULL;
+}
+
+//
+// Starts a worker for sv. It holds a reference to sv's config.
+//
+void startworker(server_t *sv)
+{
+    worker_t *w = calloc(1, sizeof(worker_t));
+    if (pipe(w->wake))
+    {
+        perror("sunspy: worker pipe");
+        exit(-1);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(w->wake[i], F_SETFL, fcntl(w->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(w->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    w->haspending = true;
+    w->pending = sv;
+    sv->worker = w;
+    holdfleet(sv->fleet);
+
+    __sync_add_and_fetch(&runningworkers, 1);
+    if (pthread_create(&w->thread, NULL, serverworker, w))
+    {
+        perror("sunspy: worker thread");
+        exit(-1);
+    }
+    w->next = workers;
+    workers = w;
+}
+
+//
+// Hands old's worker the server's new config, or NULL to stop it. False
+// if the worker has already finished, sv then needs one of its own.
+//
+static bool postworker(server_t *old, server_t *sv)
+{
+    worker_t *w = old->worker;
+    pthread_mutex_lock(&w->lock);
+    if (w->exited)
+    {
+        pthread_mutex_unlock(&w->lock);
+        return false;
+    }
+    if (w->haspending && w->pending)
+        releasefleet(w->pending->fleet);    // superseded before it was read
+    w->haspending = true;
+    w->pending = sv;
+    if (sv)
+    {
+        sv->worker = w;
+        holdfleet(sv->fleet);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    char c = 1;
+    if (write(w->wake[1], &c, 1) < 0)
+        ; // already has a wakeup waiting
+    return true;
+}
+
+//
+// Hands sv's worker an order from the control socket. False if the
+// worker has finished, i.e. the server has no cameras left to run.
+//
+bool postorder(server_t *sv, OrderType type, long camera)
+{
+    worker_t *w = sv->worker;
+    if (!w)
+        return false;
+    order_t *o = malloc(sizeof(order_t));
+    o->type = type;
+    o->camera = camera;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->exited)
+    {
+        pthread_mutex_unlock(&w->lock);
+        free(o);
+        return false;
+    }
+    o->next = w->orders;
+    w->orders = o;
+    pthread_mutex_unlock(&w->lock);
+
+    char c = 1;
+    if (write(w->wake[1], &c, 1) < 0)
+        ; // already has a wakeup waiting
+    return true;
+}
+
+static void freeworker(worker_t *w)
+{
+    pthread_join(w->thread, NULL);
+    close(w->wake[0]);
+    close(w->wake[1]);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+//
+// Wakes sv's worker to look at the clock again, for a simulated clock
+// its loop can't sleep until.
+//
+void wakeworker(server_t *sv)
+{
+    char c = 1;
+    if (sv->worker && write(sv->worker->wake[1], &c, 1) < 0)
+        ; // already has a wakeup waiting
+}
+
+//
+// Waits for every worker started to finish.
+//
+static void joinworkers()
+{
+    while (workers)
+    {
+        worker_t *w = workers;
+        workers = w->next;
+        freeworker(w);
+    }
+}
+
+//
+// Joins and frees the workers that have finished and that no server in
+// serverlist still points to, i.e. those a reload stopped. Returns how
+// many workers are left.
+//
+unsigned reapworkers()
+{
+    unsigned left = 0;
+    for (worker_t **p = &workers; *p; )
+    {
+        worker_t *w = *p;
+        bool used = false;
+        for (server_t *sv = serverlist; sv && !used; sv = sv->next)
+            used = sv->worker == w;
+        pthread_mutex_lock(&w->lock);
+        bool exited = w->exited;
+        pthread_mutex_unlock(&w->lock);
+        if (used || !exited)
+        {
+            p = &w->next;
+            left++;
+            continue;
+        }
+        *p = w->next;
+        freeworker(w);
+    }
+    return left;
+}
+
+//
+// Tells the workers for serverlist to stop, and waits for them.
+//
+void stopworkers()
+{
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+        if (sv->worker)
+            postworker(sv, NULL);
+    joinworkers();
 }
 
 //
-// Add camera to our array
+// Copies out the sun times last worked out, see calc_sunrise_sunset(),
+// and which anchors they were worked out for. Returns the time they're
+// from.
 //
-void addcamera(const char *name, unsigned number, const char *start, const char *stop)
+mstime_t suntimes(mstime_t *today, mstime_t *tomorrow, unsigned *used)
 {
-    camera_t *new = malloc(sizeof(camera_t));
-    new->name = name;
-    new->number = number;
-    new->str_start = start;
-    new->str_stop  = stop;
-    new->next = NULL;
-
-    if (cameralist)
-        new->next = cameralist;
-
-    cameralist = new;
+    pthread_mutex_lock(&sunlock);
+    memcpy(today, ttToday, sizeof(ttToday));
+    memcpy(tomorrow, ttTomorrow, sizeof(ttTomorrow));
+    *used = anchorsused | (1 << ANCHOR_SUNRISE) | (1 << ANCHOR_NOON) | (1 << ANCHOR_SUNSET);
+    mstime_t reference = ttReference;
+    pthread_mutex_unlock(&sunlock);
+    return reference;
 }
 
+// --simulate bookkeeping
+static bool simtrace = false;
+static FILE *simout;
+static unsigned long simfired = 0, simskipped = 0, simdoubled = 0, simstalled = 0, simneardst = 0;
+static unsigned simreported = 0;
+#define SIM_MAX_REPORTED    20
 
 //
-// Insert new event into list sorted by time
+// true if the local clock changes between two days before t and a day
+// after, which covers the gap before a skipped day.
 //
-void addevent(camevent_t *event)
+static bool neardst(mstime_t t)
 {
-    event->next = NULL;
-    if (!camevents)
+    time_t before = (time_t)(t / 1000) - 2*60*60*24, after = (time_t)(t / 1000) + 60*60*24;
+    struct tm tmBefore, tmAfter;
+    localtime_r(&before, &tmBefore);
+    localtime_r(&after, &tmAfter);
+    return tmBefore.tm_isdst != tmAfter.tm_isdst || tmBefore.tm_gmtoff != tmAfter.tm_gmtoff;
+}
+
+static void anomaly(const camevent_t *e, mstime_t t, const char *what, unsigned long *counter)
+{
+    (*counter)++;
+    bool dst = neardst(t);
+    if (dst)
+        simneardst++;
+    if (simreported++ < SIM_MAX_REPORTED)
+        fprintf(simout, "  %s camera #%d %s \"%s\" %s at %s", e->server->name, e->camera,
+               e->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE", e->str_time,
+               what, timer_str(t, NULL));
+}
+
+static void simevent(camevent_t *e, mstime_t now)
+{
+    simfired++;
+    if (simtrace)
     {
-        camevents = event;
+        char when[40];
+        timer_str(now, when);
+        fprintf(simout, "%.28s  %s camera #%d %s (%s)\n", when, e->server->name, e->camera,
+               e->action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE", e->str_time);
     }
-    else
-    {
-        camevent_t *t = camevents, *tp = NULL;
-        while (t != NULL && event->starttime > t->starttime)
-        {
-            tp = t;
-            t = t->next;
-        }
 
-        if (tp)
-        {
-            event->next = tp->next;
-            tp->next = event;
-        }
-        else
-        {
-            event->next = camevents;
-            camevents = event;
-        }
+    // every schedule comes round once a day, give or take the sun
+    if (e->lasttime)
+    {
+        mstime_t gap = now - e->lasttime;
+        if (gap > 36*60*60*1000LL)
+            anomaly(e, now, "skipped a day, fired", &simskipped);
+        else if (gap < 12*60*60*1000LL)
+            anomaly(e, now, "fired twice in a day", &simdoubled);
     }
 }
 
 //
-// removes event, does not free.
+// Replays simulatedays of every server's schedule against a simulated
+// clock, as fast as it'll go, and reports to f anything that didn't fire
+// once a day. Nothing is sent. Returns how many of those there were.
 //
-void removeevent(camevent_t *event)
+unsigned long simulate(FILE *f)
 {
-    camevent_t *t = camevents, *tp = NULL;
-    while (t != event)
+    mstime_t start = timer_now();
+    mstime_t end = start + simulatedays * 60*60*24*1000LL;
+    bool wasverbose = verbose;
+
+    // Without TZ set every localtime() checks /etc/localtime for changes,
+    // which is most of the time spent here.
+    if (!getenv("TZ"))
     {
-        tp = t;
-        t = t->next;
+        setenv("TZ", ":/etc/localtime", 0);
+        tzset();
     }
-    if (tp == NULL)
-        camevents = event->next;
-    else
-        tp->next = event->next;
-    event->next = NULL;
+
+    simout = f;
+    simfired = simskipped = simdoubled = simstalled = simneardst = 0;
+    simreported = 0;
+    retried = 0;
+    verbose = false;
+    timer_setvirtual(start);
+    calc_sunrise_sunset((time_t)(start / 1000));
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+        queuecameras(sv);
+
+    unsigned ncams = 0;
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+        ncams += sv->numcameras;
+
+    mstime_t t0 = timer_monotonic();
+    camevent_t *e;
+    while ((e = sched_peek()) && e->starttime < end)
+    {
+        // events already past at startup go straight away, as they would
+        mstime_t now = e->starttime > timer_now() ? e->starttime : timer_now();
+        timer_setvirtual(now);
+        firebatch(now, simevent);
+    }
+    mstime_t t1 = timer_monotonic();
+
+    // anything that's gone quiet, i.e. a sunrise that never comes
+    while ((e = sched_pop()))
+        if (e->starttime > end + 36*60*60*1000LL)
+            anomaly(e, e->starttime, "stalled, next fires", &simstalled);
+
+    timer_setvirtual(0);
+    verbose = wasverbose;
+
+    unsigned long events = 0, requests = 0;
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+    {
+        events += sv->events;
+        requests += sv->requests;
+    }
+    if (simreported > SIM_MAX_REPORTED)
+        fprintf(f, "  ... and %u more\n", simreported - SIM_MAX_REPORTED);
+    fprintf(f, "Simulated %u days, %u cameras on %u servers in %lldms\n", simulatedays, ncams, numservers, t1 - t0);
+    fprintf(f, "  %lu events, %lu requests, %lu merged\n", events, requests, events - requests);
+    fprintf(f, "  %lu reschedules needed a later day\n", retried);
+    fprintf(f, "  %lu skipped days, %lu doubled, %lu stalled, %lu of them near a clock change\n",
+            simskipped, simdoubled, simstalled, simneardst);
+    return simskipped + simdoubled + simstalled;
+}
+
+static int hupfd[2] = { -1, -1 };   // SIGHUP, to the main thread's loop
+
+void reloadconfig(void);
+
+static void onsighup(int sig)
+{
+    char c = 1;
+    if (write(hupfd[1], &c, 1) < 0)
+        ; // one's already waiting
+}
+
+static void onhup(loop_t *loop, int fd, unsigned events, void *userdata)
+{
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    reloadconfig();
 }
 
+void *georefresh(void *arg);
+
 //
-// This is the daemon loop, it never returns.
+// This is the daemon loop, it only returns if every queue empties.
+// Timers, the requests out to each server and the control socket all
+// run from event loops, so none of them holds up the others.
 //
 void camloop()
 {
-    time_t tt = time (NULL);
-    
-    while (camevents) {
-        camevent_t *e = camevents;
-        
-        // let time magically advance in noaction mode.
-        if (!noaction)
-            tt = time (NULL); // the time is now
-        
-        // wait for next event
-        if (e->starttime > tt && !noaction && !forceaction)
-        {
-            //if (verbose)
-                printf("Sleeping until %s, %s", e->str_time, ctime(&e->starttime));
-            sleep((unsigned)(e->starttime - tt));
-            if (verbose)
-            {
-                time_t tn = time(NULL);
-                printf("Woke up at %s.", ctime(&tn));
-            }
-        }
-        if (noaction|verbose)
-        {
-            printf("Event %s scheduled for %s", e->str_time, ctime(&e->starttime));
-            tt = e->starttime + (60*60);
-        }
-        
-        char strip[1000]; // yeah, i know.
-        // build command string for ss web api
-        if (e->action == CAM_ACTION_ACTIVE)
-            sprintf(strip, "%s/++ssControlActiveMode?cameraNum=%d", url, e->camera);
-        else //CAM_ACTION_PASSIVE
-            sprintf(strip, "%s/++ssControlPassiveMode?cameraNum=%d", url, e->camera);
-
-        // call the web server
-        if (noaction||verbose)
-            printf("%s @ %s\n", user, strip);
-
-        if(!noaction)
-        {
-            int httpcode = httpcmd(strip, user, password);
-            if (httpcode != 200)
-                fprintf(stderr, "Warning: Server returned %d\n", httpcode);
-        }
-        
-        // reschedule
-        removeevent(e);
-        
-        // noaction and forceaction only execute each event once.
-        if (!noaction && !forceaction)
-        {
-            // recalc times
-            calc_sunrise_sunset(tt);
-            e->starttime = decodetime(e->str_time);
-            
-            // add event back to the queue
-            addevent(e);
-        }
+    if (simulatedays)
+    {
+        simulate(stdout);
+        return;
+    }
+
+    if (noaction || forceaction || camaction)
+    {
+        for (server_t *sv = serverlist; sv; sv = sv->next)
+            queuecameras(sv);
+        runonce();
+        return;
+    }
+
+    bool journal = journalfile && journal_open(journalfile);
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+        startworker(sv);
+
+    pthread_t geothread;
+    if (refreshlocation && pthread_create(&geothread, NULL, georefresh, NULL) == 0)
+        pthread_detach(geothread);
+
+    // this thread waits for SIGHUP, and the control socket if there is one
+    loop_t *loop = loop_new();
+    if (pipe(hupfd) == 0)
+    {
+        fcntl(hupfd[0], F_SETFL, O_NONBLOCK);
+        fcntl(hupfd[1], F_SETFL, O_NONBLOCK);
+        loop_watch(loop, hupfd[0], LOOP_READ, onhup, NULL);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = onsighup;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &sa, NULL);
     }
+
+    bool control = controlsocket && control_open(loop, controlsocket, serverlist);
+    if (control)
+        logmsg(LEVEL_DEBUG, "Control socket listening on %s", controlsocket);
+    bool metrics = metricsaddr && metrics_open(loop, metricsaddr, serverlist);
+    if (metrics)
+        logmsg(LEVEL_DEBUG, "Serving metrics on %s", metricsaddr);
+    while (runningworkers)
+        loop_once(loop, 1000);
+    if (metrics)
+        metrics_close();
+    if (control)
+        control_close();
+    signal(SIGHUP, SIG_DFL);
+    loop_free(loop);
+
+    joinworkers();
+    if (journal)
+        journal_close();
+
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+        logmsg(LEVEL_INFO, "%s: %lu events in %lu requests, %lu saved by batching, %lu request buffers, %lu retries, "
+               "breaker opened %lu times, %lu cameras put right",
+               sv->name, sv->events, sv->requests, sv->events - sv->requests, sv->allocs, sv->retries,
+               sv->trips, sv->reconciled);
 }
 
 //
@@ -537,6 +2088,18 @@ void parsecl(int argc, const char *argv[])
             {"lat", required_argument, NULL, 'l'},
             {"lon", required_argument, NULL, 'm'},
             {"timezone", required_argument, NULL, 't'},
+            {"benchmark", optional_argument, NULL, 'b'},
+            {"test", no_argument, NULL, 'T'},
+            {"ephemeris", required_argument, NULL, 'e'},
+            {"makeephemeris", required_argument, NULL, 'g'},
+            {"solar", required_argument, NULL, 'E'},
+            {"control", required_argument, NULL, 's'},
+            {"metrics", required_argument, NULL, 'M'},
+            {"journal", required_argument, NULL, 'J'},
+            {"loglevel", required_argument, NULL, 'L'},
+            {"logformat", required_argument, NULL, 'F'},
+            {"simulate", required_argument, NULL, 'S'},
+            {"trace", no_argument, &simtrace, true},
             {"help", no_argument, NULL, '?'},
             {0,0,0,0}
         };
@@ -559,18 +2122,15 @@ void parsecl(int argc, const char *argv[])
                 strcpy(camera_id, optarg);
                 break;
             case 'a':
-                printf("--action or -a is not supported yet.\n");
-                /*
-
                 if (!strncasecmp("active", optarg, 6))
-                    action = CAM_ACTION_ACTIVE;
+                    camaction = CAM_ACTION_ACTIVE;
                 else if (!strncasecmp("passive", optarg, 6))
-                    action = CAM_ACTION_PASSIVE;
+                    camaction = CAM_ACTION_PASSIVE;
                 else
                 {
                     fprintf(stderr, "Unknown --action paramter [%s]. Must be 'active' or 'passive'.\n", optarg);
                     exit(-1);
-                }*/
+                }
                 break;
             case 'u':
                 user = malloc(strlen(optarg)+1);
@@ -607,6 +2167,46 @@ void parsecl(int argc, const char *argv[])
             case 'v':
                 verbose = true;
                 break;
+            case 'b':
+                runbenchmarks(optarg && !strcmp(optarg, "json"));
+                exit(0);
+            case 'T':
+                exit(runtests() ? 1 : 0);
+            case 'E':
+                solarname = malloc(strlen(optarg)+1);
+                strcpy(solarname, optarg);
+                break;
+            case 'e':
+                ephemerisfile = malloc(strlen(optarg)+1);
+                strcpy(ephemerisfile, optarg);
+                break;
+            case 'g':
+                makeephemeris = malloc(strlen(optarg)+1);
+                strcpy(makeephemeris, optarg);
+                break;
+            case 'S':
+                simulatedays = (unsigned)atoi(optarg);
+                break;
+            case 's':
+                controlsocket = malloc(strlen(optarg)+1);
+                strcpy(controlsocket, optarg);
+                break;
+            case 'M':
+                metricsaddr = malloc(strlen(optarg)+1);
+                strcpy(metricsaddr, optarg);
+                break;
+            case 'J':
+                journalfile = malloc(strlen(optarg)+1);
+                strcpy(journalfile, optarg);
+                break;
+            case 'L':
+                loglevel = malloc(strlen(optarg)+1);
+                strcpy(loglevel, optarg);
+                break;
+            case 'F':
+                logformat = malloc(strlen(optarg)+1);
+                strcpy(logformat, optarg);
+                break;
             case '?':
                 usage();
                 break;
@@ -616,6 +2216,110 @@ void parsecl(int argc, const char *argv[])
     }
 }
 
+//
+// A camera given with --cameraid, --start and --stop.
+//
+void commandlinecamera()
+{
+    if (camera_id && camera_start && camera_stop)
+    {
+        cameralist = arena_alloc(configarena, sizeof(camera_t));
+        addcamera(cameralist, &numcameralist, "commandline", atoi(camera_id), camera_start, camera_stop);
+    }
+}
+
+//
+// Adds the top level / command line server and builds what each server
+// needs before it starts.
+//
+void finishservers()
+{
+    if (numcameralist)
+        addserver(url, url, user, password, cameralist, numcameralist);
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+    {
+        if (!sv->password)
+            sv->password = password;
+        prepareserver(sv);
+    }
+}
+
+#ifndef WITHOUT_LIBCONFIG
+
+//
+// Cameras from a config file list
+//
+camera_t *readcameras(config_setting_t *cameras, unsigned *numcameras)
+{
+    int count = config_setting_length(cameras);
+    camera_t *list = arena_array(configarena, count, sizeof(camera_t));
+    *numcameras = 0;
+    for (int i = 0; i < count; i++)
+    {
+        config_setting_t *camera = config_setting_get_elem(cameras, i);
+        const char *name, *start, *stop;
+        int id;
+        
+        if (!(config_setting_lookup_int(camera, "number", &id)
+              && config_setting_lookup_string(camera, "name", &name)
+              && config_setting_lookup_string(camera, "start", &start)
+              && config_setting_lookup_string(camera, "stop", &stop)))
+        {
+            logmsg(LEVEL_ERROR, "Invalid Camera #%d", i);
+        } else {
+            addcamera(list, numcameras, arena_strdup(configarena, name), (unsigned)id,
+                      arena_strdup(configarena, start), arena_strdup(configarena, stop));
+        }
+    }
+    return list;
+}
+
+//
+// Loads the cameras and servers from a parsed config into configarena,
+// copying what they need out of it. False if there aren't any.
+//
+bool readservers(config_t *cfg)
+{
+    config_setting_t *servers = config_lookup(cfg, "servers");
+    if (cameralist == NULL)
+    {
+        // Get the camera list
+        config_setting_t *cameras = config_lookup(cfg, "cameras");
+        if (!cameras && !servers)
+        {
+            logmsg(LEVEL_ERROR, "No Cameras in config file!");
+            return false;
+        }
+        if (cameras)
+            cameralist = readcameras(cameras, &numcameralist);
+    }
+
+    int count = servers ? config_setting_length(servers) : 0;
+    for (int i = 0; i < count; i++)
+    {
+        config_setting_t *server = config_setting_get_elem(servers, i);
+        const char *name = NULL, *svurl = NULL, *svuser = user, *svpassword = password;
+        config_setting_t *cameras = config_setting_get_member(server, "cameras");
+
+        config_setting_lookup_string(server, "server_address", &svurl);
+        config_setting_lookup_string(server, "user", &svuser);
+        config_setting_lookup_string(server, "password", &svpassword);
+        if (!config_setting_lookup_string(server, "name", &name))
+            name = svurl;
+
+        if (!svurl || !svuser || !cameras)
+            logmsg(LEVEL_ERROR, "Invalid Server #%d, needs server_address, user and cameras", i);
+        else
+        {
+            unsigned numcameras;
+            camera_t *list = readcameras(cameras, &numcameras);
+            addserver(arena_strdup(configarena, name), arena_strdup(configarena, svurl), arena_strdup(configarena, svuser),
+                      svpassword ? arena_strdup(configarena, svpassword) : NULL, list, numcameras);
+        }
+    }
+    return true;
+}
+
 //
 // reads the config file and sets up the globals.
 //
@@ -637,19 +2341,64 @@ bool readconfig()
     if (verbose)
         printf("Using config file:%s\n", configfile);
     
+    // A list of servers, each with their own cameras, or just the one
+    // server at the top level.
+    config_setting_t *servers = config_lookup(&cfg, "servers");
+
     if (!url)
-        if(!config_lookup_string(&cfg, "server_address", (const char **)&url))
+        if(!config_lookup_string(&cfg, "server_address", (const char **)&url) && !servers)
             fprintf(stderr, "No 'server_address' setting in configuration file.\n");
     if (!user)
-        if(!config_lookup_string(&cfg, "user", (const char **)&user))
+        if(!config_lookup_string(&cfg, "user", (const char **)&user) && !servers)
             fprintf(stderr, "No 'user' setting in configuration file.\n");
+    if (!password && !askforpassword)
+        config_lookup_string(&cfg, "password", (const char **)&password);
 
-    if (!url || !user)
+    if (!servers && (!url || !user))
     {
         fprintf(stderr, "Missing url, user.\n");
         exit(-1);
     }
     
+    if (!ephemerisfile)
+        config_lookup_string(&cfg, "ephemeris", (const char **)&ephemerisfile);
+    if (!solarname)
+        config_lookup_string(&cfg, "solar_engine", (const char **)&solarname);
+
+    if (!controlsocket)
+        config_lookup_string(&cfg, "control_socket", (const char **)&controlsocket);
+
+    if (!metricsaddr)
+        config_lookup_string(&cfg, "metrics_listen", (const char **)&metricsaddr);
+
+    if (!journalfile)
+        config_lookup_string(&cfg, "journal", (const char **)&journalfile);
+
+    if (!loglevel)
+        config_lookup_string(&cfg, "log_level", (const char **)&loglevel);
+    if (!logformat)
+        config_lookup_string(&cfg, "log_format", (const char **)&logformat);
+
+    if (!geocache)
+        config_lookup_string(&cfg, "location_cache", (const char **)&geocache);
+    config_lookup_string(&cfg, "location_url", (const char **)&geourl);
+
+    int ttl;
+    if (config_lookup_int(&cfg, "location_ttl", &ttl) && ttl >= 0)
+        geottl = ttl * 60 * 60;
+
+    int inflight;
+    if (config_lookup_int(&cfg, "max_inflight", &inflight) && inflight > 0)
+        maxinflight = (unsigned)inflight;
+
+    int window;
+    if (config_lookup_int(&cfg, "batch_window", &window) && window >= 0)
+        batchwindow = (unsigned)window;
+
+    int check;
+    if (config_lookup_bool(&cfg, "reconcile", &check))
+        reconcile = check;
+
     if (lat == BOGUS && lon == BOGUS)
     {
         const char *latstr = NULL, *lonstr = NULL;
@@ -671,104 +2420,190 @@ bool readconfig()
         }
     }
     
-    if (cameralist == NULL)
+    if (!readservers(&cfg))
+        exit(-1);
+    return true;
+}
+
+//
+// Reads the cameras and servers in the config file again, for a reload.
+// False if it doesn't load.
+//
+static bool rereadservers()
+{
+    config_t cfg;
+    config_init(&cfg);
+    if (config_read_file(&cfg, configfile) == CONFIG_FALSE)
     {
-        // Get the camera list
-        config_setting_t *cameras = config_lookup(&cfg, "cameras");
-        if (!cameras)
-        {
-            fprintf(stderr, "No Cameras in config file!");
-            exit(-1);
-        }
-    
-        int count = config_setting_length(cameras);
-        for (int i = 0; i < count; i++)
+        logmsg(LEVEL_ERROR, "Reload of %s failed at line %d: %s", configfile,
+               config_error_line(&cfg), config_error_text(&cfg) ? config_error_text(&cfg) : "can't read it");
+        config_destroy(&cfg);
+        return false;
+    }
+    bool ok = readservers(&cfg);
+    config_destroy(&cfg);
+    return ok;
+}
+
+#else
+
+// Built without libconfig, for the benchmarks and tests, see Makefile.
+bool readconfig()
+{
+    if (verbose)
+        printf("Built without libconfig, not using a config file.\n");
+    return false;
+}
+
+static bool rereadservers()
+{
+    logmsg(LEVEL_ERROR, "Can't reload %s, sunspy was built without libconfig.", configfile);
+    return false;
+}
+
+#endif
+
+//
+// Moves the workers from oldservers, loaded as oldfleet, onto serverlist.
+// Servers are matched by name; new ones get a worker, ones no longer
+// there have theirs stopped, and workers stopped earlier are reaped.
+//
+void replaceservers(fleet_t *oldfleet, server_t *oldservers, unsigned oldnumservers,
+                    unsigned *started, unsigned *stopped)
+{
+    unsigned k;
+    *started = *stopped = 0;
+    bool *matched = calloc(oldnumservers + 1, sizeof(bool));
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+    {
+        server_t *old = oldservers;
+        for (k = 0; old && (matched[k] || strcmp(old->name, sv->name)); k++)
+            old = old->next;
+        if (old)
+            matched[k] = true;
+        if (!old || !postworker(old, sv))
         {
-            config_setting_t *camera = config_setting_get_elem(cameras, i);
-            const char *name, *start, *stop;
-            int id;
-            
-            if (!(config_setting_lookup_int(camera, "number", &id)
-                  && config_setting_lookup_string(camera, "name", &name)
-                  && config_setting_lookup_string(camera, "start", &start)
-                  && config_setting_lookup_string(camera, "stop", &stop)))
-            {
-                fprintf(stderr, "Invalid Camera #%d\n", i);
-            } else {
-                addcamera(name, (unsigned)id, start, stop);
-            }
+            startworker(sv);
+            (*started)++;
         }
     }
-    return true;
+    k = 0;
+    for (server_t *old = oldservers; old; old = old->next, k++)
+    {
+        if (!matched[k] && postworker(old, NULL))
+            (*stopped)++;
+    }
+    free(matched);
+
+    control_setservers(serverlist);
+    metrics_setservers(serverlist);
+    releasefleet(oldfleet);
+    reapworkers();
 }
 
+//
+// SIGHUP. Reads the config file again and hands each server's worker its
+// new cameras, see adopt() and replaceservers(). If the file doesn't
+// load the running config carries on. Location, timezone and the other
+// settings need a restart.
+//
+void reloadconfig()
+{
+    mstime_t t0 = timer_monotonic();
+    fleet_t *oldfleet = fleet;
+    server_t *oldservers = serverlist;
+    unsigned oldnumservers = numservers;
+    arena_t *oldarena = configarena;
+    camera_t *oldcameralist = cameralist;
+    unsigned oldnumcameralist = numcameralist;
+
+    newfleet();
+    serverlist = NULL;
+    numservers = 0;
+    cameralist = NULL;
+    numcameralist = 0;
+    badtimes = 0;
+    commandlinecamera();
+    bool ok = rereadservers();
+    finishservers();
+
+    if (!ok || badtimes || !serverlist)
+    {
+        logmsg(LEVEL_ERROR, "Reload of %s failed, keeping the running config.", configfile);
+        releasefleet(fleet);
+        fleet = oldfleet;
+        serverlist = oldservers;
+        numservers = oldnumservers;
+        configarena = oldarena;
+        cameralist = oldcameralist;
+        numcameralist = oldnumcameralist;
+        return;
+    }
 
-int curlbufsize = 1024;
-int curlbufwritten;
-char *curlbuf;
+    unsigned started, stopped;
+    replaceservers(oldfleet, oldservers, oldnumservers, &started, &stopped);
+    logmsg(LEVEL_INFO, "Reloaded %s in %lldms, %u servers, %u started, %u stopped",
+           configfile, timer_monotonic() - t0, numservers, started, stopped);
+}
 
-// helper function for fetchLatLon. Not robust.
-size_t curlwrite(char *ptr, size_t size, size_t nmemb, void *userdata)
+//
+// Looks up where we are again after starting from the cached location,
+// and saves it for next time. If we've moved the sun times follow from
+// each camera's next event.
+//
+void *georefresh(void *arg)
 {
-    size_t i = size * nmemb;
-    if (curlbufwritten+i > curlbufsize-1)
+    location_t loc;
+    if (!location_fetch(geourl, &loc))
+        return NULL;
+
+    if (!location_write(geocache, &loc))
+        logmsg(LEVEL_WARN, "Can't save location to %s", geocache);
+    pthread_mutex_lock(&sunlock);
+    bool moved = fabs(loc.lat - lat) > 0.01 || fabs(loc.lon - lon) > 0.01;
+    if (moved)
     {
-        fprintf(stderr, "Exceeding curl buffer.\n");
-        return 0;
+        lat = loc.lat;
+        lon = loc.lon;
     }
-    
-    memcpy(&curlbuf[curlbufwritten], ptr, i);
-    return i;
+    pthread_mutex_unlock(&sunlock);
+    if (moved)
+        logmsg(LEVEL_INFO, "Location changed to %f, %f", loc.lat, loc.lon);
+    return NULL;
 }
 
 //
-// Fetch Lat Long from fregeoiop.net.
+// Fills in lat/lon from the cache, or failing that from geourl. A cache
+// older than geottl is used anyway and the daemon looks again in the
+// background once its events are armed.
 //
-void fetchLatLon()
+void findlocation(location_t *loc)
 {
-    CURL *crl = curl_easy_init();
+    if (!geocache)
+        geocache = defaultgeocachepath;
 
-    curlbufwritten = 0;
-    curlbuf = malloc(curlbufsize);
-    
-    const char *freegeoip = "http://freegeoip.net/csv";
-    curl_easy_setopt(crl, CURLOPT_URL, freegeoip);
-    curl_easy_setopt(crl, CURLOPT_WRITEFUNCTION, curlwrite);
-    int iret = curl_easy_perform(crl);
-    if (iret && verbose) {
-        fprintf(stderr, "curl failed. %d", iret);
+    if (location_read(geocache, loc))
+    {
+        long long age = (long long)(time(NULL) - loc->fetched);
+        refreshlocation = age < 0 || age >= geottl;
+        if (verbose||noaction)
+            logmsg(LEVEL_INFO, "lat/lon %f, %f from %s, %s", loc->lat, loc->lon, geocache,
+                   refreshlocation ? "out of date" : "up to date");
     }
-    
-    int httpcode = 0;
-    curl_easy_getinfo(crl, CURLINFO_RESPONSE_CODE, &httpcode);
-    curl_easy_cleanup(crl);
-    
-    
-    // Parse response
-    // sample : "64.119.5.150","US","United States","WA","Washington","Friday Harbor","98250","48.5372","-123.0679","819","360"
-    // Soooper hacky.
-    if (httpcode == 200)
+    else if (location_fetch(geourl, loc))
     {
-        curlbuf[curlbufwritten] = 0; // just in case
-        
-        // Get the IP
-        char *struserip = strtok(&curlbuf[1], "\",\"");// skip initial '"'.
-        userip = malloc(strlen(struserip)+1);
-        strcpy(userip, struserip);
-        
-        // skip the next six fields
-        for (int i = 0; i < 6; i++) strtok(NULL, "\",\"");
-        
-        // get the lat lon
-        char *strlat = strtok(NULL, "\",\"");
-        char *strlon = strtok(NULL, "\",\"");
-        lat = strtod(strlat, NULL);
-        lon = strtod(strlon, NULL);
-        
         if (verbose||noaction)
-            printf ("lat/lon detected as %f, %f\n", lat, lon);
+            logmsg(LEVEL_INFO, "lat/lon detected as %f, %f", loc->lat, loc->lon);
+        if (!location_write(geocache, loc))
+            logmsg(LEVEL_WARN, "Can't save location to %s", geocache);
     }
-   
+    else
+        return;
+
+    lat = loc->lat;
+    lon = loc->lon;
+    if (loc->ip[0])
+        userip = strdup(loc->ip);
 }
 
 //
@@ -780,7 +2615,10 @@ void fetchTZ()
     struct tm tmLocal = *localtime (&tt);
     tz = tmLocal.tm_gmtoff/(60.0*60.0); //convert from seconds to factional hours
     if (verbose||noaction)
-        printf ("Timezone detected as %s %s\n", prettyHour(tz, NULL), tmLocal.tm_zone);
+    {
+        char hours[20];
+        logmsg(LEVEL_INFO, "Timezone detected as %s %s", prettyHour(tz, hours), tmLocal.tm_zone);
+    }
 }
 
 //
@@ -788,28 +2626,57 @@ void fetchTZ()
 //
 int main(int argc, const char * argv[])
 {
-    defaultconfigpath = malloc(strlen(argv[0])+strlen(".conf"));
+    timer_markstart();
+
+    // a control or metrics client that hangs up mid-reply is an EPIPE
+    // for that client, not the end of sunspy
+    signal(SIGPIPE, SIG_IGN);
+
+    defaultconfigpath = malloc(strlen(argv[0])+strlen(".conf")+1);
     sprintf(defaultconfigpath, "%s.conf", argv[0]);
+    defaultgeocachepath = malloc(strlen(argv[0])+strlen(".location")+1);
+    sprintf(defaultgeocachepath, "%s.location", argv[0]);
  
     // parse command line args
     parsecl(argc, argv);
+    newfleet();
+
+    http_init();
 
     if (verbose)
         printf("sunspy version %1.1f\n", version);
 
     // Did we get a camera from the command line?
-    if (camera_id && camera_start && camera_stop)
-        addcamera("commandline", atoi(camera_id), camera_start, camera_stop);
+    commandlinecamera();
     
     // parse config file
     // if no config file, we need at least a few args
     // site, camera, start, user
     if (!readconfig() && argc < 5)
         usage();
+    http_setmaxinflight(maxinflight);
+
+    if (loglevel && !log_setlevel(loglevel))
+    {
+        fprintf(stderr, "Unknown log level '%s'. Must be error, warn, info or debug.\n", loglevel);
+        exit(-1);
+    }
+    if (logformat && !log_setformat(logformat))
+    {
+        fprintf(stderr, "Unknown log format '%s'. Must be text, logfmt or json.\n", logformat);
+        exit(-1);
+    }
+    if (solarname && !solar_byname(solarname, &solarengine))
+    {
+        fprintf(stderr, "Unknown solar engine '%s'. Must be fast or noaa.\n", solarname);
+        exit(-1);
+    }
     
     // Try to fill in lat/lon and timezone if not provided.
+    location_t loc;
+    memset(&loc, 0, sizeof(loc));
     if (lat == BOGUS || lon == BOGUS)
-        fetchLatLon();
+        findlocation(&loc);
     
     // Still no lat/lon? Pft.
     if (lat == BOGUS || lon == BOGUS)
@@ -818,10 +2685,44 @@ int main(int argc, const char * argv[])
         exit(-1);
     }
     
+    if (makeephemeris)
+    {
+        // start at the first of the year so the file is good for a while
+        time_t tt = time(NULL);
+        struct tm today = *gmtime(&tt);
+        unsigned firstday = daysSince2000(today.tm_year + 1900, 1, 1);
+        if (!ephemeris_write(makeephemeris, lat, lon, firstday, EPH_DEFAULT_DAYS))
+            exit(-1);
+        if (verbose)
+            printf("Wrote %d days of sun times for %f, %f to %s\n", EPH_DEFAULT_DAYS, lat, lon, makeephemeris);
+        exit(0);
+    }
+
+    if (ephemerisfile && solarengine != SOLAR_FAST)
+        logmsg(LEVEL_WARN, "Not using ephemeris file %s, it has the fast engine's sun times.", ephemerisfile);
+    else if (ephemerisfile)
+    {
+        if (ephemeris_open(ephemerisfile))
+        {
+            logmsg(LEVEL_DEBUG, "Using ephemeris file %s", ephemerisfile);
+        }
+        else
+            logmsg(LEVEL_WARN, "Can't use ephemeris file %s, computing sun times.", ephemerisfile);
+    }
+
     // Try to fill in the timezone if not provide, otherwise it defaults to a useless
     //   gmt 0 time.
     if (tz == BOGUS)
+    {
         fetchTZ();
+
+        // this machine's clock may not be on the cameras' time
+        double zonetz;
+        char here[20], there[20];
+        if (loc.zone[0] && location_zoneoffset(loc.zone, time(NULL), &zonetz) && zonetz != tz)
+            logmsg(LEVEL_WARN, "timezone is %s here but %s at %s. Set --timezone if the cameras are there.",
+                   prettyHour(tz, here), prettyHour(zonetz, there), loc.zone);
+    }
     
     // Still no timezone? Bail.
     if (tz == BOGUS)
@@ -835,53 +2736,32 @@ int main(int argc, const char * argv[])
         password  = malloc(_PASSWORD_LEN+1);
         strcpy(password, getpass("password:"));
     } else if (!password) {
-        if (verbose)
-            printf("warning: no password was given.\n");
+        logmsg(LEVEL_DEBUG, "no password was given.");
     }
  
-    if (!isconnected())
+    finishservers();
+    if (badtimes)
+        exit(-1);
+
+    if (!serverlist)
     {
+        fprintf(stderr, "No cameras.\n");
         exit(-1);
     }
-    
+
     // initial sunrise/sunset calculation
-    calc_sunrise_sunset(time(NULL));
-    
-    if (verbose)
-    printf("Events:\n");
+    calc_sunrise_sunset((time_t)(timer_now() / 1000));
     
-    // initial setup for cameras
-    for (camera_t *cam = cameralist; cam; cam = cam->next)
-    {
-        // Add start time
-        camevent_t *e = (camevent_t *)malloc(sizeof(camevent_t));
-        e->action = CAM_ACTION_ACTIVE;
-        e->camera = cam->number;
-        e->starttime = decodetime(cam->str_start);
-        e->str_time = cam->str_start;
-        addevent(e);
-  
-        if (verbose)
-            printf("Set camera #%d to ACTIVE at %s", cam->number, ctime(&e->starttime));
-
-        
-        // Add stop time
-        e = (camevent_t *)malloc(sizeof(camevent_t));
-        e->action = CAM_ACTION_PASSIVE;
-        e->camera = cam->number;
-        e->starttime = decodetime(cam->str_stop);
-        e->str_time = cam->str_stop;
-        addevent(e);
-        
-        if (verbose)
-            printf("Set camera #%d to PASSIVE at %s", cam->number, ctime(&e->starttime));
-   }
-
-    if (verbose)
-        printf("\n");
+    logmsg(LEVEL_DEBUG, "Events:");
     
-    // daemon loop
+    // daemon loop, queues each server's events on its worker. From here
+    // on nothing waits on stdout to log.
+    log_open();
     camloop();
+    log_close();
+    timer_report(stdout);
+    http_cleanup();
+    releasefleet(fleet);
     
     printf("done.\n");
     return 0;
@@ -2,12 +2,16 @@
 #ifndef LAUNCHSS_H
   #define LAUNCHSS_H
 
+#include <time.h>
+
 typedef int bool;
 #define true 1
 #define false 0
 
 #define NOT_SET 9999
 
+typedef long long mstime_t;     // milliseconds since the epoch
+
 typedef enum
 { DAYTYPE_NORMAL      = 0
 , DAYTYPE_POLAR_DAY   = 1 // AKA midnight sun
@@ -27,6 +31,77 @@ typedef struct
   DayType  dayType;        // Normal, Polar Day, Polar Night
 } sunrise_t;
 
+// A compiled start/stop time, see timeexpr.h
+typedef struct
+{
+    int anchor;             // TimeAnchor, what it's relative to
+    int offset;             // seconds from the anchor
+} timeexpr_t;
+
+// Basic Camera info
+typedef struct camera_t {
+    const char *name;       // securityspy text name
+    unsigned number;        // securityspy camera number
+    const char *str_start;  // unparsed start time i.e "sunrise+30"
+    const char *str_stop;   // unparsed stop time
+    timeexpr_t start;       // compiled str_start
+    timeexpr_t stop;        // compiled str_stop
+    const char *activeurl;  // prebuilt requests, see prepareserver()
+    const char *passiveurl;
+} camera_t;
+
+// A SecuritySpy server and its cameras. Each server's events are
+// scheduled and sent from a worker thread of its own.
+typedef struct server_t {
+    const char *name;
+    const char *url;
+    const char *user;
+    const char *password;
+    const char *userpwd;    // "user:password" for curl, NULL if no password
+    const char *infourl;    // ++systemInfo, to check the server is there
+    camera_t *cameras;      // array, in config order
+    unsigned numcameras;
+    struct camevent_t *camevents; // numcameras * 2, each camera's start then stop
+    unsigned queued;        // status, written by the server's worker
+    unsigned inflight;
+    mstime_t nextevent;
+    unsigned long events;   // events that have come due
+    unsigned long requests; // requests sent for them, after batching
+    unsigned long allocs;   // request buffers allocated, one per camera unless it falls behind
+    unsigned long retries;  // failed commands sent again
+    unsigned waiting;       // failed or held commands waiting to go again
+    unsigned long trips;    // times its circuit breaker opened, see retry.h
+    bool breakeropen;       // commands are being held
+    unsigned long reconciled; // commands sent because the server had a camera in the wrong mode
+    unsigned paused;        // cameras paused from the control socket, or 1 for all of them
+    struct srvmetrics_t *metrics; // kept across reloads, see metrics.h
+    struct fleet_t *fleet;  // the loaded config it's part of
+    struct worker_t *worker; // thread sending its events
+    struct server_t *retired; // older copies its worker still holds, see adopt()
+    struct server_t *next;  // sll
+} server_t;
+
+// Event info.
+// At this time we only support two events, set the camera
+// ACTIVE or PASSIVE
+#define CAM_ACTION_ACTIVE 1
+#define CAM_ACTION_PASSIVE 2
+typedef struct camevent_t {
+    unsigned action;        // active or passive
+    unsigned camera;        // camera id
+    unsigned cam;           // index in server->cameras
+    struct server_t *server; // server the camera is on
+    mstime_t starttime;     // computed execution time
+    const char *str_time;   // unparsed execution time i.e. "sunrise+30"
+    const timeexpr_t *when; // compiled str_time, see timeexpr.h
+    const char *url;        // ss web api command that carries out the action
+    unsigned slot;          // scheduler heap position, SCHED_NONE if not queued
+    unsigned long seq;      // insertion order, keeps equal start times FIFO
+    mstime_t lasttime;      // when it last fired, 0 if it hasn't
+    unsigned attempts;      // sends that have failed since it last went through
+    mstime_t retryat;       // when to send it again, 0 if it needn't be
+} camevent_t;
+
 #endif
 
 
@@ -0,0 +1,117 @@
+//
+//  sysinfo.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "sunspy.h"
+#include "sysinfo.h"
+
+enum { S_TEXT, S_TAG };
+
+void sysinfo_init(sysinfo_t *p, sysinfocam_t cb, void *userdata)
+{
+    memset(p, 0, sizeof(*p));
+    p->number = -1;
+    p->cb = cb;
+    p->userdata = userdata;
+}
+
+static unsigned tomode(const char *text)
+{
+    if (!strcasecmp(text, "active") || !strcasecmp(text, "armed"))
+        return CAM_ACTION_ACTIVE;
+    if (!strcasecmp(text, "passive") || !strcasecmp(text, "disarmed"))
+        return CAM_ACTION_PASSIVE;
+    return 0;
+}
+
+//
+// A tag's been read, p->tag holds what was between < and >.
+//
+static void ontag(sysinfo_t *p)
+{
+    p->tag[p->taglen] = 0;
+    bool closing = p->tag[0] == '/';
+    const char *name = p->tag + closing;
+    size_t len = strcspn(name, " \t\r\n/");
+
+    if (len == 6 && !strncmp(name, "camera", 6))
+    {
+        if (!closing)
+        {
+            p->incamera = true;
+            p->number = -1;
+            p->mode = p->modem = 0;
+        }
+        else if (p->incamera)
+        {
+            p->incamera = false;
+            unsigned mode = p->mode ? p->mode : p->modem;
+            if (p->number >= 0 && mode)
+            {
+                p->cameras++;
+                p->cb((unsigned)p->number, mode, p->userdata);
+            }
+        }
+    }
+    else if (closing && p->incamera)
+    {
+        p->text[p->textlen] = 0;
+        char *text = p->text;
+        while (isspace((unsigned char)*text))
+            text++;
+        text[strcspn(text, " \t\r\n")] = 0;
+
+        if (len == 6 && !strncmp(name, "number", 6))
+        {
+            char *end;
+            long n = strtol(text, &end, 10);
+            if (end != text && !*end && n >= 0)
+                p->number = n;
+        }
+        else if (len == 4 && !strncmp(name, "mode", 4))
+            p->mode = tomode(text);
+        else if (len == 6 && !strncmp(name, "mode-m", 6))
+            p->modem = tomode(text);
+    }
+
+    // text belongs to the element just opened or closed
+    p->textlen = 0;
+}
+
+//
+// Feeds the parser the next 'len' bytes of the reply, however it's
+// split up.
+//
+void sysinfo_parse(sysinfo_t *p, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = data[i];
+        if (p->state == S_TEXT)
+        {
+            if (c == '<')
+            {
+                p->state = S_TAG;
+                p->taglen = 0;
+            }
+            else if (p->textlen < SYSINFO_TEXT - 1)
+                p->text[p->textlen++] = c;
+        }
+        else if (c == '>')
+        {
+            p->state = S_TEXT;
+            ontag(p);
+        }
+        else if (p->taglen < SYSINFO_TEXT - 1)
+            p->tag[p->taglen++] = c;
+    }
+}
@@ -0,0 +1,42 @@
+//
+//  sysinfo.h
+//
+//  Reads the mode each camera is in from SecuritySpy's ++systemInfo
+//  reply as it arrives. Only <camera> elements in it are looked at:
+//
+//    <camera><number>3</number> .. <mode>active</mode> .. </camera>
+//
+//  Servers without <mode> are read from <mode-m>, armed being ACTIVE.
+//
+
+#ifndef SYSINFO_H
+  #define SYSINFO_H
+
+#include <stddef.h>
+#include "sunspy.h"
+
+#define SYSINFO_TEXT    32
+
+// Called for each camera with CAM_ACTION_ACTIVE or CAM_ACTION_PASSIVE.
+typedef void (*sysinfocam_t)(unsigned number, unsigned action, void *userdata);
+
+typedef struct
+{
+    int state;
+    char tag[SYSINFO_TEXT];     // element being opened or closed
+    size_t taglen;
+    char text[SYSINFO_TEXT];    // its text so far
+    size_t textlen;
+    bool incamera;
+    long number;                // of the camera being read, -1 if not seen
+    unsigned mode;              // from <mode>, 0 if not seen
+    unsigned modem;             // from <mode-m>
+    unsigned cameras;           // reported so far
+    sysinfocam_t cb;
+    void *userdata;
+} sysinfo_t;
+
+void sysinfo_init(sysinfo_t *p, sysinfocam_t cb, void *userdata);
+void sysinfo_parse(sysinfo_t *p, const char *data, size_t len);
+
+#endif
@@ -0,0 +1,1302 @@
+//
+//  test.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "sunspy.h"
+#include "sunriset.h"
+#include "solar.h"
+#include "sunbatch.h"
+#include "loop.h"
+#include "http.h"
+#include "timer.h"
+#include "bench.h"
+#include "arena.h"
+#include "control.h"
+#include "metrics.h"
+#include "log.h"
+#include "location.h"
+#include "timeexpr.h"
+#include "retry.h"
+#include "sysinfo.h"
+#include "journal.h"
+#include "test.h"
+
+// from sunspy.c
+extern double lat, lon, tz;
+extern bool verbose;
+extern arena_t *configarena;
+extern server_t *serverlist;
+extern unsigned numservers;
+typedef struct fleet_t fleet_t;
+extern fleet_t *fleet;
+fleet_t *newfleet(void);
+void releasefleet(fleet_t *f);
+void addcamera(camera_t *cameras, unsigned *count, const char *name, unsigned number, const char *start, const char *stop);
+server_t *addserver(const char *name, const char *url, const char *user, const char *password, camera_t *cameras, unsigned numcameras);
+void prepareserver(server_t *sv);
+void calc_sunrise_sunset(time_t tt);
+void startworker(server_t *sv);
+void stopworkers(void);
+unsigned reapworkers(void);
+void wakeworker(server_t *sv);
+void replaceservers(fleet_t *oldfleet, server_t *oldservers, unsigned oldnumservers,
+                    unsigned *started, unsigned *stopped);
+extern char *geocache, *geourl;
+extern int geottl;
+extern bool refreshlocation;
+void findlocation(location_t *loc);
+void *georefresh(void *arg);
+
+#if defined(TEST_HEAPCOUNT) && defined(__GLIBC__)
+// glibc lets a program replace malloc and friends. This build counts
+// every heap call in the process, for the tests that check nothing is
+// allocated or leaked, and passes them on to glibc's own. Calls made
+// from sunspy's own code, rather than curl's or libc's, are counted
+// apart; strdup() and strndup() count as their caller's.
+#define HEAPCOUNT
+extern char __executable_start[], etext[];
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *p);
+
+static volatile unsigned long heapcalls = 0;    // allocations and reallocations
+static volatile unsigned long owncalls = 0;     // those made by sunspy's code
+static volatile long heaplive = 0;              // blocks not yet freed
+
+static void called(const void *caller)
+{
+    __sync_fetch_and_add(&heapcalls, 1);
+    if ((const char *)caller >= __executable_start && (const char *)caller < etext)
+        __sync_fetch_and_add(&owncalls, 1);
+}
+
+static void *counted(void *p, const void *caller)
+{
+    called(caller);
+    if (p)
+        __sync_fetch_and_add(&heaplive, 1);
+    return p;
+}
+
+void *malloc(size_t size)
+{
+    return counted(__libc_malloc(size), __builtin_return_address(0));
+}
+
+void *calloc(size_t n, size_t size)
+{
+    return counted(__libc_calloc(n, size), __builtin_return_address(0));
+}
+
+char *strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *p = counted(__libc_malloc(len), __builtin_return_address(0));
+    return p ? memcpy(p, str, len) : NULL;
+}
+
+char *strndup(const char *str, size_t n)
+{
+    size_t len = strnlen(str, n);
+    char *p = counted(__libc_malloc(len + 1), __builtin_return_address(0));
+    if (!p)
+        return NULL;
+    memcpy(p, str, len);
+    p[len] = 0;
+    return p;
+}
+
+void *realloc(void *p, size_t size)
+{
+    called(__builtin_return_address(0));
+    void *q = __libc_realloc(p, size);
+    if (!p && q)
+        __sync_fetch_and_add(&heaplive, 1);
+    else if (p && !size && !q)
+        __sync_fetch_and_sub(&heaplive, 1);
+    return q;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return counted(__libc_memalign(align, size), __builtin_return_address(0));
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return counted(__libc_memalign(align, size), __builtin_return_address(0));
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+    *p = counted(__libc_memalign(align, size), __builtin_return_address(0));
+    return *p ? 0 : ENOMEM;
+}
+
+void free(void *p)
+{
+    if (!p)
+        return;
+    __sync_fetch_and_sub(&heaplive, 1);
+    __libc_free(p);
+}
+#endif
+
+static unsigned failed;         // checks failed in the test being run
+static bool named;              // its name's on the line, waiting for the result
+
+//
+// Counts a failure, saying why, unless ok.
+//
+static bool expect(bool ok, const char *fmt, ...)
+{
+    if (ok)
+        return true;
+    if (named)
+        printf("\n");
+    named = false;
+    va_list ap;
+    va_start(ap, fmt);
+    printf("    ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    failed++;
+    return false;
+}
+
+//
+// Seconds between two times of day in hours, either way round midnight.
+//
+static double apart(double a, double b)
+{
+    double d = fmod(fabs(a - b), 24.0);
+    return (d > 12.0 ? 24.0 - d : d) * 3600.0;
+}
+
+static void hms(double hours, char *buf)
+{
+    hours -= 24.0 * floor(hours / 24.0);
+    long s = lround(hours * 3600.0);
+    sprintf(buf, "%02ld:%02ld:%02ld", s / 3600 % 24, s / 60 % 60, s % 60);
+}
+
+//
+// Published sun times, UT, as NOAA's solar calculator gives them. Most
+// are only given to the minute.
+//
+static const struct
+{
+    const char *place;
+    double lat, lon;
+    unsigned year, month, day;
+    double rise, noon, set;     // hours UT, NOT_SET for none or not given
+    DayType type;
+} published[] = {
+    { "London",  51.5074,  -0.1278, 2014,  6, 21,  3 + 43 / 60.0, 12 +  2 / 60.0, 20 + 21 / 60.0 + 41 / 3600.0, DAYTYPE_NORMAL },
+    { "London",  51.5074,  -0.1278, 2014, 12, 21,  8 +  4 / 60.0, 11 + 58 / 60.0, 15 + 53 / 60.0, DAYTYPE_NORMAL },
+    { "Sydney", -33.8688, 151.2093, 2014,  6, 21, 21 +  0 / 60.0,  1 + 57 / 60.0,  6 + 54 / 60.0, DAYTYPE_NORMAL },
+    { "Tromso",  69.6492,  18.9553, 2014,  6, 21, NOT_SET,        NOT_SET,        NOT_SET,        DAYTYPE_POLAR_DAY },
+    { "Tromso",  69.6492,  18.9553, 2014, 12, 21, NOT_SET,        NOT_SET,        NOT_SET,        DAYTYPE_POLAR_NIGHT },
+};
+
+#define TEST_PUBLISHED  90.0    // seconds, they're to the minute
+
+//
+// The noaa engine against published rise, noon and set times.
+//
+static void test_solar()
+{
+    for (unsigned i = 0; i < sizeof(published) / sizeof(published[0]); i++)
+    {
+        sunrise_t sr;
+        sr.latitude = published[i].lat;
+        sr.longitude = published[i].lon;
+        sr.daysSince2000 = daysSince2000(published[i].year, published[i].month, published[i].day);
+        sr.twilightAngle = TWILIGHT_ANGLE_DAYLIGHT;
+        sunriset_noaa(&sr);
+
+        char got[3][12], want[3][12];
+        hms(sr.riseTime, got[0]);
+        hms(sr.noonTime, got[1]);
+        hms(sr.setTime, got[2]);
+        hms(published[i].rise, want[0]);
+        hms(published[i].noon, want[1]);
+        hms(published[i].set, want[2]);
+        if (!expect(sr.dayType == published[i].type, "%s %u-%02u-%02u: day type %d, not %d", published[i].place,
+                    published[i].year, published[i].month, published[i].day, sr.dayType, published[i].type))
+            continue;
+        if (published[i].noon != NOT_SET)
+            expect(apart(sr.noonTime, published[i].noon) <= TEST_PUBLISHED, "%s %u-%02u-%02u: noon %s, not %s",
+                   published[i].place, published[i].year, published[i].month, published[i].day, got[1], want[1]);
+        if (sr.dayType != DAYTYPE_NORMAL)
+            continue;
+        expect(apart(sr.riseTime, published[i].rise) <= TEST_PUBLISHED, "%s %u-%02u-%02u: rise %s, not %s",
+               published[i].place, published[i].year, published[i].month, published[i].day, got[0], want[0]);
+        expect(apart(sr.setTime, published[i].set) <= TEST_PUBLISHED, "%s %u-%02u-%02u: set %s, not %s",
+               published[i].place, published[i].year, published[i].month, published[i].day, got[2], want[2]);
+    }
+}
+
+//
+// Every sunriset_batch() kernel this cpu runs against sunriset(), over
+// a grid of sites that takes in the poles, the polar circles, the date
+// line and each twilight, for every day of a year.
+//
+static void test_sunbatch()
+{
+    const double lats[] = { -90, -89.99, -80, -67, -66.6, -66.5, -60, -45, -23.44, -1, 0, 1, 23.44, 45, 60,
+                            66.5, 66.6, 67, 70, 80, 89.99, 90 };
+    const double lons[] = { -180, -179.99, -90, 0, 0.01, 90, 179.99, 180 };
+    const double angles[] = { TWILIGHT_ANGLE_DAYLIGHT, TWILIGHT_ANGLE_CIVIL, TWILIGHT_ANGLE_NAUTICAL,
+                              TWILIGHT_ANGLE_ASTRONOMICAL };
+    const unsigned nlat = sizeof(lats) / sizeof(lats[0]), nlon = sizeof(lons) / sizeof(lons[0]);
+    const unsigned nangle = sizeof(angles) / sizeof(angles[0]), ndays = 366;
+    unsigned n = nlat * nlon * nangle * ndays;
+
+    double *lat = malloc(n * sizeof(double)), *lon = malloc(n * sizeof(double));
+    double *angle = malloc(n * sizeof(double));
+    unsigned int *day = malloc(n * sizeof(unsigned int));
+    double *rise = malloc(n * sizeof(double)), *noon = malloc(n * sizeof(double));
+    double *set = malloc(n * sizeof(double));
+    DayType *type = malloc(n * sizeof(DayType));
+    sunrise_t *ref = malloc(n * sizeof(sunrise_t));
+
+    unsigned k = 0;
+    for (unsigned d = 0; d < ndays; d++)
+        for (unsigned i = 0; i < nlat; i++)
+            for (unsigned j = 0; j < nlon; j++)
+                for (unsigned a = 0; a < nangle; a++, k++)
+                {
+                    lat[k] = ref[k].latitude = lats[i];
+                    lon[k] = ref[k].longitude = lons[j];
+                    angle[k] = ref[k].twilightAngle = angles[a];
+                    day[k] = ref[k].daysSince2000 = daysSince2000(2016, 1, 1) + d;
+                    sunriset(&ref[k]);
+                }
+
+    sunbatch_t b = { n, lat, lon, day, angle, rise, noon, set, type };
+    for (SunbatchIsa isa = SUNBATCH_SCALAR; isa <= SUNBATCH_AVX2; isa++)
+    {
+        if (sunbatch_isa(isa) != isa)
+        {
+            printf("    %s: not on this cpu\n", sunbatch_isaname(isa));
+            continue;
+        }
+        sunriset_batch(&b);
+
+        unsigned bad = 0;
+        for (k = 0; k < n; k++)
+        {
+            double err = 0;
+            if (type[k] == ref[k].dayType)
+            {
+                err = fabs(noon[k] - ref[k].noonTime);
+                if (type[k] == DAYTYPE_NORMAL)
+                    err = fmax(err, fmax(fabs(rise[k] - ref[k].riseTime), fabs(set[k] - ref[k].setTime)));
+            }
+            if (type[k] == ref[k].dayType && err <= SUNBATCH_MAX_ERROR)
+                continue;
+            if (bad++ >= 5)
+                continue;
+            if (type[k] != ref[k].dayType)
+                expect(false, "%s: lat %g lon %g angle %g day %u: day type %d, not %d", sunbatch_isaname(isa),
+                       lat[k], lon[k], angle[k], day[k], type[k], ref[k].dayType);
+            else
+                expect(false, "%s: lat %g lon %g angle %g day %u: %.3gs out", sunbatch_isaname(isa),
+                       lat[k], lon[k], angle[k], day[k], err * 3600);
+        }
+        if (bad > 5)
+            expect(false, "%s: and %u more", sunbatch_isaname(isa), bad - 5);
+    }
+    sunbatch_isa(SUNBATCH_AUTO);
+
+    free(lat); free(lon); free(angle); free(day);
+    free(rise); free(noon); free(set); free(type); free(ref);
+}
+
+// Start/stop times, and what they compile to. Offsets are in seconds.
+static const struct
+{
+    const char *str;
+    bool ok;
+    TimeAnchor anchor;
+    int offset;
+} timeexprs[] = {
+    { "20:30",                      true, ANCHOR_CLOCK,             20*3600 + 30*60 },
+    { "7:05:09",                    true, ANCHOR_CLOCK,             7*3600 + 5*60 + 9 },
+    { "00:00",                      true, ANCHOR_CLOCK,             0 },
+    { "23:59:59",                   true, ANCHOR_CLOCK,             86399 },
+    { "20:30+15m",                  true, ANCHOR_CLOCK,             20*3600 + 45*60 },
+    { "sunrise",                    true, ANCHOR_SUNRISE,           0 },
+    { "  SunSet-30m",               true, ANCHOR_SUNSET,            -30*60 },
+    { "sunset-30",                  true, ANCHOR_SUNSET,            -30*60 },
+    { "noon+1h30m",                 true, ANCHOR_NOON,              90*60 },
+    { "sunset-1h30m",               true, ANCHOR_SUNSET,            -90*60 },
+    { "sunset-1h+30m",              true, ANCHOR_SUNSET,            -30*60 },
+    { "dusk+10s",                   true, ANCHOR_SUNSET,            10 },
+    { "civil_dawn",                 true, ANCHOR_SUNRISE,           0 },
+    { "civil_dusk+1h30m",           true, ANCHOR_SUNSET,            90*60 },
+    { "nautical_dawn-15",           true, ANCHOR_NAUTICAL_DAWN,     -15*60 },
+    { "Nautical_Dusk+1d",           true, ANCHOR_NAUTICAL_DUSK,     86400 },
+    { "astronomical_dawn -1d",      true, ANCHOR_ASTRONOMICAL_DAWN, -86400 },
+    { "astronomical_dusk + 2h",     true, ANCHOR_ASTRONOMICAL_DUSK, 2*3600 },
+    // a bare offset is from sunrise, minutes without a unit
+    { "+6h",                        true, ANCHOR_SUNRISE,           6*3600 },
+    { "90",                         true, ANCHOR_SUNRISE,           90*60 },
+    { "1440",                       true, ANCHOR_SUNRISE,           86400 },
+    { "-1d",                        true, ANCHOR_SUNRISE,           -86400 },
+    // no more than a day either way
+    { "1441",                       false },
+    { "sunset+1d1s",                false },
+    { "-25h",                       false },
+    { "dawn - 2d",                  false },
+    { "12:00+1d",                   true, ANCHOR_CLOCK,             12*3600 + 86400 },
+    // and nothing that doesn't parse
+    { "",                           false },
+    { "   ",                        false },
+    { "24:00",                      false },
+    { "12:60",                      false },
+    { "12:30:60",                   false },
+    { "sundown",                    false },
+    { "sunrises",                   false },
+    { "sunrise30",                  false },
+    { "sunset+",                    false },
+    { "sunset+h",                   false },
+    { "noon-90x",                   false },
+};
+
+//
+// Each time compiled, or rejected. Rejected ones say so on stderr,
+// which is put aside while they do.
+//
+static void test_timeexpr()
+{
+    fflush(stderr);
+    int saved = dup(2), null = open("/dev/null", O_WRONLY);
+    for (unsigned i = 0; i < sizeof(timeexprs) / sizeof(timeexprs[0]); i++)
+    {
+        timeexpr_t te;
+        dup2(null, 2);
+        bool ok = timeexpr_parse(timeexprs[i].str, &te);
+        fflush(stderr);
+        dup2(saved, 2);
+        if (!expect(ok == timeexprs[i].ok, "'%s' %s", timeexprs[i].str, ok ? "compiled" : "was rejected") || !ok)
+            continue;
+        expect(te.anchor == (int)timeexprs[i].anchor && te.offset == timeexprs[i].offset,
+               "'%s' is %s%+ds, not %s%+ds", timeexprs[i].str, timeexpr_anchorname(te.anchor), te.offset,
+               timeexpr_anchorname(timeexprs[i].anchor), timeexprs[i].offset);
+    }
+    close(null);
+    close(saved);
+}
+
+#define TEST_RETRY_SEEDS    500     // backoffs drawn for each attempt
+
+//
+// Retry delays doubling from RETRY_BASE_MS to RETRY_MAX_MS, spread over
+// the upper half of each. Then a breaker opened by BREAKER_FAILURES in a
+// row, its cooldown doubling from BREAKER_COOLDOWN_MS while checks fail,
+// and closed by one that doesn't.
+//
+static void test_retry()
+{
+    mstime_t want = RETRY_BASE_MS;
+    for (unsigned attempt = 1; attempt <= 12; attempt++, want = want * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : want * 2)
+    {
+        mstime_t lo = want, hi = 0;
+        for (unsigned seed = 1; seed <= TEST_RETRY_SEEDS; seed++)
+        {
+            unsigned s = seed * 2654435761u;
+            mstime_t delay = retry_backoff(attempt, &s);
+            lo = delay < lo ? delay : lo;
+            hi = delay > hi ? delay : hi;
+        }
+        // and it's spread over all of it
+        expect(lo >= want / 2 && hi <= want && lo < want / 2 + want / 8 && hi > want - want / 8,
+               "retry %u: backoff %lld..%lldms, not %lld..%lldms", attempt, lo, hi, want / 2, want);
+    }
+
+    breaker_t b;
+    breaker_init(&b);
+    mstime_t now = 1403352000000LL;
+    for (unsigned i = 1; i < BREAKER_FAILURES; i++)
+        expect(!breaker_record(&b, false, now), "failure %u changed the breaker", i);
+    expect(!breaker_record(&b, true, now) && b.failures == 0, "a success didn't start the count again");
+    for (unsigned i = 1; i < BREAKER_FAILURES; i++)
+        breaker_record(&b, false, now);
+    expect(b.state == BREAKER_CLOSED && !breaker_trial(&b, now), "open after %u failures", BREAKER_FAILURES - 1);
+    expect(breaker_record(&b, false, now) && b.state == BREAKER_OPEN && b.trips == 1
+           && b.until == now + BREAKER_COOLDOWN_MS, "%u failures didn't open it for %ums", BREAKER_FAILURES,
+           BREAKER_COOLDOWN_MS);
+    expect(!breaker_record(&b, false, now + 1) && b.until == now + BREAKER_COOLDOWN_MS,
+           "a straggler changed the open breaker");
+
+    // each failed check keeps it open twice as long, up to the most
+    mstime_t cooldown = BREAKER_COOLDOWN_MS;
+    for (unsigned check = 1; check <= 7; check++)
+    {
+        expect(!breaker_trial(&b, b.until - 1), "check %u: half open before the cooldown was up", check);
+        now = b.until;
+        if (!expect(breaker_trial(&b, now) && b.state == BREAKER_HALFOPEN, "check %u: not half open", check))
+            break;
+        cooldown = cooldown * 2 > BREAKER_MAX_COOLDOWN_MS ? BREAKER_MAX_COOLDOWN_MS : cooldown * 2;
+        bool changed = breaker_record(&b, false, now);
+        expect(changed && b.state == BREAKER_OPEN && b.until == now + cooldown,
+               "check %u failed: open for %lldms, not %lldms", check, b.until - now, cooldown);
+    }
+    expect(b.trips == 1, "%lu trips counted for one outage", b.trips);
+
+    // one that goes through closes it, and the cooldown starts over
+    now = b.until;
+    breaker_trial(&b, now);
+    bool closed = breaker_record(&b, true, now);
+    expect(closed && b.state == BREAKER_CLOSED && b.cooldown == BREAKER_COOLDOWN_MS,
+           "check went through: state %d, cooldown %lldms", b.state, b.cooldown);
+    expect(!breaker_record(&b, true, now), "a success changed the closed breaker");
+    for (unsigned i = 1; i <= BREAKER_FAILURES; i++)
+        breaker_record(&b, false, now);
+    expect(b.state == BREAKER_OPEN && b.trips == 2 && b.until == now + BREAKER_COOLDOWN_MS,
+           "reopened: state %d, %lu trips, for %lldms", b.state, b.trips, b.until - now);
+
+    expect(retry_worthwhile(0) && retry_worthwhile(408) && retry_worthwhile(429) && retry_worthwhile(503)
+           && !retry_worthwhile(401) && !retry_worthwhile(404), "wrong replies are worth retrying");
+}
+
+// A ++systemInfo reply, and the cameras and modes that should come out
+// of it. <mode> wins over <mode-m>, armed meaning ACTIVE, and a camera
+// without a number or either mode isn't reported.
+static const char sysinforeply[] =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+    "<system>\r\n"
+    "<server><name>Home</name><version>3.2.1</version></server>\r\n"
+    "<cameralist>\r\n"
+    "<camera><number>1</number><name>Front &amp; side</name><connected>yes</connected>"
+    "<mode>active</mode><mode-c>passive</mode-c><mode-m>disarmed</mode-m></camera>\r\n"
+    "<camera>\r\n  <number> 2 </number>\r\n  <mode>passive</mode>\r\n</camera>\r\n"
+    "<camera><number>3</number><mode-m>armed</mode-m></camera>\r\n"
+    "<camera><number>4</number><mode-m>disarmed</mode-m><name>Back</name></camera>\r\n"
+    "<camera><number>5</number><name>No mode</name></camera>\r\n"
+    "<camera><mode>active</mode></camera>\r\n"
+    "<camera id=\"x\"><number>7</number><mode>unknown</mode><mode-m>Armed</mode-m></camera>\r\n"
+    "<camera><number>12</number><mode>Active</mode><devicename>a very long device name, longer than we keep</devicename></camera>\r\n"
+    "</cameralist>\r\n"
+    "</system>\r\n";
+
+static const struct
+{
+    unsigned number;
+    unsigned action;
+} sysinfocams[] = {
+    { 1, CAM_ACTION_ACTIVE },
+    { 2, CAM_ACTION_PASSIVE },
+    { 3, CAM_ACTION_ACTIVE },
+    { 4, CAM_ACTION_PASSIVE },
+    { 7, CAM_ACTION_ACTIVE },
+    { 12, CAM_ACTION_ACTIVE },
+};
+#define NUM_SYSINFOCAMS (sizeof(sysinfocams) / sizeof(sysinfocams[0]))
+
+typedef struct
+{
+    unsigned count;
+    unsigned number[NUM_SYSINFOCAMS + 1];
+    unsigned action[NUM_SYSINFOCAMS + 1];
+} sysinfoseen_t;
+
+static void sysinfocam(unsigned number, unsigned action, void *userdata)
+{
+    sysinfoseen_t *seen = userdata;
+    if (seen->count <= NUM_SYSINFOCAMS)
+    {
+        seen->number[seen->count] = number;
+        seen->action[seen->count] = action;
+    }
+    seen->count++;
+}
+
+//
+// The reply fed in a byte at a time, then split in two at every offset,
+// gives the same cameras and modes every time.
+//
+static void test_sysinfo()
+{
+    size_t len = strlen(sysinforeply);
+    for (size_t split = 0; split <= len + 1; split++)
+    {
+        sysinfoseen_t seen;
+        memset(&seen, 0, sizeof(seen));
+        sysinfo_t p;
+        sysinfo_init(&p, sysinfocam, &seen);
+        char how[32];
+        if (split > len)
+        {
+            for (size_t i = 0; i < len; i++)
+                sysinfo_parse(&p, sysinforeply + i, 1);
+            sprintf(how, "a byte at a time");
+        }
+        else
+        {
+            sysinfo_parse(&p, sysinforeply, split);
+            sysinfo_parse(&p, sysinforeply + split, len - split);
+            sprintf(how, "split at %zu", split);
+        }
+
+        if (!expect(seen.count == NUM_SYSINFOCAMS && p.cameras == NUM_SYSINFOCAMS, "%s: %u cameras, not %u",
+                    how, seen.count, (unsigned)NUM_SYSINFOCAMS))
+            break;
+        unsigned i;
+        for (i = 0; i < NUM_SYSINFOCAMS; i++)
+            if (seen.number[i] != sysinfocams[i].number || seen.action[i] != sysinfocams[i].action)
+                break;
+        if (!expect(i == NUM_SYSINFOCAMS, "%s: camera %u is #%u %s", how, i, seen.number[i],
+                    seen.action[i] == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE"))
+            break;
+    }
+}
+
+//
+// A loopback port nothing's listening on.
+//
+static unsigned deadport()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+#define TEST_HTTP_SLOW      40      // requests to the slow server
+#define TEST_HTTP_REFUSED   8       // to the one that says 401
+#define TEST_HTTP_DEAD      2       // and to one that isn't there
+#define TEST_HTTP_INFLIGHT  4
+#define TEST_HTTP_DELAYMS   50
+#define TEST_HTTP_TIMEOUT   10000   // ms for the lot
+
+static void httpcounted(httpreq_t *req, void *userdata)
+{
+    (*(unsigned *)userdata)++;
+}
+
+//
+// http_submit() against mock servers: each request completes exactly
+// once with its server's answer, and the slow one never has more than
+// the in flight limit at once, though it gets that many.
+//
+static void test_http()
+{
+    mockserver_t slow, refused;
+    mockstart(&slow, TEST_HTTP_DELAYMS, 200);
+    mockstart(&refused, 0, 401);
+    char slowurl[64], refusedurl[64], deadurl[64];
+    sprintf(slowurl, "http://127.0.0.1:%u/++ssControlActiveMode?cameraNum=1", slow.port);
+    sprintf(refusedurl, "http://127.0.0.1:%u/++ssControlActiveMode?cameraNum=1", refused.port);
+    sprintf(deadurl, "http://127.0.0.1:%u/++ssControlActiveMode?cameraNum=1", deadport());
+
+    const unsigned n = TEST_HTTP_SLOW + TEST_HTTP_REFUSED + TEST_HTTP_DEAD;
+    httpreq_t reqs[n];
+    unsigned calls[n];
+    int want[n];
+    memset(reqs, 0, sizeof(reqs));
+    memset(calls, 0, sizeof(calls));
+
+    loop_t *loop = loop_new();
+    http_setloop(loop);
+    http_setmaxinflight(TEST_HTTP_INFLIGHT);
+    for (unsigned i = 0; i < n; i++)
+    {
+        // interleaved, so the slow server's queue doesn't hold up the others
+        unsigned k = i % (n / TEST_HTTP_DEAD);
+        reqs[i].url = k == 0 ? deadurl : k <= TEST_HTTP_REFUSED / TEST_HTTP_DEAD ? refusedurl : slowurl;
+        reqs[i].userpwd = "test:test";
+        want[i] = k == 0 ? 0 : k <= TEST_HTTP_REFUSED / TEST_HTTP_DEAD ? 401 : 200;
+        http_submit(&reqs[i], httpcounted, &calls[i]);
+    }
+
+    mstime_t t0 = timer_monotonic();
+    while (http_outstanding() && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+        loop_once(loop, 100);
+    expect(!http_outstanding(), "%u requests still outstanding after %ums", http_outstanding(), TEST_HTTP_TIMEOUT);
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        expect(calls[i] == 1, "request %u completed %u times", i, calls[i]);
+        expect(reqs[i].httpcode == want[i], "request %u to %s got %d, not %d", i, reqs[i].url, reqs[i].httpcode, want[i]);
+        if (!want[i])
+            expect(reqs[i].curlcode != 0, "request %u to %s failed without a curl error", i, reqs[i].url);
+    }
+    expect(slow.served == TEST_HTTP_SLOW, "slow server answered %u, not %u", slow.served, TEST_HTTP_SLOW);
+    expect(slow.maxactive == TEST_HTTP_INFLIGHT, "slow server had %u at once, limit %u",
+           slow.maxactive, TEST_HTTP_INFLIGHT);
+
+    // every reply takes a while, so running the lot took rounds of the limit
+    mstime_t took = timer_monotonic() - t0;
+    expect(took >= TEST_HTTP_SLOW / TEST_HTTP_INFLIGHT * TEST_HTTP_DELAYMS, "slow server's requests took %lldms", took);
+
+    http_setloop(NULL);
+    loop_free(loop);
+}
+
+#define TEST_ALLOCS_CAMERAS 50
+#define TEST_ALLOCS_ROUNDS  10
+#define TEST_ALLOCS_WARMUP  2      // a round of each command, to fill curl's pool
+
+//
+// ACTIVE and PASSIVE commands that have come back for sv.
+//
+static unsigned long long answered(const server_t *sv)
+{
+    unsigned long long count = 0;
+    for (unsigned i = 0; i <= METRICS_BUCKETS; i++)
+        count += sv->metrics->http[ENDPOINT_ACTIVE].counts[i] + sv->metrics->http[ENDPOINT_PASSIVE].counts[i];
+    return count;
+}
+
+//
+// A worker dispatching every camera's sunrise and sunset events as they
+// come due, days of them on a simulated clock. Its request buffers are
+// made up front, a buffer per camera, and once it's warmed up sunspy's
+// code makes no heap calls at all.
+//
+static void test_allocs()
+{
+    mockserver_t ms;
+    mockstart(&ms, 0, 200);
+    char url[32];
+    sprintf(url, "http://127.0.0.1:%u", ms.port);
+
+    bool wasverbose = verbose;
+    verbose = false;
+    lat = 51.5; lon = 0; tz = 0;
+    mstime_t now = timer_now();
+    timer_setvirtual(now);
+    newfleet();
+    camera_t *cams = arena_array(configarena, TEST_ALLOCS_CAMERAS, sizeof(camera_t));
+    unsigned count = 0;
+    for (unsigned i = 0; i < TEST_ALLOCS_CAMERAS; i++)
+        addcamera(cams, &count, "test", i + 1, "sunrise", "sunset");
+    server_t *sv = addserver("allocs", url, "test", "test", cams, count);
+    prepareserver(sv);
+    calc_sunrise_sunset((time_t)(now / 1000));
+    startworker(sv);
+
+    unsigned long before = 0;
+#ifdef HEAPCOUNT
+    unsigned long own = 0;
+#endif
+    for (unsigned round = 0; round < TEST_ALLOCS_ROUNDS; round++)
+    {
+        // wait for it to queue the next batch, then move the clock there
+        mstime_t t0 = timer_monotonic();
+        while (sv->nextevent <= now && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+            usleep(1000);
+        if (!expect(sv->nextevent > now, "round %u: nothing queued", round))
+            break;
+        now = sv->nextevent;
+        timer_setvirtual(now);
+        wakeworker(sv);
+
+        unsigned long long want = (round + 1) * (unsigned long long)count;
+        while (answered(sv) < want && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+            usleep(1000);
+        if (!expect(answered(sv) == want, "round %u: %llu commands answered, not %llu", round, answered(sv), want))
+            break;
+        if (round == 0)
+            before = sv->allocs;
+#ifdef HEAPCOUNT
+        if (round == TEST_ALLOCS_WARMUP - 1)
+            own = owncalls;
+#endif
+    }
+    expect(before == count, "%lu request buffers for %u cameras", before, count);
+    expect(sv->allocs == before, "%lu request buffers after %u rounds, %lu after the first", sv->allocs,
+           TEST_ALLOCS_ROUNDS, before);
+#ifdef HEAPCOUNT
+    unsigned events = (TEST_ALLOCS_ROUNDS - TEST_ALLOCS_WARMUP) * count;
+    expect(owncalls == own, "%lu heap calls by sunspy for %u events", owncalls - own, events);
+#else
+    printf("    heap calls not counted in this build\n");
+#endif
+
+    stopworkers();
+    timer_setvirtual(0);
+    releasefleet(fleet);
+    fleet = NULL;
+    serverlist = NULL;
+    numservers = 0;
+    verbose = wasverbose;
+}
+
+#define TEST_RELOAD_CAMERAS 10
+#define TEST_RELOAD_CYCLES  12
+
+//
+// Adds a server called name with its cameras to the fleet being loaded.
+//
+static server_t *testserver(const char *name, const char *url, unsigned cameras)
+{
+    camera_t *cams = arena_array(configarena, cameras, sizeof(camera_t));
+    unsigned count = 0;
+    for (unsigned i = 0; i < cameras; i++)
+        addcamera(cams, &count, "test", i + 1, "sunrise", "sunset");
+    server_t *sv = addserver(name, url, "test", "test", cams, count);
+    prepareserver(sv);
+    return sv;
+}
+
+//
+// Loads servers b, and a unless it's away, in place of what's running,
+// the way a SIGHUP does. Returns how many workers were started.
+//
+static unsigned reloadtest(const char *url, bool away)
+{
+    fleet_t *oldfleet = fleet;
+    server_t *oldservers = serverlist;
+    unsigned oldnumservers = numservers;
+    newfleet();
+    serverlist = NULL;
+    numservers = 0;
+    testserver("b", url, TEST_RELOAD_CAMERAS);
+    if (!away)
+        testserver("a", url, TEST_RELOAD_CAMERAS);
+
+    unsigned started, stopped;
+    replaceservers(oldfleet, oldservers, oldnumservers, &started, &stopped);
+    expect(stopped == (away ? 1 : 0), "%u workers stopped, a %s", stopped, away ? "went" : "came back");
+    return started;
+}
+
+//
+// ++systemInfo probes that have come back for sv.
+//
+static unsigned long long probed(const server_t *sv)
+{
+    unsigned long long count = 0;
+    for (unsigned i = 0; i <= METRICS_BUCKETS; i++)
+        count += sv->metrics->http[ENDPOINT_INFO].counts[i];
+    return count;
+}
+
+//
+// Reloads a server away and back, over and over. Its worker is stopped
+// and reaped each time and a new one started, and nothing the old ones
+// had is left on the heap.
+//
+static void test_reload()
+{
+    mockserver_t ms;
+    mockstart(&ms, 0, 200);
+    char url[32];
+    sprintf(url, "http://127.0.0.1:%u", ms.port);
+
+    bool wasverbose = verbose;
+    verbose = false;
+    lat = 51.5; lon = 0; tz = 0;
+    newfleet();
+    testserver("a", url, TEST_RELOAD_CAMERAS);
+    testserver("b", url, TEST_RELOAD_CAMERAS);
+    calc_sunrise_sunset(time(NULL));
+    for (server_t *sv = serverlist; sv; sv = sv->next)
+        startworker(sv);
+    mstime_t t0 = timer_monotonic();
+    while (probed(serverlist) < 1 && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+        usleep(1000);
+
+    long live[TEST_RELOAD_CYCLES];
+    for (unsigned cycle = 0; cycle < TEST_RELOAD_CYCLES; cycle++)
+    {
+        reloadtest(url, true);
+        t0 = timer_monotonic();
+        while (reapworkers() > 1 && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+            usleep(1000);
+        if (!expect(reapworkers() == 1, "cycle %u: a's worker wasn't reaped", cycle))
+            break;
+#ifdef HEAPCOUNT
+        live[cycle] = heaplive;
+#else
+        live[cycle] = 0;
+#endif
+        unsigned started = reloadtest(url, false);
+        expect(started == 1, "cycle %u: %u workers started when a came back", cycle, started);
+
+        // let the new worker get going, it probes the server once it has
+        server_t *a = serverlist->name[0] == 'a' ? serverlist : serverlist->next;
+        t0 = timer_monotonic();
+        while (probed(a) < cycle + 2 && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+            usleep(1000);
+        expect(probed(a) == cycle + 2, "cycle %u: a's new worker probed %llu times", cycle, probed(a));
+    }
+
+    // the first cycles settle curl's caches, after that it's level
+    const unsigned half = TEST_RELOAD_CYCLES / 2;
+    expect(live[TEST_RELOAD_CYCLES - 1] <= live[half], "%ld blocks on the heap after %u reloads, %ld after %u",
+           live[TEST_RELOAD_CYCLES - 1], TEST_RELOAD_CYCLES, live[half], half);
+
+    stopworkers();
+    releasefleet(fleet);
+    fleet = NULL;
+    serverlist = NULL;
+    numservers = 0;
+    verbose = wasverbose;
+}
+
+// Geolocation replies, and what should come out of them.
+static const struct
+{
+    const char *reply;
+    bool ok;
+    const char *ip;
+    double lat, lon;
+    const char *zone;
+} replies[] = {
+    // freegeoip's csv, before and after it added the time zone
+    { "1.2.3.4,DE,Germany,BW,Baden-Wurttemberg,Tubingen,72070,48.5216,9.0576,,\r\n",
+      true, "1.2.3.4", 48.5216, 9.0576, "" },
+    { "8.8.8.8,US,United States,CA,California,Mountain View,94035,America/Los_Angeles,37.386,-122.0838,807\n",
+      true, "8.8.8.8", 37.386, -122.0838, "America/Los_Angeles" },
+    { "\"5.6.7.8\",\"GB\",\"United Kingdom\",\"ENG\",\"England\",\"London, \"\"City\"\"\",\"EC1A\",\"Europe/London\",51.5142,-0.0931,0",
+      true, "5.6.7.8", 51.5142, -0.0931, "Europe/London" },
+    // json, ip-api's keys and freegeoip's, nested and escaped values skipped
+    { "{\"status\":\"success\",\"country\":\"Germany\",\"lat\":48.52,\"lon\":9.05,\"timezone\":\"Europe/Berlin\",\"query\":\"1.2.3.4\"}",
+      true, "1.2.3.4", 48.52, 9.05, "Europe/Berlin" },
+    { "  {\n \"ip\": \"9.9.9.9\", \"location\": {\"lat\": 1, \"lon\": 2, \"x\": [3, {\"latitude\": 4}]},\n"
+      " \"city\": \"Tu\\\"bingen, \\\\\", \"latitude\": -33.87, \"longitude\": 151.21, \"time_zone\": \"Australia/Sydney\" }\n",
+      true, "9.9.9.9", -33.87, 151.21, "Australia/Sydney" },
+    { "{\"latitude\": 10.5, \"longitude\": -20.25", true, "", 10.5, -20.25, "" },
+    // errors
+    { "", false },
+    { "<html><body>404 Not Found</body></html>", false },
+    { "Rate limit exceeded, try again later\n", false },
+    { "{\"status\":\"fail\",\"message\":\"private range\",\"query\":\"10.0.0.1\"}", false },
+    { "{\"latitude\": \"north\", \"longitude\": 9}", false },
+    { "1.2.3.4,DE,Germany,BW,Baden-Wurttemberg,Tubingen,72070,95.0,9.0,,", false },
+    { "1.2.3.4,DE,Germany", false },
+};
+
+//
+// Parses reply fed in pieces of 'chunk' bytes, 0 for split in two at 'at'.
+//
+static bool parsechunked(const char *reply, size_t chunk, size_t at, location_t *loc)
+{
+    locparser_t p;
+    location_parseinit(&p);
+    size_t len = strlen(reply);
+    if (!chunk)
+    {
+        location_parse(&p, reply, at);
+        location_parse(&p, reply + at, len - at);
+    }
+    else
+        for (size_t off = 0; off < len; off += chunk)
+            location_parse(&p, reply + off, len - off < chunk ? len - off : chunk);
+    return location_parsed(&p, loc);
+}
+
+#define TEST_LOCATION_OVERSIZED (256*1024)  // bytes, far more than any field
+
+//
+// Every reply fetched from a mock service the way the daemon does, an
+// error status, a service that isn't there and replies far too big to
+// hold.
+//
+static void test_locationfetch(const char *url, mockserver_t *ms)
+{
+    for (unsigned i = 0; i < sizeof(replies) / sizeof(replies[0]); i++)
+    {
+        ms->body = replies[i].reply;
+        location_t loc;
+        memset(&loc, 0, sizeof(loc));
+        time_t t0 = time(NULL);
+        bool ok = location_fetch(url, &loc);
+        if (!expect(ok == replies[i].ok, "fetched reply %u: %s", i, ok ? "parsed" : "didn't parse") || !ok)
+            continue;
+        expect(!strcmp(loc.ip, replies[i].ip) && !strcmp(loc.zone, replies[i].zone)
+               && loc.lat == replies[i].lat && loc.lon == replies[i].lon && loc.fetched >= t0,
+               "fetched reply %u: ip '%s' %f, %f zone '%s' fetched %lld", i, loc.ip, loc.lat, loc.lon,
+               loc.zone, (long long)loc.fetched);
+    }
+
+    location_t loc;
+    mockserver_t down;
+    mockstart(&down, 0, 503);
+    down.body = replies[0].reply;
+    char downurl[32];
+    sprintf(downurl, "http://127.0.0.1:%u", down.port);
+    expect(!location_fetch(downurl, &loc), "parsed a 503");
+    sprintf(downurl, "http://127.0.0.1:%u", deadport());
+    expect(!location_fetch(downurl, &loc), "fetched from nothing");
+
+    // the parser keeps nothing of what it doesn't want, however much
+    char *big = malloc(TEST_LOCATION_OVERSIZED + 64);
+    int len = sprintf(big, "{\"city\": \"");
+    memset(big + len, 'x', TEST_LOCATION_OVERSIZED);
+    sprintf(big + len + TEST_LOCATION_OVERSIZED, "\", \"latitude\": 12.5, \"longitude\": -34.25}");
+    ms->body = big;
+    expect(location_fetch(url, &loc) && loc.lat == 12.5 && loc.lon == -34.25,
+           "oversized reply came out at %f, %f", loc.lat, loc.lon);
+    memset(big, 'x', TEST_LOCATION_OVERSIZED);
+    big[TEST_LOCATION_OVERSIZED] = 0;
+    expect(!location_fetch(url, &loc), "parsed %d bytes of x", TEST_LOCATION_OVERSIZED);
+    ms->body = NULL;
+    free(big);
+}
+
+//
+// Where findlocation() gets lat/lon from: the service when there's no
+// cache, the cache when there is, even once it's past geottl, and then
+// the service again in the background, saved over the cache.
+//
+static void test_locationcache(const char *url, mockserver_t *ms, const char *path)
+{
+    char *wasurl = geourl, *wascache = geocache;
+    double waslat = lat, waslon = lon;
+    geourl = (char *)url;
+    geocache = (char *)path;
+    ms->body = replies[1].reply;    // 8.8.8.8, 37.386, -122.0838
+
+    location_t loc, cached;
+    unlink(path);
+    unsigned served = ms->served;
+    lat = lon = 0;
+    findlocation(&loc);
+    expect(ms->served == served + 1 && lat == 37.386 && lon == -122.0838 && !refreshlocation,
+           "with no cache: %u fetches, %f, %f", ms->served - served, lat, lon);
+    expect(location_read(path, &cached) && !strcmp(cached.ip, "8.8.8.8") && cached.fetched >= time(NULL) - 5,
+           "fetched location wasn't cached");
+
+    location_t sydney = { "2001:db8::1", -33.868820, 151.209296, "Australia/Sydney", 0 };
+    for (unsigned stale = 0; stale < 2; stale++)
+    {
+        sydney.fetched = time(NULL) - (stale ? geottl + 60 : 60);
+        location_write(path, &sydney);
+        served = ms->served;
+        lat = lon = 0;
+        findlocation(&loc);
+        expect(ms->served == served && fabs(lat - sydney.lat) < 1e-6 && fabs(lon - sydney.lon) < 1e-6,
+               "%s cache: %u fetches, %f, %f", stale ? "stale" : "fresh", ms->served - served, lat, lon);
+        expect(refreshlocation == stale, "%s cache %s refreshed", stale ? "stale" : "fresh",
+               refreshlocation ? "would be" : "wouldn't be");
+    }
+
+    // the refresh moves us, and the cache with us
+    georefresh(NULL);
+    expect(lat == 37.386 && lon == -122.0838, "refreshed to %f, %f", lat, lon);
+    expect(location_read(path, &cached) && !strcmp(cached.ip, "8.8.8.8") && cached.fetched >= time(NULL) - 5,
+           "refreshed location wasn't cached");
+
+    // and if the service has gone, both stay as they were
+    location_write(path, &sydney);
+    lat = sydney.lat; lon = sydney.lon;
+    ms->status = 500;
+    georefresh(NULL);
+    ms->status = 200;
+    expect(lat == sydney.lat && lon == sydney.lon, "failed refresh moved us to %f, %f", lat, lon);
+    expect(location_read(path, &cached) && cached.fetched == sydney.fetched, "failed refresh rewrote the cache");
+
+    ms->body = NULL;
+    unlink(path);
+    geourl = wasurl;
+    geocache = wascache;
+    lat = waslat;
+    lon = waslon;
+}
+
+//
+// The geolocation reply parser however the reply comes in, and the
+// location cache written and read back. Then the same replies fetched
+// from a mock service, and the cache as findlocation() and the
+// background refresh use it.
+//
+static void test_location()
+{
+    for (unsigned i = 0; i < sizeof(replies) / sizeof(replies[0]); i++)
+    {
+        size_t len = strlen(replies[i].reply);
+        for (size_t split = 0; split <= len + 3; split++)
+        {
+            // a byte at a time, then 2, 3.., then whole, then two pieces split everywhere
+            size_t chunk = split < 8 ? split + 1 : split == 8 ? len + 1 : 0;
+            size_t at = split - 8;
+            if (!chunk && at > len)
+                break;
+            location_t loc;
+            bool ok = parsechunked(replies[i].reply, chunk, at, &loc);
+            char how[32];
+            sprintf(how, chunk ? "%zu byte pieces" : "split at %zu", chunk ? chunk : at);
+            if (!expect(ok == replies[i].ok, "reply %u in %s: %s", i, how, ok ? "parsed" : "didn't parse"))
+                break;
+            if (!ok)
+                continue;
+            if (!expect(!strcmp(loc.ip, replies[i].ip) && !strcmp(loc.zone, replies[i].zone)
+                        && loc.lat == replies[i].lat && loc.lon == replies[i].lon,
+                        "reply %u in %s: ip '%s' %f, %f zone '%s'", i, how, loc.ip, loc.lat, loc.lon, loc.zone))
+                break;
+        }
+    }
+
+    char path[64], tmp[70];
+    sprintf(path, "/tmp/sunspy-test-%d.location", (int)getpid());
+    sprintf(tmp, "%s.new", path);
+    location_t out = { "2001:db8::1", -33.868820, 151.209296, "Australia/Sydney", 1403308800 }, in;
+    expect(location_write(path, &out), "can't write %s", path);
+    expect(access(tmp, F_OK) != 0, "%s left behind", tmp);
+    if (expect(location_read(path, &in), "can't read back %s", path))
+        expect(!strcmp(in.ip, out.ip) && !strcmp(in.zone, out.zone) && in.fetched == out.fetched
+               && fabs(in.lat - out.lat) < 1e-6 && fabs(in.lon - out.lon) < 1e-6,
+               "read back ip '%s' %f, %f zone '%s' fetched %lld", in.ip, in.lat, in.lon, in.zone, (long long)in.fetched);
+
+    // a cache without both lat and lon is no use
+    FILE *f = fopen(path, "w");
+    fprintf(f, "# hand edited\nip=1.2.3.4\nlat=48.5\nlon=north\n");
+    fclose(f);
+    expect(!location_read(path, &in), "read a cache with a bad lon");
+    unlink(path);
+    expect(!location_read(path, &in), "read a cache that isn't there");
+
+    mockserver_t ms;
+    mockstart(&ms, 0, 200);
+    char url[32];
+    sprintf(url, "http://127.0.0.1:%u", ms.port);
+    log_setlevel("error");      // the failures are meant to happen
+    test_locationfetch(url, &ms);
+    test_locationcache(url, &ms, path);
+    log_setlevel("warn");
+}
+
+// A journal as a crash might leave it, and what it says each camera missed.
+static const char journalfile_test[] =
+    "S 1000 1 1 srv\n"
+    "D 2000 1 1 srv\n"
+    "C 2000 1 1 srv\n"      // 1 went ACTIVE at 2000
+    "D 3000 2 2 srv\n"      // 2 came due PASSIVE and never went through
+    "C 1000 1 3 srv\n"
+    "K 4000 2 3 srv\n"      // 3 was paused when it came due PASSIVE
+    "C 5000 2 4 srv\n"      // 4 went PASSIVE
+    "X 5000 2 4 srv\n"
+    "C 5000 9 4 srv\n"
+    "C 6000 1 4 srv";       // and the write going ACTIVE was cut short
+
+static const struct
+{
+    unsigned camera;
+    unsigned action;
+    mstime_t since;
+    bool missed;
+} journalmissed[] = {
+    { 1, CAM_ACTION_ACTIVE, 1500, false },
+    { 1, CAM_ACTION_PASSIVE, 2500, true },
+    { 1, CAM_ACTION_PASSIVE, 1500, false },     // forced since it was due
+    { 2, CAM_ACTION_ACTIVE, 2500, true },
+    { 2, CAM_ACTION_PASSIVE, 2500, true },
+    { 3, CAM_ACTION_PASSIVE, 4500, false },
+    { 3, CAM_ACTION_ACTIVE, 4500, true },
+    { 4, CAM_ACTION_PASSIVE, 5500, false },
+    { 4, CAM_ACTION_ACTIVE, 5500, true },
+    { 9, CAM_ACTION_ACTIVE, 1000, false },      // not in the journal
+};
+
+#define TEST_JOURNAL_CAMERAS    10
+#define TEST_JOURNAL_BYTES      (JOURNAL_COMPACT + JOURNAL_COMPACT / 4)
+
+static off_t filesize(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) ? -1 : st.st_size;
+}
+
+//
+// The C record for camera in the journal at path, 0 if there isn't one.
+//
+static mstime_t journaldone(const char *path, unsigned camera)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char line[256];
+    mstime_t done = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        long long when;
+        unsigned action, cam;
+        if (sscanf(line, "C %lld %u %u", &when, &action, &cam) == 3 && cam == camera)
+            done = when;
+    }
+    fclose(f);
+    return done;
+}
+
+//
+// The journal read back from a crashed run, rewritten on open and read
+// again, compacted once it's grown, and a worker journaling a command
+// reconcile sent for a camera whose event hasn't fired yet.
+//
+static void test_journal()
+{
+    char path[64];
+    sprintf(path, "/tmp/sunspy-test-%d.journal", (int)getpid());
+    FILE *f = fopen(path, "w");
+    fputs(journalfile_test, f);
+    fclose(f);
+
+    // read as left, then as journal_open() rewrote it
+    log_setlevel("error");      // about the lines it skips
+    for (unsigned pass = 0; pass < 2; pass++)
+    {
+        if (!expect(journal_open(path), "pass %u: can't open %s", pass, path))
+            break;
+        for (unsigned i = 0; i < sizeof(journalmissed) / sizeof(journalmissed[0]); i++)
+            expect(journal_missed("srv", journalmissed[i].camera, journalmissed[i].action, journalmissed[i].since)
+                   == journalmissed[i].missed, "pass %u: camera %u %s missed going %s since %lld", pass,
+                   journalmissed[i].camera, journalmissed[i].missed ? "hasn't" : "has",
+                   journalmissed[i].action == CAM_ACTION_ACTIVE ? "ACTIVE" : "PASSIVE", journalmissed[i].since);
+        expect(!journal_missed("other", 2, CAM_ACTION_ACTIVE, 0), "pass %u: another server's camera missed", pass);
+        journal_close();
+    }
+    log_setlevel("warn");
+
+    // enough records to be compacted, each camera ending up ACTIVE at a different time
+    unlink(path);
+    journal_open(path);
+    server_t sv;
+    memset(&sv, 0, sizeof(sv));
+    sv.name = "compact";
+    camevent_t e;
+    memset(&e, 0, sizeof(e));
+    e.server = &sv;
+    mstime_t when = 1403352000000LL;
+    size_t bytes = 0;
+    for (unsigned n = 0; bytes < TEST_JOURNAL_BYTES; n++, when += 1000)
+    {
+        e.camera = n % TEST_JOURNAL_CAMERAS + 1;
+        e.action = n / TEST_JOURNAL_CAMERAS % 2 ? CAM_ACTION_PASSIVE : CAM_ACTION_ACTIVE;
+        journal_record(JOURNAL_SCHEDULED, when + 60000, &e);
+        journal_record(JOURNAL_DUE, when, &e);
+        journal_record(JOURNAL_DONE, when, &e);
+        bytes += 3 * snprintf(NULL, 0, "S %lld %u %u %s\n", when, e.action, e.camera, sv.name);
+    }
+    mstime_t last = when - 1000;
+    e.action = CAM_ACTION_ACTIVE;
+    for (unsigned c = 1; c <= TEST_JOURNAL_CAMERAS; c++)
+    {
+        e.camera = c;
+        journal_record(JOURNAL_DONE, last + c, &e);
+    }
+    mstime_t t0 = timer_monotonic();
+    while (filesize(path) >= JOURNAL_COMPACT / 2 && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+        usleep(1000);
+    journal_close();
+    expect(filesize(path) < JOURNAL_COMPACT / 2, "%lld bytes left after %zu were written",
+           (long long)filesize(path), bytes);
+    journal_open(path);
+    for (unsigned c = 1; c <= TEST_JOURNAL_CAMERAS; c++)
+        expect(!journal_missed("compact", c, CAM_ACTION_ACTIVE, last + c)
+               && journal_missed("compact", c, CAM_ACTION_PASSIVE, last + c + 1),
+               "camera %u isn't ACTIVE as of %lld after compacting", c, last + c);
+    journal_close();
+    expect(journaldone(path, 1) == last + 1, "camera 1's C record is %lld, not %lld", journaldone(path, 1), last + 1);
+
+    // midday, the camera's PASSIVE but should be ACTIVE from sunrise
+    unlink(path);
+    mockserver_t ms;
+    mockstart(&ms, 0, 200);
+    ms.body = "<system><cameralist><camera><number>1</number><mode>passive</mode></camera></cameralist></system>";
+    char url[32];
+    sprintf(url, "http://127.0.0.1:%u", ms.port);
+
+    bool wasverbose = verbose;
+    verbose = false;
+    lat = 51.5; lon = 0; tz = 0;
+    mstime_t now = 1403352000000LL;     // 2014-06-21 12:00 UTC
+    timer_setvirtual(now);
+    journal_open(path);
+    newfleet();
+    server_t *s = testserver("journal", url, 1);
+    calc_sunrise_sunset((time_t)(now / 1000));
+    startworker(s);
+    t0 = timer_monotonic();
+    while (answered(s) < 1 && timer_monotonic() - t0 < TEST_HTTP_TIMEOUT)
+        usleep(1000);
+    expect(answered(s) == 1 && s->reconciled == 1, "%llu commands answered, %lu reconciled", answered(s), s->reconciled);
+    stopworkers();
+    journal_close();
+
+    expect(journaldone(path, 1) == now, "ACTIVE sent at %lld journaled as %lld", now, journaldone(path, 1));
+    journal_open(path);
+    expect(!journal_missed("journal", 1, CAM_ACTION_ACTIVE, now - 6 * 60*60*1000),
+           "camera 1 missed going ACTIVE after a restart");
+    journal_close();
+
+    timer_setvirtual(0);
+    releasefleet(fleet);
+    fleet = NULL;
+    serverlist = NULL;
+    numservers = 0;
+    verbose = wasverbose;
+    unlink(path);
+}
+
+static const struct
+{
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "solar", test_solar },
+    { "sunbatch", test_sunbatch },
+    { "timeexpr", test_timeexpr },
+    { "retry", test_retry },
+    { "sysinfo", test_sysinfo },
+    { "http", test_http },
+    { "allocs", test_allocs },
+    { "reload", test_reload },
+    { "location", test_location },
+    { "journal", test_journal },
+};
+
+//
+// Runs every test, returns how many failed.
+//
+unsigned runtests()
+{
+    unsigned failures = 0;
+    log_setlevel("warn");   // the workers' chatter isn't what's being tested
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        failed = 0;
+        printf("%-12s ", tests[i].name);
+        fflush(stdout);
+        named = true;
+        tests[i].run();
+        if (!named)
+            printf("%-12s ", tests[i].name);
+        printf("%s\n", failed ? "FAILED" : "ok");
+        named = false;
+        if (failed)
+            failures++;
+    }
+    printf("%u of %u tests failed\n", failures, (unsigned)(sizeof(tests) / sizeof(tests[0])));
+    return failures;
+}
@@ -0,0 +1,16 @@
+//
+//  test.h
+//
+//  Built-in self tests, run with --test. Each prints whether it passed
+//  and why not; --test exits non-zero if any didn't. make check runs
+//  them.
+//
+
+#ifndef TEST_H
+  #define TEST_H
+
+#include "sunspy.h"
+
+unsigned runtests(void);
+
+#endif
@@ -0,0 +1,176 @@
+//
+//  timeexpr.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "sunspy.h"
+#include "timeexpr.h"
+
+// Longer names first, so "dawn" doesn't match the front of something else.
+static const struct
+{
+    const char *name;
+    TimeAnchor anchor;
+} anchornames[] =
+{ { "astronomical_dawn",    ANCHOR_ASTRONOMICAL_DAWN }
+, { "astronomical_dusk",    ANCHOR_ASTRONOMICAL_DUSK }
+, { "nautical_dawn",        ANCHOR_NAUTICAL_DAWN }
+, { "nautical_dusk",        ANCHOR_NAUTICAL_DUSK }
+, { "civil_dawn",           ANCHOR_SUNRISE }
+, { "civil_dusk",           ANCHOR_SUNSET }
+, { "sunrise",              ANCHOR_SUNRISE }
+, { "sunset",               ANCHOR_SUNSET }
+, { "noon",                 ANCHOR_NOON }
+, { "dawn",                 ANCHOR_SUNRISE }
+, { "dusk",                 ANCHOR_SUNSET }
+};
+#define NUM_ANCHORNAMES (sizeof(anchornames)/sizeof(anchornames[0]))
+
+// Which sunriset() result each sun anchor is.
+static const struct
+{
+    const char *twilight;           // for calctime()
+    SunEvent event;
+    const char *name;               // for reports, dawn/dusk come out as sunrise/sunset
+} anchorsun[NUM_ANCHORS] =
+{ { "civil",        SUN_RISE,   "sunrise" }
+, { "civil",        SUN_NOON,   "noon" }
+, { "civil",        SUN_SET,    "sunset" }
+, { "nautical",     SUN_RISE,   "nautical_dawn" }
+, { "nautical",     SUN_SET,    "nautical_dusk" }
+, { "astronomical", SUN_RISE,   "astronomical_dawn" }
+, { "astronomical", SUN_SET,    "astronomical_dusk" }
+, { NULL,           SUN_NOON,   "clock" }
+};
+
+const char *timeexpr_twilight(TimeAnchor anchor)
+{
+    return anchorsun[anchor].twilight;
+}
+
+SunEvent timeexpr_event(TimeAnchor anchor)
+{
+    return anchorsun[anchor].event;
+}
+
+const char *timeexpr_anchorname(TimeAnchor anchor)
+{
+    return anchorsun[anchor].name;
+}
+
+static int number(const char **s)
+{
+    int n = 0;
+    while (isdigit(**s) && n < 100000000)
+        n = n * 10 + *(*s)++ - '0';
+    return n;
+}
+
+//
+// Compiles str into te. False, with a message, if it doesn't parse.
+//
+bool timeexpr_parse(const char *str, timeexpr_t *te)
+{
+    const char *s = str;
+    bool bare = true;   // just an offset, from sunrise
+    te->anchor = ANCHOR_SUNRISE;
+    te->offset = 0;
+
+    while (isspace(*s))
+        s++;
+
+    if (isdigit(s[0]) && (s[1] == ':' || (isdigit(s[1]) && s[2] == ':')))
+    {
+        // HH:MM[:SS]
+        int h = number(&s);
+        s++;
+        int m = number(&s), sec = 0;
+        if (*s == ':')
+        {
+            s++;
+            sec = number(&s);
+        }
+        if (h > 23 || m > 59 || sec > 59)
+            goto bad;
+        te->anchor = ANCHOR_CLOCK;
+        bare = false;
+        te->offset = h * 60*60 + m * 60 + sec;
+    }
+    else if (isalpha(*s))
+    {
+        unsigned i;
+        for (i = 0; i < NUM_ANCHORNAMES; i++)
+        {
+            size_t len = strlen(anchornames[i].name);
+            if (!strncasecmp(anchornames[i].name, s, len) && !isalnum(s[len]) && s[len] != '_')
+                break;
+        }
+        if (i == NUM_ANCHORNAMES)
+            goto bad;
+        te->anchor = anchornames[i].anchor;
+        bare = false;
+        s += strlen(anchornames[i].name);
+    }
+    else if (!*s)
+    {
+        goto bad;
+    }
+
+    // offsets, the sign carries over terms: "+1h30m"
+    int sign = 1;
+    bool any = false;
+    long long offset = 0;
+    while (*s)
+    {
+        if (*s == '+' || *s == '-')
+        {
+            sign = (*s++ == '-') ? -1 : 1;
+            while (isspace(*s))
+                s++;
+            if (!isdigit(*s))
+                goto bad;
+        }
+        else if (isspace(*s))
+        {
+            s++;
+            continue;
+        }
+        else if (!isdigit(*s) || (!any && !bare))
+        {
+            goto bad;   // a term needs a sign after an anchor
+        }
+
+        int n = number(&s);
+        int unit = 60;
+        switch (tolower(*s))
+        {
+            case 'd': unit = 60*60*24; s++; break;
+            case 'h': unit = 60*60;    s++; break;
+            case 'm': unit = 60;       s++; break;
+            case 's': unit = 1;        s++; break;
+        }
+        offset += sign * (long long)n * unit;
+        any = true;
+    }
+    if (bare && !any)
+        goto bad;
+    if (llabs(offset) > 60*60*24)
+    {
+        fprintf(stderr, "Time '%s' is more than a day from its anchor\n", str);
+        return false;
+    }
+    te->offset += (int)offset;
+    return true;
+
+bad:
+    fprintf(stderr, "Unknown time '%s'\n", str);
+    return false;
+}
@@ -0,0 +1,50 @@
+//
+//  timeexpr.h
+//
+//  Camera start/stop times, compiled once from strings like
+//  "sunset-30m", "civil_dusk+1h30m" or "20:30" into an anchor and an
+//  offset, so rescheduling is a table lookup and an add.
+//
+//  time     := anchor [offset...] | clock [offset...] | offset...
+//  anchor   := sunrise | noon | sunset | dawn | dusk
+//              | civil_dawn | civil_dusk | nautical_dawn | nautical_dusk
+//              | astronomical_dawn | astronomical_dusk
+//  clock    := HH:MM[:SS]      24h local time
+//  offset   := +|- term...     i.e. "+1h30m", "-1d"
+//  term     := number [d|h|m|s], minutes if no unit
+//
+//  Offsets are limited to a day either way, the schedule repeats daily.
+//
+//  A bare offset, "+6h", is from sunrise.
+//
+
+#ifndef TIMEEXPR_H
+  #define TIMEEXPR_H
+
+#include "sunspy.h"
+
+// sunrise/sunset are taken at civil twilight, the same as dawn/dusk.
+typedef enum
+{ ANCHOR_SUNRISE            = 0
+, ANCHOR_NOON               = 1
+, ANCHOR_SUNSET             = 2
+, ANCHOR_NAUTICAL_DAWN      = 3
+, ANCHOR_NAUTICAL_DUSK      = 4
+, ANCHOR_ASTRONOMICAL_DAWN  = 5
+, ANCHOR_ASTRONOMICAL_DUSK  = 6
+, ANCHOR_CLOCK              = 7     // offset is from local midnight
+, NUM_ANCHORS               = 8
+} TimeAnchor;
+
+typedef enum
+{ SUN_RISE = 0
+, SUN_NOON = 1
+, SUN_SET  = 2
+} SunEvent;
+
+bool timeexpr_parse(const char *str, timeexpr_t *te);
+const char *timeexpr_twilight(TimeAnchor anchor);
+SunEvent timeexpr_event(TimeAnchor anchor);
+const char *timeexpr_anchorname(TimeAnchor anchor);
+
+#endif
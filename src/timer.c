@@ -0,0 +1,154 @@
+//
+//  timer.c
+//
+//  Copyright (c) 2013 mike harrington. All rights reserved.
+//  Released to the public domain by Mike Harrington, September 2013
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sunspy.h"
+#include "timer.h"
+#include "metrics.h"
+
+static mstime_t msof(const struct timespec *ts)
+{
+    return (mstime_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+static mstime_t clockms(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return msof(&ts);
+}
+
+// Non-zero while simulating, stands in for the wall clock.
+static mstime_t virtualnow = 0;
+
+//
+// Wall clock time in milliseconds, or the simulated time.
+//
+mstime_t timer_now()
+{
+    if (virtualnow)
+        return virtualnow;
+    return clockms(CLOCK_REALTIME);
+}
+
+//
+// Runs the clock from 't' instead of the wall clock, 0 goes back to the
+// wall clock. The simulated clock only moves when told to.
+//
+void timer_setvirtual(mstime_t t)
+{
+    virtualnow = t;
+}
+
+bool timer_isvirtual()
+{
+    return virtualnow != 0;
+}
+
+//
+// Milliseconds from an arbitrary start, never jumps.
+//
+mstime_t timer_monotonic()
+{
+    return clockms(CLOCK_MONOTONIC);
+}
+
+//
+// Like ctime() but with milliseconds, "Sat Oct 17 19:01:00.250 2026\n".
+//
+char *timer_str(mstime_t t, char *dest)
+{
+    static __thread char szbuf[40];
+    if (dest == NULL) dest = szbuf;
+
+    time_t secs = (time_t)(t / 1000);
+    struct tm tmLocal;
+    localtime_r(&secs, &tmLocal);
+    char date[32];
+    strftime(date, sizeof(date), "%a %b %e %H:%M:%S", &tmLocal);
+    sprintf(dest, "%s.%03d %d\n", date, (int)(t % 1000), tmLocal.tm_year + 1900);
+    return dest;
+}
+
+// Monotonic time at startup, and how long after it the first event was
+// armed, -1 until then.
+static mstime_t started = 0;
+static volatile mstime_t firstarmed = -1;
+
+//
+// Marks the start of the process for timer_armed().
+//
+void timer_markstart()
+{
+    started = timer_monotonic();
+}
+
+//
+// Called whenever an event is armed, the first call records how long
+// startup took. True on that first call.
+//
+bool timer_markarmed()
+{
+    if (firstarmed >= 0)
+        return false;
+    return __sync_bool_compare_and_swap(&firstarmed, -1, timer_monotonic() - started);
+}
+
+//
+// Milliseconds from start to the first armed event, -1 if none yet.
+//
+mstime_t timer_armed()
+{
+    return firstarmed;
+}
+
+//
+// Bucket bound that covers the given fraction of h's events.
+//
+static const char *percentile(const histogram_t *h, unsigned long long count, double p, char *dest)
+{
+    unsigned long long want = (unsigned long long)(count * p + 0.999999), seen = 0;
+    for (unsigned b = 0; b <= METRICS_BUCKETS; b++)
+    {
+        seen += h->counts[b];
+        if (seen >= want)
+        {
+            if (b == METRICS_BUCKETS)
+                sprintf(dest, ">%lldms", h->bounds[b - 1] / 1000);
+            else
+                sprintf(dest, "<=%lldms", h->bounds[b] / 1000);
+            return dest;
+        }
+    }
+    return "-";
+}
+
+//
+// Startup time, and how late events went out from the lateness
+// metrics, see metrics_lateness().
+//
+void timer_report(FILE *f)
+{
+    if (firstarmed >= 0)
+        fprintf(f, "Startup: first event armed %lldms after start\n", firstarmed);
+
+    histogram_t late;
+    metrics_alllateness(&late);
+    unsigned long long count = 0;
+    for (unsigned b = 0; b <= METRICS_BUCKETS; b++)
+        count += late.counts[b];
+    if (count)
+    {
+        char p50[20], p99[20];
+        fprintf(f, "Dispatch lateness: %llu events, mean %llums, max %llums, p50 %s, p99 %s\n",
+                count, late.sum / count / 1000, late.max / 1000,
+                percentile(&late, count, 0.5, p50), percentile(&late, count, 0.99, p99));
+    }
+}
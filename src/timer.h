@@ -0,0 +1,30 @@
+//
+//  timer.h
+//
+//  Millisecond clocks, how long startup took to arm the first event and
+//  the report of how late events went out, from the lateness metrics.
+//  timer_now() can be swapped for a simulated clock to replay a schedule
+//  without waiting for it.
+//
+
+#ifndef TIMER_H
+  #define TIMER_H
+
+#include <stdio.h>
+#include "sunspy.h"
+
+#define TIMER_JUMP_MS  1000     // realtime vs monotonic drift that counts as a clock change
+
+mstime_t timer_now(void);
+mstime_t timer_monotonic(void);
+void timer_setvirtual(mstime_t t);
+bool timer_isvirtual(void);
+char *timer_str(mstime_t t, char *dest);
+
+void timer_markstart(void);
+bool timer_markarmed(void);
+mstime_t timer_armed(void);
+
+void timer_report(FILE *f);
+
+#endif